@@ -26,25 +26,122 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 
 int decode;
-int decode_config[CFG_WORDS];
+int num_decoders;
+int decoder_type[MAX_DECODERS];
+int decode_config[MAX_DECODERS][CFG_WORDS];
 int trigger_freq;
+bool trigger_rle;
+bool timestamps;
+int link_baud;
 int pins[TOTAL_PIN_NUM];
 const char *pin_names[TOTAL_PIN_NUM] = {
 	"A0", "A1", "A2", "A3", "A4", "A5",
 	"D2", "D3", "D4", "D5", "D6", "D7" };
-std::vector<uint16_t> samples;
+struct sample_store samples;
+bool record;
+size_t record_pre, record_post;
+bool record_rearm;
+int num_matches;
+struct record_match matches[MAX_MATCHES];
 
 const char *vcd_prefix = "";
+bool vcd_no_trigger;
+bool vcd_live;
+int vcd_threads;
 bool dont_cleanup_fwsrc;
+bool universal_firmware;
 bool verbose;
 
+static const char *vcd_file;
+static const char *fst_file;
+static const char *svf_file;
+static const char *log_file;
+static bool log_json;
+static const char *raw_file;
+static bool raw_binary;
+static bool timing;
+static double stage_start;
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + 1e-6 * tv.tv_usec;
+}
+
+// with -T the time of each stage and the peak memory so far are printed
+static void stage_done(const char *stage)
+{
+	double t = now();
+	if (timing) {
+		struct rusage ru;
+		getrusage(RUSAGE_SELF, &ru);
+		printf("Timing: %-8s %8.3f s %10.2f MS/s   peak RSS %8.1f MB\n", stage, t - stage_start,
+				1e-6 * samples.size() / (t - stage_start), ru.ru_maxrss / 1024.0);
+	}
+	stage_start = now();
+}
+
+// the files for window n of a re-armed flight recorder are name-n.ext
+static const char *window_file(const char *file, int window, std::string &buffer)
+{
+	if (file == NULL || window == 0)
+		return file;
+
+	const char *base = strrchr(file, '/');
+	const char *ext = strrchr(base ? base : file, '.');
+	size_t len = ext ? ext - file : strlen(file);
+
+	char num[16];
+	snprintf(num, sizeof(num), "-%d", window);
+	buffer = std::string(file, len) + num + (ext ? ext : "");
+	return buffer.c_str();
+}
+
+void writeoutputs(int window)
+{
+	std::string buffer;
+
+	stage_start = now();
+
+	if (raw_file) {
+		writerawfile(window_file(raw_file, window, buffer), raw_binary);
+		stage_done("raw");
+	}
+
+	if (vcd_live) {
+		writevcd_end();
+		vcd_live = false;
+	} else if (vcd_file) {
+		writevcd(window_file(vcd_file, window, buffer));
+		stage_done("vcd");
+	}
+
+	if (fst_file) {
+		writefst(window_file(fst_file, window, buffer));
+		stage_done("fst");
+	}
+
+	if (svf_file) {
+		writesvf(window_file(svf_file, window, buffer));
+		stage_done("svf");
+	}
+
+	if (log_file) {
+		writelog(window_file(log_file, window, buffer), log_json);
+		stage_done("log");
+	}
+}
+
 void help(const char *progname)
 {
-	fprintf(stderr, "Usage: %s [-v] [-p [-n]] [-P vcd_prefix] [-t <dev>] \\\n", progname);
-	fprintf(stderr, "     %*.s [-V vcd_file] [-R raw_file] \\\n", int(strlen(progname)+2), "");
-	fprintf(stderr, "     %*.s configfile [ raw_file ]\n", int(strlen(progname)+2), "");
+	fprintf(stderr, "Usage: %s [-v] [-p [-p] [-n]] [-u] [-r] [-P vcd_prefix] [-t <dev>] \\\n", progname);
+	fprintf(stderr, "     %*.s [-V vcd_file [-C] [-j threads] [-l]] [-F fst_file] [-S svf_file] [-L log_file [-J]] \\\n", int(strlen(progname)+2), "");
+	fprintf(stderr, "     %*.s [-R raw_file [-b]] [-T] { configfile [ raw_file ] | binary_raw_file }\n", int(strlen(progname)+2), "");
 	exit(1);
 }
 
@@ -52,21 +149,27 @@ int main(int argc, char **argv)
 {
 	int opt;
 	const char *ttydev = "/dev/ttyACM0";
-	bool programm_arduino = false;
-	const char *vcd_file = NULL;
-	const char *raw_file = NULL;
+	int programm_arduino = 0;
+	bool realtime = false;
+	bool live = false;
 
-	while ((opt = getopt(argc, argv, "vpnP:t:V:R:")) != -1) {
+	while ((opt = getopt(argc, argv, "vpnurP:t:V:Cj:lF:S:L:JR:bT")) != -1) {
 		switch (opt) {
 		case 'v':
 			verbose = true;
 			break;
 		case 'p':
-			programm_arduino = true;
+			programm_arduino++;
 			break;
 		case 'n':
 			dont_cleanup_fwsrc = true;
 			break;
+		case 'u':
+			universal_firmware = true;
+			break;
+		case 'r':
+			realtime = true;
+			break;
 		case 'P':
 			vcd_prefix = optarg;
 			break;
@@ -76,9 +179,36 @@ int main(int argc, char **argv)
 		case 'V':
 			vcd_file = optarg;
 			break;
+		case 'C':
+			vcd_no_trigger = true;
+			break;
+		case 'j':
+			vcd_threads = atoi(optarg);
+			break;
+		case 'l':
+			live = true;
+			break;
+		case 'F':
+			fst_file = optarg;
+			break;
+		case 'S':
+			svf_file = optarg;
+			break;
+		case 'L':
+			log_file = optarg;
+			break;
+		case 'J':
+			log_json = true;
+			break;
 		case 'R':
 			raw_file = optarg;
 			break;
+		case 'b':
+			raw_binary = true;
+			break;
+		case 'T':
+			timing = true;
+			break;
 		default:
 			help(argv[0]);
 		}
@@ -87,21 +217,48 @@ int main(int argc, char **argv)
 	if (optind != argc-2 && optind != argc-1)
 		help(argv[0]);
 
-	config(argv[optind]);
-
-	if (programm_arduino)
-		genfirmware(ttydev);
+	stage_start = now();
 
-	if (optind == argc-2)
-		readrawfile(argv[optind+1]);
+	if (optind == argc-1 && is_binary_rawfile(argv[optind]))
+	{
+		// binary raw files carry their own configuration
+		readrawfile(argv[optind], true);
+		stage_done("map");
+	}
 	else
-		readdata(ttydev, !programm_arduino);
+	{
+		config(argv[optind]);
+
+		if (programm_arduino)
+			genfirmware(ttydev, programm_arduino < 2);
 
-	if (raw_file)
-		writerawfile(raw_file);
+		if (live && record) {
+			fprintf(stderr, "The `-l' option can't be used with a record statement.\n");
+			exit(1);
+		}
 
-	if (vcd_file)
-		writevcd(vcd_file);
+		if (optind == argc-2) {
+			stage_start = now();
+			readrawfile(argv[optind+1], false);
+			stage_done("load");
+			if (record) {
+				recorder_init();
+				recorder_finish();
+				stage_done("record");
+			}
+		} else {
+			// in live mode the VCD file is written during the capture
+			vcd_live = live && vcd_file != NULL;
+			if (vcd_live)
+				writevcd_begin(vcd_file, true);
+			stage_start = now();
+			readdata(ttydev, programm_arduino == 0, realtime);
+			stage_done("capture");
+		}
+	}
 
+	// with rearm the windows are in the numbered output files
+	if (!record || recorder_windows() == 0)
+		writeoutputs(0);
 	return 0;
 }
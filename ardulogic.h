@@ -24,6 +24,8 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <string>
 #include <vector>
 
 #define PIN_A(__n) (__n)
@@ -45,40 +47,497 @@
 #define CFG_SPI_MSB	0
 #define CFG_SPI_CSNEG	1
 #define CFG_SPI_CS	2
+#define CFG_SPI_BITS	3	// word width (8, 16 or 32)
+#define CFG_SPI_CSMASK	4	// all chip select pins
+#define CFG_SPI_CSNEGMASK 5	// inverted chip select pins
+#define CFG_SPI_SCK	6	// SCK pin + 1
+#define CFG_SPI_SCKEDGE	7	// PIN_TRIGGER_POSEDGE or PIN_TRIGGER_NEGEDGE
+#define CFG_SPI_DATAMASK 8	// data pins (0 = all captured pins except CS)
+#define CFG_SPI_MOSI	9	// MOSI pin + 1
+#define CFG_SPI_MISO	10	// MISO pin + 1
 
 #define CFG_I2C_SCL	0
 #define CFG_I2C_SDA	1
+#define CFG_I2C_FILTER	2	// 4 words: bitmask of 7 bit addresses, all zero = no filter
 
 #define CFG_JTAG_TMS	0
 #define CFG_JTAG_TDI	1
 #define CFG_JTAG_TDO	2
+#define CFG_JTAG_TCK	3	// TCK pin + 1
 
-#define CFG_WORDS	3
+#define CFG_WORDS	11
+
+// Each configured decoder has its own row of config words. The decode
+// variable holds the type of the first decoder (or DECODE_TRIGGER/FREQ).
+#define MAX_DECODERS	4
+
+// The host sends PROBE_QUERY when it connects and the firmware answers
+// immediately with 8 zero bytes and "..ARDULOGIC?<protocol>:<id>:\r\n", where
+// <id> is the config_hash() of its configuration as 8 hex digits, or
+// "U<version>" for the universal firmware. The firmware sends the same after
+// a reset. PROBE_START starts the capture, the probe then sends the header
+// "..ARDULOGIC:<pins>:<freq>:[rle:][ts:]\r\n" followed by the samples. After
+// the end of the capture it waits for the next query.
+
+#define PROTOCOL_VERSION	3
+#define PROBE_QUERY		'?'
+#define PROBE_START		'S'
+
+// The serial link starts at LINK_SAFE_BAUD after a reset and after each
+// capture. Before the capture the host tries faster rates (see the link
+// statement): it sends LINK_BAUD with the UBRR0 value for the rate and its
+// complement, the firmware answers LINK_BAUD and switches UBRR0. At the new
+// rate the host sends LINK_TEST and the firmware answers with LINK_TEST_BYTES
+// bytes of LINK_TEST_BYTE(). When all of them are received correctly the
+// host sends LINK_KEEP and the firmware answers LINK_KEEP. Any other byte
+// instead of LINK_TEST or LINK_KEEP (the host sends LINK_ABORT) switches the
+// firmware back to the safe rate, and so does the host to try the next
+// slower rate.
+//
+// Timing: the firmware switches UBRR0 LINK_SWITCH_US after the last byte
+// at the old rate was written to the USART, long enough for it and the byte
+// in the shift register to leave at the slowest rate. So the host can
+// switch LINK_SWITCH_US after it has received the answer. The firmware
+// waits LINK_TIMEOUT_MS for LINK_TEST and LINK_KEEP and then switches back
+// by itself, so after a lost LINK_ABORT the probe is at the safe rate
+// again at the latest LINK_TIMEOUT_MS + LINK_SWITCH_US after the host sent
+// it.
+
+#define LINK_BAUD		'B'
+#define LINK_TEST		'T'
+#define LINK_KEEP		'K'
+#define LINK_ABORT		'A'
+#define LINK_SAFE_BAUD		115200
+#define LINK_MAX_BAUD		2000000
+#define LINK_TEST_BYTES		256
+#define LINK_TIMEOUT_MS		100
+
+// the time of a byte (10 bits) and of the switch to a new rate in us
+#define LINK_BYTE_US(baud)	((10 * 1000000 + (baud) - 1) / (baud))
+#define LINK_SWITCH_US		(4 * LINK_BYTE_US(LINK_SAFE_BAUD))
+
+// USART0 in double speed mode (U2X0) at 16 MHz, rounded to the nearest rate
+#define LINK_UBRR(baud)		((LINK_MAX_BAUD + (baud)/2) / (baud) - 1)
+
+// the bytes of the test burst (an arithmetic sequence covering all values)
+#define LINK_TEST_BYTE(i)	((uint8_t)((i) * 0x9d + 0x35))
+
+// The universal firmware (-u) is the same for all configurations. Instead
+// of PROBE_START it gets a configuration frame: 'C', the number of bytes n,
+// the UCFG_* bytes followed by the header of the configuration (sent back
+// by the probe before the samples), and the sum of the n bytes.
+
+#define UNIVERSAL_VERSION	1
+#define UNIVERSAL_FRAME_MAX	96
+
+#define UCFG_MODE	0	// UMODE_*
+#define UCFG_FLAGS	1	// UFLAG_*
+#define UCFG_CAPC	2	// captured pins of port C and D
+#define UCFG_CAPD	3
+#define UCFG_PULLUPC	4
+#define UCFG_PULLUPD	5
+#define UCFG_POSC	6	// edge trigger pins of port C and D
+#define UCFG_NEGC	7
+#define UCFG_POSD	8
+#define UCFG_NEGD	9
+#define UCFG_EICRA	10
+#define UCFG_EIMSK	11
+#define UCFG_TCCR1B	12
+#define UCFG_OCR1AH	13
+#define UCFG_OCR1AL	14
+#define UCFG_SIZE	15
+
+#define UMODE_FREQ	0	// free running trigger (Timer1 compare match)
+#define UMODE_IRQ	1	// edge triggers on D2/D3 (INT0/INT1)
+#define UMODE_POLL	2	// edge triggers on other pins (polled)
+
+#define UFLAG_RLE	0x01
+#define UFLAG_TS	0x02
+
+// The captured samples are stored in blocks of SAMPLE_BLOCK samples. Each
+// block is a list of varint encoded records, each record holding the pins
+// that changed (xor to the previous value) and the number of repetitions.
+// Alternatively the store can point to a read-only mapping of the sample
+// data in a binary raw file. Blocks at the start can be dropped, the
+// remaining samples keep their indices (first_block is the first kept).
+// With timestamps (see the timestamp statement) the time of each sample in
+// ns is kept in the times array, starting with the first kept sample.
+
+#define SAMPLE_BLOCK 4096
+
+struct sample_store;
+
+// A cursor walks the samples sequentially, one run of identical samples at a
+// time. run_end is the index of the first sample after the current run.
+struct sample_cursor
+{
+	const struct sample_store *store;
+	size_t idx, run_start, run_end;
+	uint16_t value;
+	size_t pos;
+	bool pending;
+
+	sample_cursor(const struct sample_store &s, size_t i = 0);
+	void seek(size_t i);
+	bool load();
+
+	bool valid() const {
+		return idx < run_end;
+	}
+	bool next() {
+		return ++idx < run_end || load();
+	}
+	bool next_run() {
+		idx = run_end;
+		return load();
+	}
+};
+
+struct sample_store
+{
+	std::vector<uint8_t> packed;
+	std::vector<size_t> block_offset;
+	size_t count;
+	uint16_t last_value;
+	uint16_t run_value;
+	size_t run_len;
+	size_t first_block;
+
+	bool timed;
+	std::vector<uint64_t> times;
+
+	const uint16_t *mapped;
+	const uint64_t *mapped_times;
+	size_t mapped_size;
+
+	sample_store();
+	void clear();
+	void forget() const;
+	void drop(size_t n);
+	void swap(struct sample_store &other);
+	void flush_run();
+	void decode_block(size_t block, uint16_t *out) const;
+	uint16_t lookup(size_t i) const;
+
+	size_t size() const {
+		return mapped ? mapped_size : count;
+	}
+	uint16_t operator[](size_t i) const {
+		if (i >= size())
+			return 0;
+		return mapped ? mapped[i] : lookup(i);
+	}
+	uint64_t time(size_t i) const {
+		return mapped ? mapped_times[i] : times[i - first_block * SAMPLE_BLOCK];
+	}
+	void push_back(uint16_t v) {
+		if (count % SAMPLE_BLOCK == 0) {
+			flush_run();
+			block_offset.push_back(packed.size());
+			last_value = 0;
+		}
+		if (run_len == 0 || v != run_value) {
+			flush_run();
+			run_value = v;
+		}
+		run_len++;
+		count++;
+	}
+	void push_back(uint16_t v, uint64_t t) {
+		timed = true;
+		times.push_back(t);
+		push_back(v);
+	}
+	void append(const uint16_t *p, size_t n) {
+		for (size_t i = 0; i < n; i++)
+			push_back(p[i]);
+	}
+	void append(const uint16_t *p, const uint64_t *t, size_t n) {
+		for (size_t i = 0; i < n; i++)
+			push_back(p[i], t[i]);
+	}
+	void map(const uint16_t *p, size_t n, const uint64_t *t = NULL) {
+		clear();
+		mapped = p;
+		mapped_times = t;
+		mapped_size = n;
+		timed = t != NULL;
+	}
+	size_t memory_usage() const {
+		return packed.capacity() + block_offset.capacity() * sizeof(size_t) +
+				times.capacity() * sizeof(uint64_t);
+	}
+};
+
+// The flight recorder keeps record_pre samples before and record_post
+// samples after the first sample matching one of the match statements.
+// Pin patterns match when the pins change to the given levels, edge
+// sequences when the edges happen in order without other edges on these
+// pins in between and data matches a word decoded by any decoder.
+
+#define MATCH_PINS	1
+#define MATCH_EDGES	2
+#define MATCH_DATA	3
+
+#define MAX_MATCHES	8
+#define MAX_MATCH_EDGES	8
+
+struct record_match {
+	int type;
+	uint16_t mask, value;
+	int num_edges;
+	int edge_pin[MAX_MATCH_EDGES];
+	int edge_dir[MAX_MATCH_EDGES];	// PIN_TRIGGER_POSEDGE or PIN_TRIGGER_NEGEDGE
+	uint64_t data;
+};
 
 extern int decode;
-extern int decode_config[CFG_WORDS];
+extern int num_decoders;
+extern int decoder_type[MAX_DECODERS];
+extern int decode_config[MAX_DECODERS][CFG_WORDS];
 extern int trigger_freq;
+extern bool trigger_rle;
+extern bool timestamps;
+extern int link_baud;
 extern int pins[TOTAL_PIN_NUM];
 extern const char *pin_names[TOTAL_PIN_NUM];
-extern std::vector<uint16_t> samples;
+extern struct sample_store samples;
+extern bool record;
+extern size_t record_pre, record_post;
+extern bool record_rearm;
+extern int num_matches;
+extern struct record_match matches[MAX_MATCHES];
 
 void config(const char *file);
-void genfirmware(const char *tts);
-void readdata(const char *tts, bool autoprog);
+void genfirmware(const char *tts, bool check_probe);
+int universal_frame(uint8_t *frame, const char *header, int header_len);
+int config_header(char *header, int &hdrlen);
+uint32_t config_hash();
+bool probe_matches(const char *tts);
+void readdata(const char *tts, bool autoprog, bool realtime);
+void recorder_init();
+bool recorder_update();
+void recorder_finish();
+int recorder_windows();
+void writeoutputs(int window);
 void writevcd(const char *file);
-void writerawfile(const char *file);
-void readrawfile(const char *file);
+void writevcd_begin(const char *file, bool live);
+void writevcd_update();
+void writevcd_end();
+void writefst(const char *file);
+void writesvf(const char *file);
+void writelog(const char *file, bool json);
+void writerawfile(const char *file, bool binary);
+void readrawfile(const char *file, bool load_config);
+bool is_binary_rawfile(const char *file);
+
+struct unpacker {
+	int num_bits;
+	uint16_t capture_mask;
+	uint64_t carry;
+	int carry_len;
+	uint8_t hold[2];
+	int hold_len;
+	bool rle;
+	uint16_t last;
+	uint64_t ticks, *tout;
+	uint16_t tcnt;
+	uint16_t lut[1 << TOTAL_PIN_NUM];
+	size_t (*kernel)(struct unpacker *u, const uint8_t *data, size_t len, uint16_t *out);
+};
+
+void unpack_init(struct unpacker *u, uint16_t capture_mask);
+void unpack_init_rle(struct unpacker *u, uint16_t capture_mask);
+void unpack_init_ts(struct unpacker *u, uint16_t capture_mask);
+void unpack_reset(struct unpacker *u);
+size_t unpack_maxwords(struct unpacker *u, size_t len);
+size_t unpack_data(struct unpacker *u, const uint8_t *data, size_t len, uint16_t *out);
+int unpack_finish(struct unpacker *u, uint16_t *out);
 
 extern const char *vcd_prefix;
+extern bool vcd_no_trigger;
+extern bool vcd_live;
+extern int vcd_threads;
 extern bool dont_cleanup_fwsrc;
+extern bool universal_firmware;
 extern bool verbose;
 
+// Buffered VCD output. Data is written to the file when the buffer is full
+// (or collected in memory when there is no file).
+
+#define VCD_BUFSIZE (1 << 20)
+
+struct vcd_writer {
+	FILE *f;
+	std::vector<char> buf;
+	size_t len;
+};
+
+extern char vcd_bits_table[256][8];
+
+void vcd_open(struct vcd_writer *w, FILE *f);
+void vcd_grow(struct vcd_writer *w, size_t n);
+void vcd_flush(struct vcd_writer *w);
+uint64_t vcd_time(size_t i, int third);
+void vcd_printf(struct vcd_writer *w, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+std::string vcd_ident(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static inline char *vcd_space(struct vcd_writer *w, size_t n)
+{
+	if (w->len + n > w->buf.size())
+		vcd_grow(w, n);
+	return &w->buf[w->len];
+}
+
+static inline void vcd_char(struct vcd_writer *w, char ch)
+{
+	*vcd_space(w, 1) = ch;
+	w->len++;
+}
+
+static inline void vcd_str(struct vcd_writer *w, const std::string &str)
+{
+	memcpy(vcd_space(w, str.size()), str.data(), str.size());
+	w->len += str.size();
+}
+
+static inline void vcd_num(struct vcd_writer *w, uint64_t num)
+{
+	char tmp[20], *p = tmp + sizeof(tmp);
+	do *(--p) = '0' + num % 10; while ((num /= 10) != 0);
+	size_t n = tmp + sizeof(tmp) - p;
+	memcpy(vcd_space(w, n), p, n);
+	w->len += n;
+}
+
+// write " b<value>", MSB first
+static inline void vcd_bits(struct vcd_writer *w, uint64_t value, int width)
+{
+	char *p = vcd_space(w, width + 2);
+	*(p++) = ' ';
+	*(p++) = 'b';
+	for (; width % 8 != 0; width--)
+		*(p++) = '0' + ((value >> (width-1)) & 1);
+	for (; width > 0; width -= 8, p += 8)
+		memcpy(p, vcd_bits_table[(value >> (width-8)) & 0xff], 8);
+	w->len = p - &w->buf[0];
+}
+
+// Decoders declare a list of signals and turn a range of samples into a
+// list of events. An event sets a decoder signal to a new value at the given
+// sample index. The event kind tells output backends what the value means.
+
+#define EV_VALUE	0	// counter or other helper value
+#define EV_DATA		1	// decoded data word
+#define EV_STATE	2	// protocol state (start/stop condition, TAP state, ..)
+#define EV_IDLE		3	// no value, the bus is idle
+
+struct decode_signal {
+	std::string name;
+	std::string id;
+	int width;
+	const char *const *names;
+};
+
+// Values wider than 64 bits are stored as '0'/'1' characters (MSB first) in
+// the bits array of the batch. For such events width is the number of bits
+// and value the offset in bits, otherwise width is zero.
+struct decode_event {
+	size_t idx;
+	int sig;
+	int kind;
+	int width;
+	uint64_t value;
+};
+
+struct decode_batch {
+	std::vector<decode_event> events;
+	std::vector<char> bits;
+};
+
+// A bus transaction for the log output (see writelog.cc). The data words
+// are hex numbers separated by spaces, tx is the data sent by the master
+// (MOSI, I2C write, TDI) and rx the data received (MISO, I2C read, TDO).
+// addr_idx is the sample of the last address word (0 if none).
+struct log_record {
+	size_t idx, addr_idx;
+	bool open, reading;
+	std::string addr, tx, rx, ack, state;
+	log_record() : idx(0), addr_idx(0), open(false), reading(false) { }
+};
+
+// The decoder state is kept in a struct of state_size bytes. init() sets up
+// the state for the given config words, declares the signals and adds their
+// initial values as events for sample 0. live is set when the output is
+// written during the capture and the samples so far are only the start.
+// decode() processes the samples begin..end-1 (begin > 0) and is called for
+// consecutive ranges. skip() (if set) does the same without events, it
+// is used to get the state at the start of a range of samples that is
+// decoded elsewhere. copy() (if set) copies the state to uninitialized
+// memory, without it the state is copied bytewise. done() (if set) frees
+// what init() or copy() has allocated.
+// log() (if set) collects the events of the decoder (in order, with the
+// decoders own signal numbers) in rec and adds complete transactions to done.
 struct decoder_desc {
-	void (*vcd_defs)(FILE *f);
-	void (*vcd_init)(FILE *f);
-	void (*vcd_step)(FILE *f, size_t i);
+	const char *name;
+	size_t state_size;
+	void (*init)(void *state, const int *cfg, bool live, std::vector<decode_signal> &signals, struct decode_batch &out);
+	void (*decode)(void *state, size_t begin, size_t end, struct decode_batch &out);
+	void (*skip)(void *state, size_t begin, size_t end);
+	void (*copy)(void *state, const void *from);
+	void (*done)(void *state);
+	void (*log)(void *state, const struct decode_batch &batch, const struct decode_event &ev,
+			struct log_record &rec, std::vector<log_record> &done);
+};
+
+// a captured pin that triggers on both edges
+static inline bool is_clock_pin(int pin)
+{
+	int flags = PIN_CAPTURE | PIN_TRIGGER_POSEDGE | PIN_TRIGGER_NEGEDGE;
+	return (pins[pin] & flags) == flags;
+}
+
+static inline void add_event(struct decode_batch &out, size_t idx, int sig, int kind, uint64_t value)
+{
+	struct decode_event ev = { idx, sig, kind, 0, value };
+	out.events.push_back(ev);
+}
+
+// append a data word as hex number to a list of words
+static inline void log_word(std::string &str, uint64_t value, int width)
+{
+	char buffer[20];
+	snprintf(buffer, sizeof(buffer), "%s%0*llx", str.empty() ? "" : " ", (width + 3) / 4, (unsigned long long)value);
+	str += buffer;
+}
+
+static inline void add_event_bits(struct decode_batch &out, size_t idx, int sig, int kind, const char *bits, int width)
+{
+	struct decode_event ev = { idx, sig, kind, width, out.bits.size() };
+	out.events.push_back(ev);
+	out.bits.insert(out.bits.end(), bits, bits + width);
+}
+
+// The set of all configured decoders (see decode.cc)
+struct decoder_instance {
+	struct decoder_desc *desc;
+	std::vector<char> state;
+	std::string label;
+	size_t first_signal, num_signals;
+};
+
+struct decoder_set {
+	std::vector<decoder_instance> decoders;
+	std::vector<decode_signal> signals;
+	std::vector<decode_batch> tmp;
 };
 
+void decoders_init(struct decoder_set *ds, struct decode_batch &out, bool live = false);
+void decoders_decode(struct decoder_set *ds, size_t begin, size_t end, struct decode_batch &out);
+void decoders_skip(struct decoder_set *ds, size_t begin, size_t end);
+void decoders_copy(struct decoder_set *ds, const struct decoder_set *from);
+void decoders_done(struct decoder_set *ds);
+
 extern struct decoder_desc decoder_spi;
 extern struct decoder_desc decoder_i2c;
 extern struct decoder_desc decoder_jtag;
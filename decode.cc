@@ -0,0 +1,156 @@
+/*
+ *  ArduLogic - Low Speed Logic Analyzer using the Arduino Hardware
+ *
+ *  Copyright (C) 2011  Clifford Wolf <clifford@clifford.at>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "ardulogic.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// All configured decoders run over the same range of samples and their
+// events are merged into one batch, ordered by sample index. The signals
+// of all decoders are numbered consecutively.
+
+static struct decoder_desc *decoder_by_type(int type)
+{
+	if (type == DECODE_SPI)
+		return &decoder_spi;
+	if (type == DECODE_I2C)
+		return &decoder_i2c;
+	if (type == DECODE_JTAG)
+		return &decoder_jtag;
+	fprintf(stderr, "Unknown decoder type %d.\n", type);
+	exit(1);
+}
+
+static void merge_batches(struct decoder_set *ds, struct decode_batch &out)
+{
+	size_t n = ds->decoders.size();
+	std::vector<size_t> pos(n), bits_offset(n);
+
+	for (size_t k = 0; k < n; k++) {
+		bits_offset[k] = out.bits.size();
+		out.bits.insert(out.bits.end(), ds->tmp[k].bits.begin(), ds->tmp[k].bits.end());
+	}
+
+	while (1) {
+		int best = -1;
+		for (size_t k = 0; k < n; k++)
+			if (pos[k] < ds->tmp[k].events.size() && (best < 0 ||
+					ds->tmp[k].events[pos[k]].idx < ds->tmp[best].events[pos[best]].idx))
+				best = k;
+		if (best < 0)
+			break;
+		struct decode_event ev = ds->tmp[best].events[pos[best]++];
+		ev.sig += ds->decoders[best].first_signal;
+		if (ev.width > 0)
+			ev.value += bits_offset[best];
+		out.events.push_back(ev);
+	}
+
+	for (size_t k = 0; k < n; k++)
+		ds->tmp[k] = decode_batch();
+}
+
+void decoders_init(struct decoder_set *ds, struct decode_batch &out, bool live)
+{
+	int count[DECODE_JTAG+1] = { /* zeros */ };
+	for (int k = 0; k < num_decoders; k++)
+		count[decoder_type[k]]++;
+
+	ds->decoders.resize(num_decoders);
+	ds->tmp.resize(num_decoders);
+	ds->signals.clear();
+
+	for (int k = 0, idx[DECODE_JTAG+1] = { /* zeros */ }; k < num_decoders; k++) {
+		struct decoder_instance &d = ds->decoders[k];
+		d.desc = decoder_by_type(decoder_type[k]);
+		d.state.resize(d.desc->state_size);
+		d.label = d.desc->name;
+		if (count[decoder_type[k]] > 1) {
+			char buffer[16];
+			snprintf(buffer, sizeof(buffer), "%d", idx[decoder_type[k]]++);
+			d.label += buffer;
+		}
+		d.first_signal = ds->signals.size();
+		d.desc->init(d.state.data(), decode_config[k], live, ds->signals, num_decoders > 1 ? ds->tmp[k] : out);
+		d.num_signals = ds->signals.size() - d.first_signal;
+	}
+
+	if (num_decoders > 1)
+		merge_batches(ds, out);
+}
+
+void decoders_decode(struct decoder_set *ds, size_t begin, size_t end, struct decode_batch &out)
+{
+	if (ds->decoders.size() == 1) {
+		ds->decoders[0].desc->decode(ds->decoders[0].state.data(), begin, end, out);
+		return;
+	}
+
+	for (size_t k = 0; k < ds->decoders.size(); k++)
+		ds->decoders[k].desc->decode(ds->decoders[k].state.data(), begin, end, ds->tmp[k]);
+	merge_batches(ds, out);
+}
+
+void decoders_skip(struct decoder_set *ds, size_t begin, size_t end)
+{
+	struct decode_batch scratch;
+	for (size_t k = 0; k < ds->decoders.size(); k++) {
+		struct decoder_instance &d = ds->decoders[k];
+		if (d.desc->skip)
+			d.desc->skip(d.state.data(), begin, end);
+		else {
+			d.desc->decode(d.state.data(), begin, end, scratch);
+			scratch.events.clear();
+			scratch.bits.clear();
+		}
+	}
+}
+
+// A snapshot of the decoder states, e.g. for decoding a range of samples
+// in another thread. The signals are not copied.
+void decoders_copy(struct decoder_set *ds, const struct decoder_set *from)
+{
+	ds->decoders.resize(from->decoders.size());
+	ds->tmp.resize(from->tmp.size());
+	for (size_t k = 0; k < from->decoders.size(); k++) {
+		struct decoder_instance &d = ds->decoders[k];
+		const struct decoder_instance &f = from->decoders[k];
+		d.desc = f.desc;
+		d.label = f.label;
+		d.first_signal = f.first_signal;
+		d.num_signals = f.num_signals;
+		d.state.resize(f.state.size());
+		if (d.desc->copy)
+			d.desc->copy(d.state.data(), f.state.data());
+		else
+			memcpy(d.state.data(), f.state.data(), f.state.size());
+	}
+}
+
+void decoders_done(struct decoder_set *ds)
+{
+	for (size_t k = 0; k < ds->decoders.size(); k++)
+		if (ds->decoders[k].desc->done)
+			ds->decoders[k].desc->done(ds->decoders[k].state.data());
+	ds->decoders.clear();
+}
@@ -26,131 +26,169 @@
 #include <string.h>
 #include <errno.h>
 
-static uint8_t bitstate;
-static uint8_t bitcount;
-static uint8_t wordcount;
-static size_t proc_ptr;
+// Single pass I2C decoder. The probe takes a sample on every SCL or SDA edge,
+// so only the first sample of each run of identical samples has to be looked
+// at. START and STOP are SDA edges while SCL is high, data bits are sampled
+// on the rising SCL edge. The STATE signal shows 'S' (start), 'P' (stop),
+// 'A' (address bit), 'R'/'W' (read/write bit), 'D' (data bit) and
+// 'K'/'N' (ACK/NACK).
+
+struct i2c_state {
+	int cfg[CFG_WORDS];
+	bool scl, sda;
+	bool active;
+	int bitstate;
+	uint8_t shift;
+	uint8_t wordcount;
+};
 
-static void decoder_i2c_vcd_defs(FILE *f)
-{
-	fprintf(f, "$var reg 8 %ss %sSTATE $end\n", vcd_prefix, vcd_prefix);
-	fprintf(f, "$var reg 8 %sd %sDATA $end\n", vcd_prefix, vcd_prefix);
-	fprintf(f, "$var reg 8 %sb %sBITCOUNT $end\n", vcd_prefix, vcd_prefix);
-	fprintf(f, "$var reg 8 %sw %sWORDCOUNT $end\n", vcd_prefix, vcd_prefix);
-}
+enum { SIG_STATE, SIG_DATA, SIG_BITCOUNT, SIG_WORDCOUNT, SIG_ADDR };
 
-static void decoder_i2c_vcd_init(FILE *f)
+static bool have_filter(const struct i2c_state *st)
 {
-	fprintf(f, " bzzzzzzzz %ss", vcd_prefix);
-	fprintf(f, " bzzzzzzzz %sd", vcd_prefix);
-	fprintf(f, " bzzzzzzzz %sb", vcd_prefix);
-	fprintf(f, " bzzzzzzzz %sw", vcd_prefix);
-	bitstate = 0;
-	bitcount = 0;
-	wordcount = 0;
-	proc_ptr = 0;
+	for (int i = 0; i < 4; i++)
+		if (st->cfg[CFG_I2C_FILTER + i] != 0)
+			return true;
+	return false;
 }
 
-static void bytef(FILE *f, uint8_t byte)
+static bool match_filter(const struct i2c_state *st, int addr)
 {
-	for (int i = 7; i >= 0; i--)
-		fprintf(f, "%d", (byte & (1 << i)) != 0);
+	return (st->cfg[CFG_I2C_FILTER + addr / 32] & (1u << (addr % 32))) != 0;
 }
 
-static bool get_scl(size_t idx)
+static void decoder_i2c_init(void *state, const int *cfg, bool, std::vector<decode_signal> &signals, struct decode_batch &out)
 {
-	return (samples[idx] & (1 << decode_config[CFG_I2C_SCL])) != 0;
-}
+	struct i2c_state *st = (struct i2c_state*)state;
+	memcpy(st->cfg, cfg, sizeof(st->cfg));
+	static const char *const names[5] = { "STATE", "DATA", "BITCOUNT", "WORDCOUNT", "ADDR" };
+	static const char *const ids[5] = { "s", "d", "b", "w", "a" };
+
+	for (int k = 0; k < 5; k++) {
+		struct decode_signal sig = { names[k], ids[k], 8, NULL };
+		signals.push_back(sig);
+		add_event(out, 0, k, EV_IDLE, 0);
+	}
 
-static bool get_sda(size_t idx)
-{
-	return (samples[idx] & (1 << decode_config[CFG_I2C_SDA])) != 0;
+	uint16_t first = samples.size() > 0 ? samples[0] : 0xffff;
+	st->scl = (first & (1 << st->cfg[CFG_I2C_SCL])) != 0;
+	st->sda = (first & (1 << st->cfg[CFG_I2C_SDA])) != 0;
+	st->active = false;
+	st->bitstate = -1;
+	st->shift = 0;
+	st->wordcount = 0;
 }
 
-static void decoder_i2c_vcd_step(FILE *f, size_t i)
+static void decoder_i2c_bit(struct i2c_state *st, struct decode_batch &out, size_t i, bool bit)
 {
-	if (i < proc_ptr)
-		return;
+	int pos = st->bitstate++ % 9;
 
-	bool scl = get_scl(i);
-	bool sda = get_sda(i);
+	if (pos == 8) {
+		if (st->active)
+			add_event(out, i, SIG_STATE, EV_STATE, bit ? 'N' : 'K');
+		return;
+	}
 
-	if (scl == true)
-	{
-		bool sda_high = false, sda_low = false;
-		for (proc_ptr = i; proc_ptr < samples.size() && get_scl(proc_ptr); proc_ptr++)
-		{
-			if (get_sda(proc_ptr))
-				sda_high = true;
-			else
-				sda_low = true;
-
-			// start/restart condition
-			if (sda && sda_high && sda_low) {
-				fprintf(f, " b");
-				bytef(f, 'S');
-				fprintf(f, " %ss", vcd_prefix);
-				bitstate = 0;
-				return;
-			}
-
-			// stop condition
-			if (!sda && sda_high && sda_low) {
-				fprintf(f, " b");
-				bytef(f, 'P');
-				fprintf(f, " %ss", vcd_prefix);
-				return;
-			}
+	st->shift = (st->shift << 1) | bit;
+	if (pos == 7 && st->wordcount == 0 && have_filter(st))
+		st->active = match_filter(st, st->shift >> 1);
+
+	if (st->active) {
+		add_event(out, i, SIG_BITCOUNT, EV_VALUE, pos);
+		if (pos == 7) {
+			if (st->wordcount == 0)
+				add_event(out, i, SIG_ADDR, EV_DATA, st->shift >> 1);
+			add_event(out, i, SIG_DATA, EV_DATA, st->shift);
+			add_event(out, i, SIG_WORDCOUNT, EV_VALUE, st->wordcount);
 		}
 
-		if (i == 0 || get_scl(i-1))
-			return;
-
-		while (proc_ptr+1 < samples.size() && get_scl(proc_ptr+1) == false)
-			proc_ptr++;
+		if (st->wordcount != 0)
+			add_event(out, i, SIG_STATE, EV_STATE, 'D');
+		else if (pos < 7)
+			add_event(out, i, SIG_STATE, EV_STATE, 'A');
+		else
+			add_event(out, i, SIG_STATE, EV_STATE, bit ? 'R' : 'W');
+	}
 
-		if (bitstate % 9 == 0)
-		{
-			uint8_t data = 0;
-			for (size_t j = i, k = 0; k < 8 && j < samples.size(); j++)
-				if (j > 0 && get_scl(j-1) == false && get_scl(j) == true)
-					data = (data << 1) | get_sda(j), k++;
+	if (pos == 7)
+		st->wordcount++;
+}
 
-			fprintf(f, " b");
-			bytef(f, data);
-			fprintf(f, " %sd", vcd_prefix);
+static void decoder_i2c_decode(void *state, size_t begin, size_t end, struct decode_batch &out)
+{
+	struct i2c_state *st = (struct i2c_state*)state;
 
-			fprintf(f, " b");
-			bytef(f, wordcount++);
-			fprintf(f, " %sw", vcd_prefix);
-			bitcount = 0;
+	for (sample_cursor cursor(samples, begin); cursor.valid() && cursor.idx < end; cursor.next_run())
+	{
+		size_t i = cursor.idx;
+		bool scl = (cursor.value & (1 << st->cfg[CFG_I2C_SCL])) != 0;
+		bool sda = (cursor.value & (1 << st->cfg[CFG_I2C_SDA])) != 0;
+
+		if (st->scl && scl && st->sda && !sda) {
+			st->active = !have_filter(st);
+			st->bitstate = 0;
+			st->wordcount = 0;
+			if (st->active)
+				add_event(out, i, SIG_STATE, EV_STATE, 'S');
 		}
-
-		if (bitstate % 9 != 8)
-		{
-			fprintf(f, " b");
-			bytef(f, bitcount++);
-			fprintf(f, " %sb", vcd_prefix);
+		else if (st->scl && scl && !st->sda && sda) {
+			if (st->active)
+				add_event(out, i, SIG_STATE, EV_STATE, 'P');
+			st->active = false;
+			st->bitstate = -1;
 		}
+		else if (!st->scl && scl && st->bitstate >= 0)
+			decoder_i2c_bit(st, out, i, sda);
 
-		// Just a data bit
-		fprintf(f, " b");
-		if (bitstate < 7)
-			bytef(f, 'A');
-		else if (bitstate == 7)
-			bytef(f, 'R');
-		else if (bitstate % 9 == 8)
-			bytef(f, 'C');
-		else
-			bytef(f, 'D');
-		fprintf(f, " %ss", vcd_prefix);
-		bitstate++;
+		st->scl = scl;
+		st->sda = sda;
+	}
+}
+
+// A transaction lasts from START (or the matching address with a filter) to
+// STOP, so a register read with a repeated START is one transaction. The
+// first address byte is the address of the transaction. An address byte is
+// also a DATA event at the sample of its ADDR event (which comes first), it
+// is not logged as data.
+static void decoder_i2c_log(void*, const struct decode_batch&, const struct decode_event &ev,
+		struct log_record &rec, std::vector<log_record> &done)
+{
+	if (ev.kind == EV_IDLE)
+		return;
+
+	if (ev.sig == SIG_STATE && ev.value == 'P') {
+		if (rec.open)
+			done.push_back(rec);
+		rec = log_record();
+		return;
+	}
+
+	if (!rec.open) {
+		rec.idx = ev.idx;
+		rec.open = true;
+	}
+
+	if (ev.sig == SIG_ADDR) {
+		if (rec.addr.empty())
+			log_word(rec.addr, ev.value, 8);
+		rec.addr_idx = ev.idx;
 	}
+	if (ev.sig == SIG_DATA && ev.idx != rec.addr_idx)
+		log_word(rec.reading ? rec.rx : rec.tx, ev.value, 8);
+	if (ev.sig == SIG_STATE && (ev.value == 'R' || ev.value == 'W'))
+		rec.reading = ev.value == 'R';
+	if (ev.sig == SIG_STATE && (ev.value == 'K' || ev.value == 'N'))
+		rec.ack += char(ev.value);
 }
 
 struct decoder_desc decoder_i2c = {
-	&decoder_i2c_vcd_defs,
-	&decoder_i2c_vcd_init,
-	&decoder_i2c_vcd_step
+	"i2c",
+	sizeof(struct i2c_state),
+	&decoder_i2c_init,
+	&decoder_i2c_decode,
+	NULL,
+	NULL,
+	NULL,
+	&decoder_i2c_log
 };
 
@@ -26,6 +26,11 @@
 #include <string.h>
 #include <errno.h>
 
+#include <algorithm>
+
+#define SVF_CHUNK (1 << 16)
+#define JTAG_LIVE_WIDTH 256
+
 struct tap_state_desc {
 	char name[12];
 	int next[2];
@@ -55,41 +60,325 @@ static struct tap_state_desc tap_states[] = {
 	/* 20 */ { "UNKNOWN 5",  { 16,  0 } }
 };
 
-static int state_idx;
+static const char *const tap_names[] = {
+	"RESET", "IDLE", "SELECT DR", "CAPTURE DR", "SHIFT DR", "EXIT1 DR",
+	"PAUSE DR", "EXIT2 DR", "UPDATE DR", "SELECT IR", "CAPTURE IR",
+	"SHIFT IR", "EXIT1 IR", "PAUSE IR", "EXIT2 IR", "UPDATE IR",
+	"UNKNOWN 1", "UNKNOWN 2", "UNKNOWN 3", "UNKNOWN 4", "UNKNOWN 5"
+};
+
+#define TAP_RESET	0
+#define TAP_IDLE	1
+#define TAP_SHIFT_DR	4
+#define TAP_UPDATE_DR	8
+#define TAP_SHIFT_IR	11
+#define TAP_UPDATE_IR	15
+#define TAP_UNKNOWN	16
+
+// The TDI and TDO bits shifted in SHIFT-DR and SHIFT-IR are collected and
+// reported as one value per scan in UPDATE-DR or UPDATE-IR (or RESET), so a
+// scan that goes through PAUSE-DR or PAUSE-IR is still one scan. The TAP
+// state is only reported when it changes. When TCK is captured on both edges
+// (because other decoders trigger samples too) only the TCK posedges are used.
+
+struct jtag_state {
+	int cfg[CFG_WORDS];
+	int tck_pin;
+	bool last_tck;
+	int state_idx;
+	uint32_t idle_cycles;
+	int scan_state;
+	size_t scan_len, max_ir, max_dr;
+	std::vector<char> *tdi, *tdo;
+};
+
+enum { SIG_TAPID, SIG_TAP, SIG_IR_TDI, SIG_IR_TDO, SIG_DR_TDI, SIG_DR_TDO, SIG_RUNTEST };
 
-static void decoder_jtag_vcd_defs(FILE *f)
+static inline bool is_shift(int state_idx)
 {
-	state_idx = 16;
-	fprintf(f, "$var reg 8 %sn %sTAPID $end\n", vcd_prefix, vcd_prefix);
-	fprintf(f, "$var reg %d %st %sTAP $end\n", 12*8, vcd_prefix, vcd_prefix);
+	return state_idx == TAP_SHIFT_DR || state_idx == TAP_SHIFT_IR;
 }
 
-static void bytef(FILE *f, uint8_t byte)
+static void end_scan(struct jtag_state *st, struct decode_batch *out, size_t i, int shift_state)
 {
-	for (int i = 7; i >= 0; i--)
-		fprintf(f, "%d", (byte & (1 << i)) != 0);
+	size_t &max_len = shift_state == TAP_SHIFT_IR ? st->max_ir : st->max_dr;
+	if (st->scan_len > max_len)
+		max_len = st->scan_len;
+	st->scan_len = 0;
+	st->scan_state = -1;
+
+	if (out == NULL) {
+		if (st->tdi != NULL) {
+			st->tdi->clear();
+			st->tdo->clear();
+		}
+		return;
+	}
+
+	// the first bit shifted is the LSB
+	int sig = shift_state == TAP_SHIFT_IR ? SIG_IR_TDI : SIG_DR_TDI;
+	std::reverse(st->tdi->begin(), st->tdi->end());
+	std::reverse(st->tdo->begin(), st->tdo->end());
+	add_event_bits(*out, i, sig, EV_DATA, st->tdi->data(), st->tdi->size());
+	add_event_bits(*out, i, sig+1, EV_DATA, st->tdo->data(), st->tdo->size());
+	st->tdi->clear();
+	st->tdo->clear();
 }
 
-static void decoder_jtag_vcd_init(FILE *f)
+// Sample i-1 holds TMS, TDI and TDO of the TCK edge that leads to the state
+// at sample i. Without an output batch only the state is updated, in the
+// pre-pass of init() (without bit buffers) only the scan lengths.
+static void jtag_walk(struct jtag_state *st, size_t begin, size_t end, struct decode_batch *out)
 {
-	fprintf(f, " b");
-	bytef(f, state_idx);
-	fprintf(f, " %sn b", vcd_prefix);
-	for (int i = 0; i < 12; i++)
-		bytef(f, tap_states[state_idx].name[i]);
-	fprintf(f, " %st", vcd_prefix);
+	sample_cursor cursor(samples, begin - 1);
+
+	for (size_t i = begin; i < end && cursor.valid(); )
+	{
+		int tms = (cursor.value & (1 << st->cfg[CFG_JTAG_TMS])) != 0;
+		int next = tap_states[st->state_idx].next[tms];
+
+		size_t run = cursor.run_end + 1 - i;
+		if (i + run > end)
+			run = end - i;
+
+		// n samples are handled in this step, with edges TCK edges. Without
+		// captured TCK each sample is an edge and the state doesn't change
+		// until the end of the run when next is the current state. With TCK
+		// only the first sample of a run can be an edge.
+		size_t n = 1, edges = 1;
+		if (st->tck_pin >= 0) {
+			bool tck = (cursor.value & (1 << st->tck_pin)) != 0;
+			edges = tck && !st->last_tck;
+			st->last_tck = tck;
+			n = run;
+		} else if (next == st->state_idx)
+			n = edges = run;
+
+		if (edges == 0) {
+			i += n;
+			cursor.idx += n - 1;
+			cursor.next();
+			continue;
+		}
+
+		if (is_shift(st->state_idx)) {
+			st->scan_state = st->state_idx;
+			st->scan_len += edges;
+			if (st->tdi != NULL) {
+				st->tdi->insert(st->tdi->end(), edges, (cursor.value & (1 << st->cfg[CFG_JTAG_TDI])) ? '1' : '0');
+				st->tdo->insert(st->tdo->end(), edges, (cursor.value & (1 << st->cfg[CFG_JTAG_TDO])) ? '1' : '0');
+			}
+		}
+
+		if (st->state_idx == TAP_IDLE)
+			st->idle_cycles += edges;
+
+		if (next != st->state_idx) {
+			int prev = st->state_idx;
+			st->state_idx = next;
+			if (out != NULL) {
+				add_event(*out, i, SIG_TAPID, EV_STATE, next);
+				add_event(*out, i, SIG_TAP, EV_STATE, next);
+			}
+			if (st->scan_state >= 0 && (next == TAP_UPDATE_DR || next == TAP_UPDATE_IR || next == TAP_RESET))
+				end_scan(st, out, i, st->scan_state);
+			if (prev == TAP_IDLE) {
+				if (out != NULL)
+					add_event(*out, i, SIG_RUNTEST, EV_VALUE, st->idle_cycles);
+				st->idle_cycles = 0;
+			}
+		}
+
+		i += n;
+		cursor.idx += n - 1;
+		cursor.next();
+	}
 }
 
-static void decoder_jtag_vcd_step(FILE *f, size_t i)
+static void decoder_jtag_init(void *state, const int *cfg, bool live, std::vector<decode_signal> &signals, struct decode_batch &out)
 {
-	int tms = (samples[i-1] & (1 << decode_config[CFG_JTAG_TMS])) != 0;
-	state_idx = tap_states[state_idx].next[tms];
-	decoder_jtag_vcd_init(f);
+	struct jtag_state *st = (struct jtag_state*)state;
+	memcpy(st->cfg, cfg, sizeof(st->cfg));
+
+	st->tdi = st->tdo = NULL;
+	st->tck_pin = cfg[CFG_JTAG_TCK] - 1;
+	if (st->tck_pin >= 0 && !is_clock_pin(st->tck_pin))
+		st->tck_pin = -1;
+
+	// the widths of the scan signals are the longest scans in the capture,
+	// in live mode the capture has only just started
+	st->last_tck = false;
+	st->state_idx = TAP_UNKNOWN;
+	st->idle_cycles = 0;
+	st->scan_state = -1;
+	st->scan_len = 0;
+	st->max_ir = live ? JTAG_LIVE_WIDTH : 1;
+	st->max_dr = live ? JTAG_LIVE_WIDTH : 1;
+	if (samples.size() > 1)
+		jtag_walk(st, 1, samples.size(), NULL);
+
+	struct decode_signal sigs[] = {
+		{ "TAPID", "n", 8, NULL },
+		{ "TAP", "t", 12*8, tap_names },
+		{ "IR_TDI", "ii", int(st->max_ir), NULL },
+		{ "IR_TDO", "io", int(st->max_ir), NULL },
+		{ "DR_TDI", "di", int(st->max_dr), NULL },
+		{ "DR_TDO", "do", int(st->max_dr), NULL },
+		{ "RUNTEST", "r", 32, NULL }
+	};
+	signals.insert(signals.end(), sigs, sigs + 7);
+
+	st->last_tck = false;
+	st->state_idx = TAP_UNKNOWN;
+	st->idle_cycles = 0;
+	st->scan_state = -1;
+	st->scan_len = 0;
+	st->tdi = new std::vector<char>;
+	st->tdo = new std::vector<char>;
+	add_event(out, 0, SIG_TAPID, EV_STATE, st->state_idx);
+	add_event(out, 0, SIG_TAP, EV_STATE, st->state_idx);
+}
+
+static void decoder_jtag_decode(void *state, size_t begin, size_t end, struct decode_batch &out)
+{
+	jtag_walk((struct jtag_state*)state, begin, end, &out);
+}
+
+static void decoder_jtag_skip(void *state, size_t begin, size_t end)
+{
+	jtag_walk((struct jtag_state*)state, begin, end, NULL);
+}
+
+static void decoder_jtag_copy(void *state, const void *from)
+{
+	struct jtag_state *st = (struct jtag_state*)state;
+	memcpy(st, from, sizeof(struct jtag_state));
+	st->tdi = new std::vector<char>(*st->tdi);
+	st->tdo = new std::vector<char>(*st->tdo);
+}
+
+static void decoder_jtag_done(void *state)
+{
+	struct jtag_state *st = (struct jtag_state*)state;
+	delete st->tdi;
+	delete st->tdo;
+}
+
+static std::string svf_hex(const char *bits, int width)
+{
+	std::string hex;
+	for (int i = 0, k = (4 - width % 4) % 4, v = 0; i < width; i++) {
+		v = 2*v + (bits[i] == '1');
+		if (++k == 4) {
+			hex += "0123456789abcdef"[v];
+			k = v = 0;
+		}
+	}
+	return hex;
+}
+
+// Each scan is a transaction, logged with the TAP state that follows it.
+// Entering RESET is logged as well.
+static void decoder_jtag_log(void*, const struct decode_batch &batch, const struct decode_event &ev,
+		struct log_record &rec, std::vector<log_record> &done)
+{
+	if (ev.sig == SIG_TAPID) {
+		if (ev.value == TAP_RESET) {
+			struct log_record reset;
+			reset.idx = ev.idx;
+			reset.state = tap_names[TAP_RESET];
+			done.push_back(reset);
+		}
+		rec.state = tap_names[ev.value];
+	}
+
+	if (ev.sig == SIG_IR_TDI || ev.sig == SIG_DR_TDI) {
+		rec.idx = ev.idx;
+		rec.addr = ev.sig == SIG_IR_TDI ? "IR" : "DR";
+		rec.tx = svf_hex(&batch.bits[ev.value], ev.width);
+	}
+
+	if (ev.sig == SIG_IR_TDO || ev.sig == SIG_DR_TDO) {
+		rec.rx = svf_hex(&batch.bits[ev.value], ev.width);
+		done.push_back(rec);
+	}
 }
 
 struct decoder_desc decoder_jtag = {
-	&decoder_jtag_vcd_defs,
-	&decoder_jtag_vcd_init,
-	&decoder_jtag_vcd_step
+	"jtag",
+	sizeof(struct jtag_state),
+	&decoder_jtag_init,
+	&decoder_jtag_decode,
+	&decoder_jtag_skip,
+	&decoder_jtag_copy,
+	&decoder_jtag_done,
+	&decoder_jtag_log
 };
 
+// Write the scans as SVF file. Scans end in IDLE (ENDIR/ENDDR), the TCK
+// cycles spent in IDLE beyond that are written as RUNTEST.
+void writesvf(const char *file)
+{
+	int k = 0;
+	while (k < num_decoders && decoder_type[k] != DECODE_JTAG)
+		k++;
+	if (k == num_decoders) {
+		fprintf(stderr, "SVF output requires a `decode jtag' configuration.\n");
+		exit(1);
+	}
+
+	FILE *f = fopen(file, "w");
+	if (f == NULL) {
+		fprintf(stderr, "Can't open SVF file `%s': %s\n", file, strerror(errno));
+		exit(1);
+	}
+
+	printf("Writing SVF output file `%s'.\n", file);
+	fprintf(f, "// Created by ArduLogic\n");
+	fprintf(f, "TRST OFF;\nENDIR IDLE;\nENDDR IDLE;\n");
+
+	struct jtag_state st;
+	std::vector<decode_signal> signals;
+	struct decode_batch batch;
+	decoder_jtag_init(&st, decode_config[k], false, signals, batch);
+
+	int tap = TAP_UNKNOWN;
+	size_t count = 0;
+	std::string tdi;
+
+	for (size_t begin = 1; begin < samples.size(); begin += SVF_CHUNK)
+	{
+		size_t end = begin + SVF_CHUNK < samples.size() ? begin + SVF_CHUNK : samples.size();
+		batch = decode_batch();
+		jtag_walk(&st, begin, end, &batch);
+
+		for (size_t k = 0; k < batch.events.size(); k++)
+		{
+			const struct decode_event &ev = batch.events[k];
+			if (ev.sig == SIG_RUNTEST && ev.value > 1)
+				fprintf(f, "RUNTEST %d TCK;\n", int(ev.value - 1));
+			if (ev.sig == SIG_TAPID) {
+				if (ev.value == TAP_RESET && tap != TAP_RESET)
+					fprintf(f, "STATE RESET;\n");
+				tap = ev.value;
+			}
+			if (ev.sig == SIG_IR_TDI || ev.sig == SIG_DR_TDI)
+				tdi = svf_hex(&batch.bits[ev.value], ev.width);
+			if (ev.sig == SIG_IR_TDO || ev.sig == SIG_DR_TDO) {
+				fprintf(f, "%s %d TDI (%s) TDO (%s) MASK (%s);\n", ev.sig == SIG_IR_TDO ? "SIR" : "SDR",
+						ev.width, tdi.c_str(), svf_hex(&batch.bits[ev.value], ev.width).c_str(),
+						svf_hex(std::string(ev.width, '1').c_str(), ev.width).c_str());
+				count++;
+			}
+		}
+	}
+
+	decoder_jtag_done(&st);
+
+	if (fclose(f) != 0) {
+		fprintf(stderr, "Error writing SVF file `%s': %s\n", file, strerror(errno));
+		exit(1);
+	}
+	printf("Wrote %zd scans.\n", count);
+}
+
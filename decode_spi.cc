@@ -26,111 +26,243 @@
 #include <string.h>
 #include <errno.h>
 
-static bool last_cs;
-static uint8_t bitcount;
-static uint8_t wordcount;
+// Streaming SPI decoder. The probe takes a sample on every active SCK edge
+// and on every CS edge, so each sample while a chip select is active is one
+// data bit on all data pins. When SCK is captured on both edges (because
+// other decoders trigger samples too) only the samples at an active SCK edge
+// are bits. The samples of a word are collected and
+// transposed into one word per data pin when the word is complete.
 
-static void decoder_spi_vcd_defs(FILE *f)
+struct spi_state {
+	int cfg[CFG_WORDS];
+	int sck_pin;
+	bool sck_level, last_sck;
+	int cs;
+	int width;
+	uint16_t cs_mask, cs_neg, data_mask;
+	uint8_t bitcount;
+	uint8_t wordcount;
+	uint16_t word[32];
+	int data_sig[TOTAL_PIN_NUM];
+	int bitcount_sig, wordcount_sig, slave_sig;
+	int mosi_sig, miso_sig;
+};
+
+// transpose an 8x8 bit matrix, bit j of byte k <-> bit k of byte j
+static inline uint64_t transpose8(uint64_t x)
 {
-	for (int i = 0; i < TOTAL_PIN_NUM; i++)
-	{
-		if (i == decode_config[CFG_SPI_CS])
-			continue;
-		if ((pins[i] & PIN_CAPTURE) == 0)
-			continue;
-		fprintf(f, "$var reg 8 %sd%d %s%s_DATA $end\n",
-				vcd_prefix, i, vcd_prefix, pin_names[i]);
+	uint64_t t;
+	t = (x ^ (x >> 7)) & 0x00aa00aa00aa00aaull;
+	x = x ^ t ^ (t << 7);
+	t = (x ^ (x >> 14)) & 0x0000cccc0000ccccull;
+	x = x ^ t ^ (t << 14);
+	t = (x ^ (x >> 28)) & 0x00000000f0f0f0f0ull;
+	x = x ^ t ^ (t << 28);
+	return x;
+}
+
+// gather the bits of all pins from the samples of one word
+static void spi_gather(const uint16_t *word, int width, bool msb, uint32_t *out)
+{
+	for (int j = 0; j < TOTAL_PIN_NUM; j++)
+		out[j] = 0;
+
+	for (int g = 0; g < width / 8; g++) {
+		uint64_t lo = 0, hi = 0;
+		for (int k = 0; k < 8; k++) {
+			uint16_t sample = word[8*g + (msb ? 7-k : k)];
+			lo |= uint64_t(sample & 0xff) << (8*k);
+			hi |= uint64_t(sample >> 8) << (8*k);
+		}
+		lo = transpose8(lo);
+		hi = transpose8(hi);
+		int shift = msb ? width - 8 - 8*g : 8*g;
+		for (int j = 0; j < 8; j++)
+			out[j] |= uint32_t((lo >> (8*j)) & 0xff) << shift;
+		for (int j = 8; j < TOTAL_PIN_NUM; j++)
+			out[j] |= uint32_t((hi >> (8*(j-8))) & 0xff) << shift;
 	}
-	fprintf(f, "$var reg 8 %sb %sBITCOUNT $end\n", vcd_prefix, vcd_prefix);
-	fprintf(f, "$var reg 8 %sw %sWORDCOUNT $end\n", vcd_prefix, vcd_prefix);
 }
 
-static void decoder_spi_vcd_init(FILE *f)
+static void add_signal(std::vector<decode_signal> &signals, const std::string &name, const std::string &id, int width, const char *const *names = NULL)
+{
+	struct decode_signal sig = { name, id, width, names };
+	signals.push_back(sig);
+}
+
+static void idle_events(struct spi_state *st, struct decode_batch &out, size_t i)
 {
+	for (int j = 0; j < TOTAL_PIN_NUM; j++)
+		if ((st->data_mask & (1 << j)) != 0)
+			add_event(out, i, st->data_sig[j], EV_IDLE, 0);
+	add_event(out, i, st->bitcount_sig, EV_IDLE, 0);
+	add_event(out, i, st->wordcount_sig, EV_IDLE, 0);
+	if (st->slave_sig >= 0)
+		add_event(out, i, st->slave_sig, EV_IDLE, 0);
+}
+
+static void decoder_spi_init(void *state, const int *cfg, bool, std::vector<decode_signal> &signals, struct decode_batch &out)
+{
+	struct spi_state *st = (struct spi_state*)state;
+	char buffer[16];
+
+	memcpy(st->cfg, cfg, sizeof(st->cfg));
+
+	st->width = cfg[CFG_SPI_BITS] ? cfg[CFG_SPI_BITS] : 8;
+	st->cs_mask = cfg[CFG_SPI_CSMASK];
+	st->cs_neg = cfg[CFG_SPI_CSNEGMASK];
+	if (st->cs_mask == 0) {
+		st->cs_mask = 1 << cfg[CFG_SPI_CS];
+		st->cs_neg = cfg[CFG_SPI_CSNEG] ? st->cs_mask : 0;
+	}
+
+	// SCK edges can only be found when both edges trigger a sample
+	st->sck_pin = cfg[CFG_SPI_SCK] - 1;
+	if (st->sck_pin >= 0 && !is_clock_pin(st->sck_pin))
+		st->sck_pin = -1;
+	if (st->sck_pin >= 0) {
+		st->sck_level = cfg[CFG_SPI_SCKEDGE] == PIN_TRIGGER_POSEDGE;
+		st->last_sck = samples.size() > 0 && (samples[0] & (1 << st->sck_pin)) != 0;
+	}
+
+	st->data_mask = 0;
 	for (int i = 0; i < TOTAL_PIN_NUM; i++) {
-		if (i == decode_config[CFG_SPI_CS])
+		st->data_sig[i] = -1;
+		if ((st->cs_mask & (1 << i)) != 0 || (pins[i] & PIN_CAPTURE) == 0)
 			continue;
-		if ((pins[i] & PIN_CAPTURE) == 0)
+		if (cfg[CFG_SPI_DATAMASK] != 0 && (cfg[CFG_SPI_DATAMASK] & (1 << i)) == 0)
 			continue;
-		fprintf(f, " bzzzzzzzz %sd%d", vcd_prefix, i);
+		snprintf(buffer, sizeof(buffer), "d%d", i);
+		st->data_sig[i] = signals.size();
+		st->data_mask |= 1 << i;
+		add_signal(signals, std::string(pin_names[i]) + "_DATA", buffer, st->width);
 	}
-	fprintf(f, " bzzzzzzzz %sb", vcd_prefix);
-	fprintf(f, " bzzzzzzzz %sw", vcd_prefix);
-	last_cs = false;
-}
+	st->bitcount_sig = signals.size();
+	add_signal(signals, "BITCOUNT", "b", 8);
+	st->wordcount_sig = signals.size();
+	add_signal(signals, "WORDCOUNT", "w", 8);
 
-static void printbyte(FILE *f, uint8_t data, const char *name)
-{
-	fprintf(f, " b");
-	for (int i = 0; i < 8; i++)
-		fprintf(f, "%d", (data & (0x80 >> i)) != 0);
-	fprintf(f, " %s%s", vcd_prefix, name);
+	// with more than one chip select the name of the active one is shown
+	st->slave_sig = -1;
+	if (__builtin_popcount(st->cs_mask) > 1) {
+		size_t len = 1;
+		for (int i = 0; i < TOTAL_PIN_NUM; i++)
+			if ((st->cs_mask & (1 << i)) != 0 && strlen(pin_names[i]) > len)
+				len = strlen(pin_names[i]);
+		st->slave_sig = signals.size();
+		add_signal(signals, "SLAVE", "s", 8*len, pin_names);
+	}
+
+	st->mosi_sig = cfg[CFG_SPI_MOSI] > 0 ? st->data_sig[cfg[CFG_SPI_MOSI] - 1] : -1;
+	st->miso_sig = cfg[CFG_SPI_MISO] > 0 ? st->data_sig[cfg[CFG_SPI_MISO] - 1] : -1;
+
+	idle_events(st, out, 0);
+	st->cs = -1;
+	st->bitcount = 0;
+	st->wordcount = 0;
 }
 
-static void decoder_spi_vcd_step(FILE *f, size_t i)
+// Without an output batch only the state is updated.
+static void spi_walk(struct spi_state *st, size_t begin, size_t end, struct decode_batch *out)
 {
-	bool cs = (samples[i] & (1 << decode_config[CFG_SPI_CS])) != 0;
-	if (decode_config[CFG_SPI_CSNEG] != 0)
-		cs = !cs;
-	if (cs == true && last_cs == false) {
-#if 0
-		for (int j = 0; j < TOTAL_PIN_NUM; j++) {
-			if (j == decode_config[CFG_SPI_CS])
-				continue;
-			if ((pins[j] & PIN_CAPTURE) == 0)
-				continue;
-			fprintf(f, " bxxxxxxxx %sd%d", vcd_prefix, j);
-		}
-		fprintf(f, " bxxxxxxxx %sb", vcd_prefix);
-		fprintf(f, " bxxxxxxxx %sw", vcd_prefix);
-#endif
-		last_cs = true;
-		wordcount = 0;
-		bitcount = 0;
-	}
-	else if (cs == false && last_cs == true) {
-		for (int j = 0; j < TOTAL_PIN_NUM; j++) {
-			if (j == decode_config[CFG_SPI_CS])
-				continue;
-			if ((pins[j] & PIN_CAPTURE) == 0)
-				continue;
-			fprintf(f, " bzzzzzzzz %sd%d", vcd_prefix, j);
+	bool msb = st->cfg[CFG_SPI_MSB] != 0;
+	uint32_t data[TOTAL_PIN_NUM];
+
+	sample_cursor cursor(samples, begin);
+	while (cursor.valid() && cursor.idx < end)
+	{
+		size_t i = cursor.idx;
+		uint16_t active = (cursor.value ^ st->cs_neg) & st->cs_mask;
+		int cs = active ? __builtin_ctz(active) : -1;
+
+		bool bit = true;
+		if (st->sck_pin >= 0) {
+			bool sck = (cursor.value & (1 << st->sck_pin)) != 0;
+			bit = sck == st->sck_level && st->last_sck != st->sck_level;
+			st->last_sck = sck;
 		}
-		fprintf(f, " bzzzzzzzz %sb", vcd_prefix);
-		fprintf(f, " bzzzzzzzz %sw", vcd_prefix);
-		last_cs = false;
-		bitcount = 0;
-	}
-	else {
-		if (bitcount == 0) {
-			for (int j = 0; j < TOTAL_PIN_NUM; j++) {
-				if (j == decode_config[CFG_SPI_CS])
-					continue;
-				if ((pins[j] & PIN_CAPTURE) == 0)
-					continue;
-				uint8_t byte = 0;
-				for (int k = 0; k < 8; k++) {
-					bool bit = (samples[i+k] & (1 << j)) != 0;
-					int bitidx = decode_config[CFG_SPI_MSB] ? 7-k : k;
-					byte |= bit << bitidx;
+
+		if (cs != st->cs) {
+			if (out != NULL && cs < 0)
+				idle_events(st, *out, i);
+			else if (out != NULL && st->slave_sig >= 0)
+				add_event(*out, i, st->slave_sig, EV_STATE, cs);
+			st->cs = cs;
+			st->bitcount = 0;
+			st->wordcount = 0;
+		} else if (cs >= 0 && bit) {
+			st->word[st->bitcount] = cursor.value;
+			if (out != NULL)
+				add_event(*out, i, st->bitcount_sig, EV_VALUE, st->bitcount);
+			if (++st->bitcount == st->width) {
+				if (out != NULL) {
+					spi_gather(st->word, st->width, msb, data);
+					for (int j = 0; j < TOTAL_PIN_NUM; j++)
+						if ((st->data_mask & (1 << j)) != 0)
+							add_event(*out, i, st->data_sig[j], EV_DATA, data[j]);
+					add_event(*out, i, st->wordcount_sig, EV_VALUE, st->wordcount);
 				}
-				char name[5];
-				snprintf(name, 5, "d%d", j);
-				printbyte(f, byte, name);
+				st->wordcount++;
+				st->bitcount = 0;
 			}
-			printbyte(f, wordcount, "w");
-		}
-		printbyte(f, bitcount, "b");
-		if (++bitcount == 8) {
-			bitcount = 0;
-			wordcount++;
 		}
+
+		// without a chip select or with captured SCK nothing happens
+		// in the rest of the run
+		if (cs < 0 || st->sck_pin >= 0)
+			cursor.next_run();
+		else
+			cursor.next();
 	}
 }
 
+static void decoder_spi_decode(void *state, size_t begin, size_t end, struct decode_batch &out)
+{
+	spi_walk((struct spi_state*)state, begin, end, &out);
+}
+
+static void decoder_spi_skip(void *state, size_t begin, size_t end)
+{
+	spi_walk((struct spi_state*)state, begin, end, NULL);
+}
+
+// A transaction is the time a chip select is active. It starts with the
+// first bit and ends when the chip select is released or changes.
+static void decoder_spi_log(void *state, const struct decode_batch&, const struct decode_event &ev,
+		struct log_record &rec, std::vector<log_record> &done)
+{
+	struct spi_state *st = (struct spi_state*)state;
+
+	if (ev.kind == EV_IDLE || ev.sig == st->slave_sig) {
+		if (rec.open)
+			done.push_back(rec);
+		rec = log_record();
+		if (ev.kind == EV_STATE)
+			rec.addr = pin_names[ev.value];
+		return;
+	}
+
+	if (!rec.open) {
+		rec.idx = ev.idx;
+		rec.open = true;
+		if (rec.addr.empty())
+			rec.addr = pin_names[__builtin_ctz(st->cs_mask)];
+	}
+
+	if (ev.sig == st->mosi_sig)
+		log_word(rec.tx, ev.value, st->width);
+	if (ev.sig == st->miso_sig)
+		log_word(rec.rx, ev.value, st->width);
+}
+
 struct decoder_desc decoder_spi = {
-	&decoder_spi_vcd_defs,
-	&decoder_spi_vcd_init,
-	&decoder_spi_vcd_step
+	"spi",
+	sizeof(struct spi_state),
+	&decoder_spi_init,
+	&decoder_spi_decode,
+	&decoder_spi_skip,
+	NULL,
+	NULL,
+	&decoder_spi_log
 };
 
@@ -47,3 +47,12 @@
 ###
 # decode jtag D2 D3 D4 D5
 
+
+###
+### Flight recorder: keep 100ms before and 50ms after
+### the first sample with D3 high and D4 low
+###
+# capture D2 D3 D4 D5
+# trigger 19kHz
+# record 100ms 50ms
+# match D3 !D4
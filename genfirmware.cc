@@ -27,8 +27,55 @@
 #include <errno.h>
 #include <assert.h>
 #include <math.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
-static void gen_pack(FILE *f)
+#include <string>
+
+// Rough cost in cycles of reading a packed word from a lookup table in flash
+// (address calculation and lpm), for 8 and 16 bit sample words.
+#define PACK_LUT_CYCLES_8	6
+#define PACK_LUT_CYCLES_16	10
+
+// Each port is packed using a chain of mask/shift/or terms (the AVR shifts
+// one bit per instruction) or, when the chain is more expensive, using a
+// lookup table in flash indexed by the port value.
+static bool pack_use_lut(const uint8_t *shift, int num_bits)
+{
+	int width = num_bits <= 8 ? 1 : 2;
+	int cycles = 0;
+	for (int i = 0; i < 32; i++)
+		if (shift[i])
+			cycles += (2 + abs(i - 16)) * width;
+	return cycles > (width == 1 ? PACK_LUT_CYCLES_8 : PACK_LUT_CYCLES_16);
+}
+
+static void gen_pack_lut(FILE *f, const char *port, const uint8_t *shift)
+{
+	fprintf(f, "static const smplword_t pack_%s[256] PROGMEM = {", port);
+	for (int v = 0; v < 256; v++) {
+		uint16_t w = 0;
+		for (int i = 0; i < 32; i++)
+			if (shift[i])
+				w |= i < 16 ? (v & shift[i]) >> (16 - i) : (v & shift[i]) << (i - 16);
+		fprintf(f, "%s0x%04x,", v % 8 == 0 ? "\n\t" : " ", w);
+	}
+	fprintf(f, "\n};\n");
+}
+
+static void gen_pack_port(FILE *f, const char *port, const uint8_t *shift, int num_bits)
+{
+	if (pack_use_lut(shift, num_bits)) {
+		fprintf(f, "	w |= pgm_read_%s(&pack_%s[%s]);\n", num_bits <= 8 ? "byte" : "word", port, port);
+		return;
+	}
+	for (int i = 0; i < 32; i++)
+		if (shift[i])
+			fprintf(f, "	w |= (%s & 0x%02x) %s %d;\n",
+					port, shift[i], i < 16 ? ">>" : "<<", abs(i - 16));
+}
+
+static void gen_pack(FILE *f, int num_bits)
 {
 	uint8_t ashift[32] = { };
 	uint8_t dshift[32] = { };
@@ -47,20 +94,73 @@ static void gen_pack(FILE *f)
 		dshift[off] |= 1 << (i - PIN_D(2) + 2);
 	}
 
+	if (pack_use_lut(ashift, num_bits))
+		gen_pack_lut(f, "adata", ashift);
+	if (pack_use_lut(dshift, num_bits))
+		gen_pack_lut(f, "ddata", dshift);
+
 	fprintf(f, "static inline smplword_t pack(uint8_t adata, uint8_t ddata) {\n");
 	fprintf(f, "	smplword_t w = 0;\n");
-	for (int i = 0; i < 32; i++) {
-		if (ashift[i])
-			fprintf(f, "	w |= (adata & 0x%02x) %s %d;\n",
-					ashift[i], i < 16 ? ">>" : "<<", abs(i - 16));
-		if (dshift[i])
-			fprintf(f, "	w |= (ddata & 0x%02x) %s %d;\n",
-					dshift[i], i < 16 ? ">>" : "<<", abs(i - 16));
-	}
+	gen_pack_port(f, "adata", ashift, num_bits);
+	gen_pack_port(f, "ddata", dshift, num_bits);
 	fprintf(f, "	return w;\n");
 	fprintf(f, "}\n");
 }
 
+// The sample words are pushed using a switch over the free bits in the
+// current byte, with the code for each case unrolled so that only constant
+// shifts are needed. Starting with 7 free bits, only the cases in the cycle
+// of (7 - n*num_bits) mod 7 can happen, unless the records of rle or
+// timestamps change the phase. The universal firmware has a fifo_push_<n>
+// function for each width.
+static void gen_fifo_push(FILE *f, int num_bits, bool universal)
+{
+	bool phases[8] = { };
+	if (universal || trigger_rle || timestamps) {
+		for (int p = 1; p <= 7; p++)
+			phases[p] = true;
+	} else {
+		for (int p = 7; !phases[p]; p = (p - num_bits % 7 + 6) % 7 + 1)
+			phases[p] = true;
+	}
+
+	if (universal)
+		fprintf(f, "static void fifo_push_%d(smplword_t w) {\n", num_bits);
+	else
+		fprintf(f, "static inline void fifo_push(smplword_t w) {\n");
+	fprintf(f, "	if (!fifo_push_en)\n");
+	fprintf(f, "		return;\n");
+	fprintf(f, "	switch (fifo_bits) {\n");
+	for (int p = 7; p >= 1; p--)
+	{
+		if (!phases[p])
+			continue;
+		fprintf(f, "	case %d:\n", p);
+		int free_bits = p;
+		for (int done = 0; done < num_bits; ) {
+			int bc = num_bits - done < free_bits ? num_bits - done : free_bits;
+			if (done == 0 && p != 7)
+				fprintf(f, "		fifo_data[fifo_in] |= w << %d;\n", 7 - p);
+			else if (done == 0)
+				fprintf(f, "		fifo_data[fifo_in] |= w;\n");
+			else
+				fprintf(f, "		fifo_data[fifo_in] |= w >> %d;\n", done);
+			done += bc;
+			free_bits -= bc;
+			if (free_bits == 0) {
+				fprintf(f, "		fifo_next();\n");
+				free_bits = 7;
+			}
+		}
+		if (free_bits != 7)
+			fprintf(f, "		fifo_bits = %d;\n", free_bits);
+		fprintf(f, "		break;\n");
+	}
+	fprintf(f, "	}\n");
+	fprintf(f, "}\n");
+}
+
+// num_bits is 0 for the universal firmware
 static void gen_fifo(FILE *f, int num_bits)
 {
 	fprintf(f, "static void serio_send();\n");
@@ -77,20 +177,32 @@ static void gen_fifo(FILE *f, int num_bits)
 	fprintf(f, "	fifo_bits = 7;\n");
 	fprintf(f, "}\n");
 	fprintf(f, "volatile bool fifo_push_en = 0;\n");
-	fprintf(f, "static inline void fifo_push(smplword_t w) {\n");
-	fprintf(f, "	uint8_t bits = %d;\n", num_bits);
-	fprintf(f, "	if (!fifo_push_en)\n");
-	fprintf(f, "		return;\n");
-	fprintf(f, "	do {\n");
-	fprintf(f, "		uint8_t bc = bits > fifo_bits ? fifo_bits : bits;\n");
-	fprintf(f, "		fifo_data[fifo_in] |= w << (7-fifo_bits);\n");
-	fprintf(f, "		fifo_bits -= bc;\n");
-	fprintf(f, "		if (fifo_bits == 0)\n");
-	fprintf(f, "			fifo_next();\n");
-	fprintf(f, "		w = w >> bc;\n");
-	fprintf(f, "		bits -= bc;\n");
-	fprintf(f, "	} while (bits > 0);\n");
-	fprintf(f, "}\n");
+	if (num_bits == 0) {
+		for (int n = 1; n <= TOTAL_PIN_NUM; n++)
+			gen_fifo_push(f, n, true);
+		fprintf(f, "static void (*const fifo_push_width[%d])(smplword_t) = {", TOTAL_PIN_NUM);
+		for (int n = 1; n <= TOTAL_PIN_NUM; n++)
+			fprintf(f, "%sfifo_push_%d", n > 1 ? ", " : " ", n);
+		fprintf(f, " };\n");
+		fprintf(f, "static void (*fifo_push)(smplword_t);\n");
+	} else
+		gen_fifo_push(f, num_bits, false);
+	// variable sized records for rle and timestamps
+	if (num_bits == 0 || trigger_rle || timestamps) {
+		fprintf(f, "static inline void fifo_push_bits(uint16_t w, uint8_t bits) {\n");
+		fprintf(f, "	if (!fifo_push_en)\n");
+		fprintf(f, "		return;\n");
+		fprintf(f, "	do {\n");
+		fprintf(f, "		uint8_t bc = bits > fifo_bits ? fifo_bits : bits;\n");
+		fprintf(f, "		fifo_data[fifo_in] |= w << (7-fifo_bits);\n");
+		fprintf(f, "		fifo_bits -= bc;\n");
+		fprintf(f, "		if (fifo_bits == 0)\n");
+		fprintf(f, "			fifo_next();\n");
+		fprintf(f, "		w = w >> bc;\n");
+		fprintf(f, "		bits -= bc;\n");
+		fprintf(f, "	} while (bits > 0);\n");
+		fprintf(f, "}\n");
+	}
 	fprintf(f, "static inline void fifo_close() {\n");
 	fprintf(f, "	while (fifo_in != fifo_out)\n");
 	fprintf(f, "		serio_send();\n");
@@ -99,12 +211,80 @@ static void gen_fifo(FILE *f, int num_bits)
 	fprintf(f, "}\n");
 }
 
+// the size of a sample record with its flag bit, only known at run time in
+// the universal firmware
+static std::string record_bits(int num_bits)
+{
+	return num_bits ? std::to_string(num_bits + 1) : "num_bits + 1";
+}
+
+// Run-length encoding for the free running trigger: a record is a 0 bit
+// followed by a sample, or a 1 bit followed by 7 bits holding the number
+// of repetitions of the last sample minus one (see unpack.cc).
+static void gen_rle(FILE *f, int num_bits)
+{
+	fprintf(f, "smplword_t rle_last = 0;\n");
+	fprintf(f, "uint8_t rle_count = 0;\n");
+	fprintf(f, "static inline void rle_flush() {\n");
+	fprintf(f, "	if (rle_count == 0)\n");
+	fprintf(f, "		return;\n");
+	fprintf(f, "	fifo_push_bits(((rle_count-1) << 1) | 1, 8);\n");
+	fprintf(f, "	rle_count = 0;\n");
+	fprintf(f, "}\n");
+	fprintf(f, "static inline void rle_push(smplword_t w) {\n");
+	fprintf(f, "	if (w == rle_last) {\n");
+	fprintf(f, "		if (++rle_count == 128)\n");
+	fprintf(f, "			rle_flush();\n");
+	fprintf(f, "		return;\n");
+	fprintf(f, "	}\n");
+	fprintf(f, "	rle_flush();\n");
+	fprintf(f, "	fifo_push_bits(w << 1, %s);\n", record_bits(num_bits).c_str());
+	fprintf(f, "	rle_last = w;\n");
+	fprintf(f, "}\n");
+}
+
+// Timestamps for edge triggers: Timer1 runs freely at 16 MHz. A sample is
+// sent with the ticks since the last sample (a 0 bit and 7 bits or a 1 bit
+// and 16 bits) and a timer overflow as a single 1 bit (see unpack.cc).
+static void gen_timestamps(FILE *f, int num_bits)
+{
+	fprintf(f, "uint16_t ts_last = 0;\n");
+	fprintf(f, "ISR(TIMER1_OVF_vect) {\n");
+	fprintf(f, "	fifo_push_bits(1, 1);\n");
+	fprintf(f, "}\n");
+	fprintf(f, "static inline void ts_push(smplword_t w, uint16_t tcnt) {\n");
+	fprintf(f, "	// an overflow before tcnt was latched must be sent first\n");
+	fprintf(f, "	if ((TIFR1 & _BV(TOV1)) != 0 && tcnt < 0x8000) {\n");
+	fprintf(f, "		TIFR1 = _BV(TOV1);\n");
+	fprintf(f, "		fifo_push_bits(1, 1);\n");
+	fprintf(f, "	}\n");
+	fprintf(f, "	uint16_t delta = tcnt - ts_last;\n");
+	fprintf(f, "	ts_last = tcnt;\n");
+	fprintf(f, "	fifo_push_bits(w << 1, %s);\n", record_bits(num_bits).c_str());
+	fprintf(f, "	if (delta < 128) {\n");
+	fprintf(f, "		fifo_push_bits(delta << 1, 8);\n");
+	fprintf(f, "	} else {\n");
+	fprintf(f, "		fifo_push_bits(1, 1);\n");
+	fprintf(f, "		fifo_push_bits(delta, 16);\n");
+	fprintf(f, "	}\n");
+	fprintf(f, "}\n");
+}
+
+static void gen_timer_start(FILE *f)
+{
+	fprintf(f, "	TCCR1A = 0;\n");
+	fprintf(f, "	TCCR1B = 0x01;\n");
+	fprintf(f, "	TCNT1 = 0;\n");
+	fprintf(f, "	TIFR1 = _BV(TOV1);\n");
+	fprintf(f, "	TIMSK1 = _BV(TOIE1);\n");
+}
+
 static void gen_serio(FILE *f)
 {
 	fprintf(f, "static void serio_setup() {\n");
-	fprintf(f, "	// Configure USART0 for 2MBaud\n");
+	fprintf(f, "	// Configure USART0 for %d baud (see link_negotiate)\n", LINK_SAFE_BAUD);
 	fprintf(f, "	UBRR0H = 0;\n");
-	fprintf(f, "	UBRR0L = 0;\n");
+	fprintf(f, "	UBRR0L = %d;\n", LINK_UBRR(LINK_SAFE_BAUD));
 	fprintf(f, "	UCSR0A = _BV(U2X0);\n");
 	fprintf(f, "	UCSR0B = _BV(RXEN0) | _BV(TXEN0);\n");
 	fprintf(f, "	UCSR0C = _BV(UCSZ00) | _BV(UCSZ01);\n");
@@ -121,6 +301,11 @@ static void gen_serio(FILE *f)
 	fprintf(f, "	fifo_out++;\n");
 	fprintf(f, "	PINB = 0x0c;\n");
 	fprintf(f, "}\n");
+	fprintf(f, "static uint8_t serio_recv() {\n");
+	fprintf(f, "	while ((UCSR0A & _BV(RXC0)) == 0)\n");
+	fprintf(f, "		serio_send();\n");
+	fprintf(f, "	return UDR0;\n");
+	fprintf(f, "}\n");
 #if 0
 	fprintf(f, "static void serio_sendbyte(uint8_t ch) {\n");
 	fprintf(f, "	while ((UCSR0A & _BV(UDRE0)) == 0) { /* wait */ }\n");
@@ -129,13 +314,99 @@ static void gen_serio(FILE *f)
 #endif
 }
 
+// The answer to PROBE_QUERY (see ardulogic.h), also sent after a reset. The
+// FIFO is drained first, so repeated queries can't overflow it.
+static void gen_ident(FILE *f, const char *id)
+{
+	char ident[64];
+	int len = sprintf(ident, "..ARDULOGIC?%x:%s:\r\n", PROTOCOL_VERSION, id);
+	ident[0] = ident[1] = 0;
+
+	fprintf(f, "static void send_ident() {\n");
+	fprintf(f, "	while (fifo_in != fifo_out)\n");
+	fprintf(f, "		serio_send();\n");
+	for (int i = 0; i < 8; i++)
+		fprintf(f, "	fifo_data[fifo_in++] = 0;\n");
+	for (int i = 0; i < len; i++)
+		fprintf(f, "	fifo_data[fifo_in++] = 0x%02x;\n", ident[i]);
+	fprintf(f, "}\n");
+}
+
+// The negotiation of the link speed (see ardulogic.h) and the loop waiting
+// for the command cmd that starts the capture. Timer1 is only used by the
+// capture, so it measures the timeouts at clk/1024 in between. Any other
+// byte is taken as a host talking at a different rate and switches back to
+// the safe rate.
+static void gen_link(FILE *f)
+{
+	int safe_ubrr = LINK_UBRR(LINK_SAFE_BAUD);
+	int timeout = LINK_TIMEOUT_MS * 15625 / 1000;
+	// rounded up, plus one tick as the prescaler runs on
+	int switch_ticks = (LINK_SWITCH_US * 15625 + 999999) / 1000000 + 1;
+
+	fprintf(f, "static bool serio_wait(uint16_t ticks) {\n");
+	fprintf(f, "	TCCR1A = 0;\n");
+	fprintf(f, "	TCCR1B = 0x05;\n");
+	fprintf(f, "	TCNT1 = 0;\n");
+	fprintf(f, "	while ((UCSR0A & _BV(RXC0)) == 0 && TCNT1 < ticks)\n");
+	fprintf(f, "		serio_send();\n");
+	fprintf(f, "	TCCR1B = 0;\n");
+	fprintf(f, "	return (UCSR0A & _BV(RXC0)) != 0;\n");
+	fprintf(f, "}\n");
+	fprintf(f, "static void link_speed(uint8_t ubrr) {\n");
+	fprintf(f, "	while (fifo_in != fifo_out)\n");
+	fprintf(f, "		serio_send();\n");
+	fprintf(f, "	// the last bytes leave the USART (LINK_SWITCH_US)\n");
+	fprintf(f, "	TCCR1A = 0;\n");
+	fprintf(f, "	TCCR1B = 0x05;\n");
+	fprintf(f, "	TCNT1 = 0;\n");
+	fprintf(f, "	while (TCNT1 < %d) { /* wait */ }\n", switch_ticks);
+	fprintf(f, "	TCCR1B = 0;\n");
+	fprintf(f, "	UBRR0L = ubrr;\n");
+	fprintf(f, "}\n");
+	fprintf(f, "static void link_negotiate() {\n");
+	fprintf(f, "	uint8_t ubrr = serio_recv();\n");
+	fprintf(f, "	if ((uint8_t)~serio_recv() != ubrr)\n");
+	fprintf(f, "		return;\n");
+	fprintf(f, "	fifo_data[fifo_in++] = '%c';\n", LINK_BAUD);
+	fprintf(f, "	link_speed(ubrr);\n");
+	fprintf(f, "	if (!serio_wait(%d) || UDR0 != '%c') {\n", timeout, LINK_TEST);
+	fprintf(f, "		link_speed(%d);\n", safe_ubrr);
+	fprintf(f, "		return;\n");
+	fprintf(f, "	}\n");
+	fprintf(f, "	uint8_t v = 0x%02x;\n", LINK_TEST_BYTE(0));
+	fprintf(f, "	for (uint16_t i = 0; i < %d; i++) {\n", LINK_TEST_BYTES);
+	fprintf(f, "		while ((uint8_t)(fifo_in+1) == fifo_out)\n");
+	fprintf(f, "			serio_send();\n");
+	fprintf(f, "		fifo_data[fifo_in++] = v;\n");
+	fprintf(f, "		v += 0x%02x;\n", uint8_t(LINK_TEST_BYTE(1) - LINK_TEST_BYTE(0)));
+	fprintf(f, "	}\n");
+	fprintf(f, "	if (!serio_wait(%d) || UDR0 != '%c') {\n", timeout, LINK_KEEP);
+	fprintf(f, "		link_speed(%d);\n", safe_ubrr);
+	fprintf(f, "		return;\n");
+	fprintf(f, "	}\n");
+	fprintf(f, "	fifo_data[fifo_in++] = '%c';\n", LINK_KEEP);
+	fprintf(f, "}\n");
+	fprintf(f, "static void serio_command(uint8_t cmd) {\n");
+	fprintf(f, "	uint8_t ch;\n");
+	fprintf(f, "	while ((ch = serio_recv()) != cmd) {\n");
+	fprintf(f, "		if (ch == '%c')\n", PROBE_QUERY);
+	fprintf(f, "			send_ident();\n");
+	fprintf(f, "		else if (ch == '%c')\n", LINK_BAUD);
+	fprintf(f, "			link_negotiate();\n");
+	fprintf(f, "		else\n");
+	fprintf(f, "			link_speed(%d);\n", safe_ubrr);
+	fprintf(f, "	}\n");
+	fprintf(f, "}\n");
+}
+
 static void gen_freq_trigger(FILE *f)
 {
 	fprintf(f, "ISR(TIMER1_COMPA_vect) {\n");
 	fprintf(f, "	uint8_t value_pinc = PINC;\n");
 	fprintf(f, "	uint8_t value_pind = PIND;\n");
 	fprintf(f, "	PORTB |= 0x02;\n");
-	fprintf(f, "	fifo_push(pack(value_pinc, value_pind));\n");
+	fprintf(f, "	%s(pack(value_pinc, value_pind));\n", trigger_rle ? "rle_push" : "fifo_push");
 	fprintf(f, "	PORTB &= ~0x02;\n");
 	fprintf(f, "}\n");
 }
@@ -148,8 +419,13 @@ static void gen_irq_trigger(FILE *f)
 		fprintf(f, "ISR(INT%d_vect) {\n", i);
 		fprintf(f, "	uint8_t value_pinc = PINC;\n");
 		fprintf(f, "	uint8_t value_pind = PIND;\n");
+		if (timestamps)
+			fprintf(f, "	uint16_t tcnt = TCNT1;\n");
 		fprintf(f, "	PORTB |= 0x02;\n");
-		fprintf(f, "	fifo_push(pack(value_pinc, value_pind));\n");
+		if (timestamps)
+			fprintf(f, "	ts_push(pack(value_pinc, value_pind), tcnt);\n");
+		else
+			fprintf(f, "	fifo_push(pack(value_pinc, value_pind));\n");
 		fprintf(f, "	PORTB &= ~0x02;\n");
 		fprintf(f, "}\n");
 	}
@@ -160,8 +436,14 @@ static void gen_trigger(FILE *f)
 	fprintf(f, "static uint8_t trigger_state = 0x80;\n");
 
 	fprintf(f, "static void check_trigger() {\n");
+	if (timestamps) {
+		// the timer overflow must not come between latching and sending
+		fprintf(f, "	cli();\n");
+	}
 	fprintf(f, "	uint8_t value_pinc = PINC;\n");
 	fprintf(f, "	uint8_t value_pind = PIND;\n");
+	if (timestamps)
+		fprintf(f, "	uint16_t tcnt = TCNT1;\n");
 	fprintf(f, "	PORTB |= 0x01;\n");
 	fprintf(f, "	uint8_t new_state = 0;\n");
 
@@ -188,38 +470,56 @@ static void gen_trigger(FILE *f)
 	fprintf(f, "		goto triggered;\n");
 	fprintf(f, "	trigger_state = new_state;\n");
 	fprintf(f, "	PORTB &= ~0x03;\n");
+	if (timestamps)
+		fprintf(f, "	sei();\n");
 	fprintf(f, "	return;\n");
 
 	fprintf(f, "triggered:\n");
 	fprintf(f, "	PORTB |= 0x02;\n");
 	fprintf(f, "	trigger_state = new_state;\n");
-	fprintf(f, "	fifo_push(pack(value_pinc, value_pind));\n");
+	if (timestamps)
+		fprintf(f, "	ts_push(pack(value_pinc, value_pind), tcnt);\n");
+	else
+		fprintf(f, "	fifo_push(pack(value_pinc, value_pind));\n");
 	fprintf(f, "	PORTB &= ~0x03;\n");
+	if (timestamps)
+		fprintf(f, "	sei();\n");
 	fprintf(f, "}\n");
 }
 
-void genfirmware(const char *tts)
+// the pins with the given flag as bits of PORTC (A0..A5) and PORTD (D2..D7)
+static uint8_t pinc_mask(int flag)
+{
+	uint8_t mask = 0;
+	for (int i = PIN_A(0); i <= PIN_A(5); i++)
+		if ((pins[i] & flag) != 0)
+			mask |= 1 << (i-PIN_A(0));
+	return mask;
+}
+
+static uint8_t pind_mask(int flag)
+{
+	uint8_t mask = 0;
+	for (int i = PIN_D(2); i <= PIN_D(7); i++)
+		if ((pins[i] & flag) != 0)
+			mask |= 1 << (i-PIN_D(0));
+	return mask;
+}
+
+static int trigger_mode()
 {
 	bool use_irq_trigger = true;
 	int num_trigger = 0;
-	int num_bits = 0;
 
 	for (int i = 0; i < TOTAL_PIN_NUM; i++) {
 		if ((pins[i] & (PIN_TRIGGER_POSEDGE | PIN_TRIGGER_NEGEDGE)) != 0)
 			num_trigger++;
-		if ((pins[i] & PIN_CAPTURE) != 0)
-			num_bits++;
 		if (i == PIN_D(2) || i == PIN_D(3))
 			continue;
 		if ((pins[i] & (PIN_TRIGGER_POSEDGE|PIN_TRIGGER_NEGEDGE)) != 0)
 			use_irq_trigger = false;
 	}
 
-	if (num_trigger > 7) {
-		fprintf(stderr, "A maximum of 7 trigger pins is supported by the firmware generator.\n");
-		exit(1);
-	}
-
 	if (num_trigger > 0 && trigger_freq > 0) {
 		fprintf(stderr, "Conflicting trigger configuration: found trigger pins and trigger frequency.\n");
 		exit(1);
@@ -228,22 +528,587 @@ void genfirmware(const char *tts)
 	if (!use_irq_trigger)
 		printf("WARNING: IRQs are only used when all triggers are on D2 and/or D3!\n");
 
-	FILE *f = fopen(".ardulogic_tmp.firmware.c", "w");
+	if (trigger_freq > 0)
+		return UMODE_FREQ;
+	return use_irq_trigger ? UMODE_IRQ : UMODE_POLL;
+}
+
+// Timer1 in CTC mode for the free running trigger
+static void timer_config(uint8_t &tccr1b, uint16_t &ocr1a)
+{
+	int prescale = 1;
+	int prescale_bits = 1;
+	int cycles;
+
+	while (1)
+	{
+		cycles = round((16e6 / prescale) / trigger_freq);
+		if (cycles < 64000)
+			break;
+
+		switch (prescale)
+		{
+		case 1:
+			prescale = 8;
+			prescale_bits = 2;
+			break;
+		case 8:
+			prescale = 64;
+			prescale_bits = 3;
+			break;
+		case 64:
+			prescale = 256;
+			prescale_bits = 4;
+			break;
+		case 256:
+			prescale = 1024;
+			prescale_bits = 5;
+			break;
+		default:
+			assert(!"This should never happen");
+			exit(1);
+		}
+	}
+
+	printf("Configure trigger for %.2f kHz (prescale=%d, cycles=%d).\n",
+			16e6 / (prescale * cycles), prescale, cycles);
+
+	// CTC mode: set CTC1/WGM12 in tccr1b
+	tccr1b = 0x08;
+
+	// configure prescaler and cycles
+	tccr1b |= prescale_bits;
+	ocr1a = cycles;
+}
+
+// INT0/INT1 for the edge triggers on D2/D3
+static void irq_config(uint8_t &eicra, uint8_t &eimsk)
+{
+	eicra = 0;
+	eimsk = 0;
+
+	switch (pins[PIN_D(2)] & (PIN_TRIGGER_POSEDGE|PIN_TRIGGER_NEGEDGE))
+	{
+	case PIN_TRIGGER_POSEDGE|PIN_TRIGGER_NEGEDGE:
+		eicra |= 0x01;
+		eimsk |= 0x01;
+		break;
+	case PIN_TRIGGER_NEGEDGE:
+		eicra |= 0x02;
+		eimsk |= 0x01;
+		break;
+	case PIN_TRIGGER_POSEDGE:
+		eicra |= 0x03;
+		eimsk |= 0x01;
+		break;
+	}
+
+	switch (pins[PIN_D(3)] & (PIN_TRIGGER_POSEDGE|PIN_TRIGGER_NEGEDGE))
+	{
+	case PIN_TRIGGER_POSEDGE|PIN_TRIGGER_NEGEDGE:
+		eicra |= 0x04;
+		eimsk |= 0x02;
+		break;
+	case PIN_TRIGGER_NEGEDGE:
+		eicra |= 0x06;
+		eimsk |= 0x02;
+		break;
+	case PIN_TRIGGER_POSEDGE:
+		eicra |= 0x0c;
+		eimsk |= 0x02;
+		break;
+	}
+}
+
+// The universal firmware gets the configuration at run time (see the UCFG_*
+// bytes in ardulogic.h) and is the same for all configurations. The samples
+// are packed using tables in RAM and pushed with the fifo_push_<n> variant
+// for the number of captured pins, but the sampling code has to check the
+// mode and call fifo_push through a pointer, so the generated firmware is
+// still a bit faster.
+static void gen_universal(FILE *f)
+{
+	fprintf(f, "#include <stdint.h>\n");
+	fprintf(f, "#include <stdbool.h>\n");
+	fprintf(f, "#include <avr/io.h>\n");
+	fprintf(f, "#include <avr/pgmspace.h>\n");
+	fprintf(f, "#include <avr/sleep.h>\n");
+	fprintf(f, "#include <avr/interrupt.h>\n");
+	fprintf(f, "typedef uint16_t smplword_t;\n");
+	fprintf(f, "volatile uint8_t error_code = 0;\n");
+	fprintf(f, "uint8_t mode, num_bits;\n");
+	fprintf(f, "bool rle_en, ts_en;\n");
+	fprintf(f, "uint8_t pos_c, neg_c, pos_d, neg_d;\n");
+	fprintf(f, "smplword_t pack_c[64], pack_d[64];\n");
+	fprintf(f, "static inline smplword_t pack(uint8_t adata, uint8_t ddata) {\n");
+	fprintf(f, "	return pack_c[adata & 0x3f] | pack_d[ddata >> 2];\n");
+	fprintf(f, "}\n");
+
+	gen_fifo(f, 0);
+	gen_rle(f, 0);
+	gen_timestamps(f, 0);
+	gen_serio(f);
+
+	fprintf(f, "ISR(TIMER1_COMPA_vect) {\n");
+	fprintf(f, "	uint8_t value_pinc = PINC;\n");
+	fprintf(f, "	uint8_t value_pind = PIND;\n");
+	fprintf(f, "	PORTB |= 0x02;\n");
+	fprintf(f, "	if (rle_en)\n");
+	fprintf(f, "		rle_push(pack(value_pinc, value_pind));\n");
+	fprintf(f, "	else\n");
+	fprintf(f, "		fifo_push(pack(value_pinc, value_pind));\n");
+	fprintf(f, "	PORTB &= ~0x02;\n");
+	fprintf(f, "}\n");
+
+	for (int i=0; i<2; i++) {
+		fprintf(f, "ISR(INT%d_vect) {\n", i);
+		fprintf(f, "	uint8_t value_pinc = PINC;\n");
+		fprintf(f, "	uint8_t value_pind = PIND;\n");
+		fprintf(f, "	uint16_t tcnt = TCNT1;\n");
+		fprintf(f, "	PORTB |= 0x02;\n");
+		fprintf(f, "	if (ts_en)\n");
+		fprintf(f, "		ts_push(pack(value_pinc, value_pind), tcnt);\n");
+		fprintf(f, "	else\n");
+		fprintf(f, "		fifo_push(pack(value_pinc, value_pind));\n");
+		fprintf(f, "	PORTB &= ~0x02;\n");
+		fprintf(f, "}\n");
+	}
+
+	fprintf(f, "uint8_t trigger_c, trigger_d;\n");
+	fprintf(f, "static void check_trigger() {\n");
+	fprintf(f, "	if (ts_en)\n");
+	fprintf(f, "		cli();\n");
+	fprintf(f, "	uint8_t value_pinc = PINC;\n");
+	fprintf(f, "	uint8_t value_pind = PIND;\n");
+	fprintf(f, "	uint16_t tcnt = TCNT1;\n");
+	fprintf(f, "	PORTB |= 0x01;\n");
+	fprintf(f, "	uint8_t edges = (value_pinc & ~trigger_c & pos_c) | (~value_pinc & trigger_c & neg_c) |\n");
+	fprintf(f, "			(value_pind & ~trigger_d & pos_d) | (~value_pind & trigger_d & neg_d);\n");
+	fprintf(f, "	trigger_c = value_pinc;\n");
+	fprintf(f, "	trigger_d = value_pind;\n");
+	fprintf(f, "	if (edges != 0) {\n");
+	fprintf(f, "		PORTB |= 0x02;\n");
+	fprintf(f, "		if (ts_en)\n");
+	fprintf(f, "			ts_push(pack(value_pinc, value_pind), tcnt);\n");
+	fprintf(f, "		else\n");
+	fprintf(f, "			fifo_push(pack(value_pinc, value_pind));\n");
+	fprintf(f, "	}\n");
+	fprintf(f, "	PORTB &= ~0x03;\n");
+	fprintf(f, "	if (ts_en)\n");
+	fprintf(f, "		sei();\n");
+	fprintf(f, "}\n");
+
+	char id[16];
+	sprintf(id, "U%x", UNIVERSAL_VERSION);
+	gen_ident(f, id);
+	gen_link(f);
+
+	// answer queries until a valid configuration frame is received
+	fprintf(f, "uint8_t frame[%d];\n", UNIVERSAL_FRAME_MAX);
+	fprintf(f, "static void configure() {\n");
+	fprintf(f, "	uint8_t len, sum, i, v;\n");
+	fprintf(f, "	while (1) {\n");
+	fprintf(f, "		serio_command('C');\n");
+	fprintf(f, "		len = serio_recv();\n");
+	fprintf(f, "		if (len < %d || len > %d)\n", UCFG_SIZE, UNIVERSAL_FRAME_MAX);
+	fprintf(f, "			continue;\n");
+	fprintf(f, "		for (i = 0, sum = 0; i < len; i++)\n");
+	fprintf(f, "			sum += frame[i] = serio_recv();\n");
+	fprintf(f, "		if (serio_recv() == sum)\n");
+	fprintf(f, "			break;\n");
+	fprintf(f, "	}\n");
+	fprintf(f, "	mode = frame[%d];\n", UCFG_MODE);
+	fprintf(f, "	rle_en = (frame[%d] & 0x%02x) != 0;\n", UCFG_FLAGS, UFLAG_RLE);
+	fprintf(f, "	ts_en = (frame[%d] & 0x%02x) != 0;\n", UCFG_FLAGS, UFLAG_TS);
+	fprintf(f, "	for (v = 0; v < 64; v++)\n");
+	fprintf(f, "		pack_c[v] = pack_d[v] = 0;\n");
+	fprintf(f, "	num_bits = 0;\n");
+	fprintf(f, "	for (i = 0; i < 6; i++) {\n");
+	fprintf(f, "		if ((frame[%d] & (1 << i)) == 0)\n", UCFG_CAPC);
+	fprintf(f, "			continue;\n");
+	fprintf(f, "		for (v = 0; v < 64; v++)\n");
+	fprintf(f, "			if ((v & (1 << i)) != 0)\n");
+	fprintf(f, "				pack_c[v] |= 1 << num_bits;\n");
+	fprintf(f, "		num_bits++;\n");
+	fprintf(f, "	}\n");
+	fprintf(f, "	for (i = 0; i < 6; i++) {\n");
+	fprintf(f, "		if ((frame[%d] & (4 << i)) == 0)\n", UCFG_CAPD);
+	fprintf(f, "			continue;\n");
+	fprintf(f, "		for (v = 0; v < 64; v++)\n");
+	fprintf(f, "			if ((v & (1 << i)) != 0)\n");
+	fprintf(f, "				pack_d[v] |= 1 << num_bits;\n");
+	fprintf(f, "		num_bits++;\n");
+	fprintf(f, "	}\n");
+	fprintf(f, "	fifo_push = fifo_push_width[num_bits - 1];\n");
+	fprintf(f, "	pos_c = frame[%d];\n", UCFG_POSC);
+	fprintf(f, "	neg_c = frame[%d];\n", UCFG_NEGC);
+	fprintf(f, "	pos_d = frame[%d];\n", UCFG_POSD);
+	fprintf(f, "	neg_d = frame[%d];\n", UCFG_NEGD);
+	fprintf(f, "	PORTC = frame[%d];\n", UCFG_PULLUPC);
+	fprintf(f, "	PORTD = frame[%d] | _BV(1);\n", UCFG_PULLUPD);
+	fprintf(f, "	// the header of the configuration\n");
+	fprintf(f, "	for (i = %d; i < len; i++)\n", UCFG_SIZE);
+	fprintf(f, "		fifo_data[fifo_in++] = frame[i];\n");
+	fprintf(f, "	fifo_data[fifo_in] = 0x80;\n");
+	fprintf(f, "	fifo_bits = 7;\n");
+	fprintf(f, "	error_code = 0;\n");
+	fprintf(f, "	rle_last = 0;\n");
+	fprintf(f, "	rle_count = 0;\n");
+	fprintf(f, "	ts_last = 0;\n");
+	fprintf(f, "}\n");
+
+	fprintf(f, "static void capture() {\n");
+	fprintf(f, "	fifo_push_en = true;\n");
+	fprintf(f, "	if (mode == %d) {\n", UMODE_FREQ);
+	fprintf(f, "		if (rle_en)\n");
+	fprintf(f, "			rle_push(pack(PINC, PIND));\n");
+	fprintf(f, "		else\n");
+	fprintf(f, "			fifo_push(pack(PINC, PIND));\n");
+	fprintf(f, "		PORTB |= 0x10;\n");
+	fprintf(f, "		TCCR1A = 0;\n");
+	fprintf(f, "		TCCR1B = frame[%d];\n", UCFG_TCCR1B);
+	fprintf(f, "		TCCR1C = 0;\n");
+	fprintf(f, "		TCNT1 = 0;\n");
+	fprintf(f, "		OCR1A = frame[%d] << 8 | frame[%d];\n", UCFG_OCR1AH, UCFG_OCR1AL);
+	fprintf(f, "		TIFR1 = _BV(OCF1A);\n");
+	fprintf(f, "		TIMSK1 = 0x02;\n");
+	fprintf(f, "		sei();\n");
+	fprintf(f, "		while ((UCSR0A & _BV(RXC0)) == 0) {\n");
+	fprintf(f, "			PINB = 0x01;\n");
+	fprintf(f, "			serio_send();\n");
+	fprintf(f, "		}\n");
+	fprintf(f, "		PORTB &= ~0x10;\n");
+	fprintf(f, "		TIMSK1 = 0;\n");
+	fprintf(f, "		if (rle_en)\n");
+	fprintf(f, "			rle_flush();\n");
+	fprintf(f, "	} else if (mode == %d) {\n", UMODE_IRQ);
+	fprintf(f, "		if (ts_en) {\n");
+	gen_timer_start(f);
+	fprintf(f, "			ts_push(pack(PINC, PIND), TCNT1);\n");
+	fprintf(f, "		} else\n");
+	fprintf(f, "			fifo_push(pack(PINC, PIND));\n");
+	fprintf(f, "		fifo_push_en = false;\n");
+	fprintf(f, "		EICRA = frame[%d];\n", UCFG_EICRA);
+	fprintf(f, "		EIFR = 0x03;\n");
+	fprintf(f, "		EIMSK = frame[%d];\n", UCFG_EIMSK);
+	fprintf(f, "		sei();\n");
+	fprintf(f, "		fifo_push_en = true;\n");
+	fprintf(f, "		PORTB |= 0x10;\n");
+	fprintf(f, "		while ((UCSR0A & _BV(RXC0)) == 0) {\n");
+	fprintf(f, "			PINB = 0x01;\n");
+	fprintf(f, "			serio_send();\n");
+	fprintf(f, "		}\n");
+	fprintf(f, "		PORTB &= ~0x10;\n");
+	fprintf(f, "		EIMSK = 0;\n");
+	fprintf(f, "		TIMSK1 = 0;\n");
+	fprintf(f, "	} else {\n");
+	fprintf(f, "		if (ts_en) {\n");
+	gen_timer_start(f);
+	fprintf(f, "		}\n");
+	fprintf(f, "		// the state at the start is always sent\n");
+	fprintf(f, "		trigger_c = PINC;\n");
+	fprintf(f, "		trigger_d = PIND;\n");
+	fprintf(f, "		if (ts_en) {\n");
+	fprintf(f, "			ts_push(pack(trigger_c, trigger_d), TCNT1);\n");
+	fprintf(f, "			sei();\n");
+	fprintf(f, "		} else\n");
+	fprintf(f, "			fifo_push(pack(trigger_c, trigger_d));\n");
+	fprintf(f, "		PORTB |= 0x10;\n");
+	fprintf(f, "		while ((UCSR0A & _BV(RXC0)) == 0) {\n");
+	fprintf(f, "			serio_send();\n");
+	fprintf(f, "			check_trigger();\n");
+	fprintf(f, "		}\n");
+	fprintf(f, "		PORTB &= ~0x10;\n");
+	fprintf(f, "		TIMSK1 = 0;\n");
+	fprintf(f, "	}\n");
+	fprintf(f, "	cli();\n");
+	fprintf(f, "	TCCR1B = 0;\n");
+	fprintf(f, "	fifo_push_en = false;\n");
+	fprintf(f, "	fifo_close();\n");
+	fprintf(f, "	while (fifo_in != fifo_out)\n");
+	fprintf(f, "		serio_send();\n");
+	fprintf(f, "	fifo_data[fifo_in++] = 0;\n");
+	fprintf(f, "	fifo_data[fifo_in++] = 1;\n");
+	fprintf(f, "	fifo_data[fifo_in++] = error_code;\n");
+	fprintf(f, "	while (fifo_in != fifo_out)\n");
+	fprintf(f, "		serio_send();\n");
+	fprintf(f, "	// drop the stop request\n");
+	fprintf(f, "	while ((UCSR0A & _BV(RXC0)) != 0)\n");
+	fprintf(f, "		(void)UDR0;\n");
+	fprintf(f, "}\n");
+
+	fprintf(f, "int main() {\n");
+	fprintf(f, "	DDRB = 0x3f;\n");
+	fprintf(f, "	DDRC = 0;\n");
+	fprintf(f, "	DDRD = 0;\n");
+	fprintf(f, "	PORTB = 0;\n");
+	fprintf(f, "	PORTC = 0;\n");
+	fprintf(f, "	PORTD = 0;\n");
+	fprintf(f, "	serio_setup();\n");
+	fprintf(f, "	send_ident();\n");
+	fprintf(f, "	while (1) {\n");
+	fprintf(f, "		configure();\n");
+	fprintf(f, "		capture();\n");
+	fprintf(f, "		link_speed(%d);\n", LINK_UBRR(LINK_SAFE_BAUD));
+	fprintf(f, "	}\n");
+	fprintf(f, "	return 0;\n");
+	fprintf(f, "}\n");
+}
+
+// The configuration frame for the universal firmware (see ardulogic.h), with
+// the header the probe sends back. Returns the length of the frame.
+int universal_frame(uint8_t *frame, const char *header, int header_len)
+{
+	int len = UCFG_SIZE + header_len;
+	if (len > UNIVERSAL_FRAME_MAX) {
+		fprintf(stderr, "Configuration too large for the universal firmware.\n");
+		exit(1);
+	}
+
+	uint8_t *cfg = frame + 2;
+	memset(cfg, 0, UCFG_SIZE);
+	cfg[UCFG_MODE] = trigger_mode();
+	cfg[UCFG_FLAGS] = (trigger_rle ? UFLAG_RLE : 0) | (timestamps ? UFLAG_TS : 0);
+	cfg[UCFG_CAPC] = pinc_mask(PIN_CAPTURE);
+	cfg[UCFG_CAPD] = pind_mask(PIN_CAPTURE);
+	cfg[UCFG_PULLUPC] = pinc_mask(PIN_PULLUP);
+	cfg[UCFG_PULLUPD] = pind_mask(PIN_PULLUP);
+	cfg[UCFG_POSC] = pinc_mask(PIN_TRIGGER_POSEDGE);
+	cfg[UCFG_NEGC] = pinc_mask(PIN_TRIGGER_NEGEDGE);
+	cfg[UCFG_POSD] = pind_mask(PIN_TRIGGER_POSEDGE);
+	cfg[UCFG_NEGD] = pind_mask(PIN_TRIGGER_NEGEDGE);
+
+	if (cfg[UCFG_MODE] == UMODE_FREQ) {
+		uint16_t ocr1a;
+		timer_config(cfg[UCFG_TCCR1B], ocr1a);
+		cfg[UCFG_OCR1AH] = ocr1a >> 8;
+		cfg[UCFG_OCR1AL] = ocr1a & 0xff;
+	}
+	if (cfg[UCFG_MODE] == UMODE_IRQ)
+		irq_config(cfg[UCFG_EICRA], cfg[UCFG_EIMSK]);
+
+	memcpy(cfg + UCFG_SIZE, header, header_len);
+
+	uint8_t sum = 0;
+	for (int i = 0; i < len; i++)
+		sum += cfg[i];
+	frame[0] = 'C';
+	frame[1] = len;
+	frame[len + 2] = sum;
+	return len + 3;
+}
+
+#define AVR_GCC_FLAGS "-Wall -std=gnu99 -O3 -mmcu=atmega328p -DF_CPU=16000000L"
+
+// 64 bit FNV-1a, for the names of the cached firmware images
+static uint64_t fnv1a(uint64_t h, const char *p, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		h ^= (uint8_t)p[i];
+		h *= 0x100000001b3ull;
+	}
+	return h;
+}
+
+// The header the probe sends before the samples, hdrlen is the length of the
+// fixed part before the configuration. Returns the length of the header.
+int config_header(char *header, int &hdrlen)
+{
+	strcpy(header, "..ARDULOGIC:");
+	int hp = strlen(header);
+	hdrlen = hp;
+	header[0] = header[1] = 0;
+	for (int i = 0; i < TOTAL_PIN_NUM; i++)
+		header[hp++] = pins[i] + '0';
+	hp += sprintf(header + hp, ":%x:%s%s\r\n", trigger_freq, trigger_rle ? "rle:" : "", timestamps ? "ts:" : "");
+	return hp;
+}
+
+// the hash of the configuration part of the header, sent by the firmware
+// in the answer to a query
+uint32_t config_hash()
+{
+	char header[100 + TOTAL_PIN_NUM];
+	int hdrlen, hp = config_header(header, hdrlen);
+	uint64_t hash = fnv1a(0xcbf29ce484222325ull, header + hdrlen, hp - hdrlen);
+	return hash ^ (hash >> 32);
+}
+
+// the compiler version is part of the cache key
+static std::string toolchain_id()
+{
+	std::string id = AVR_GCC_FLAGS "\n";
+	FILE *p = popen("avr-gcc --version 2>/dev/null", "r");
+	if (p != NULL) {
+		char buffer[256];
+		if (fgets(buffer, sizeof(buffer), p) != NULL)
+			id += buffer;
+		pclose(p);
+	}
+	return id;
+}
+
+// Compiled images are kept in $XDG_CACHE_HOME/ardulogic (or ~/.cache/ardulogic),
+// named by the hash of the source and the toolchain. Returns an empty string
+// when there is no usable cache directory.
+static std::string cache_dir()
+{
+	std::string dir;
+	if (getenv("XDG_CACHE_HOME") != NULL && *getenv("XDG_CACHE_HOME"))
+		dir = getenv("XDG_CACHE_HOME");
+	else if (getenv("HOME") != NULL && *getenv("HOME"))
+		dir = std::string(getenv("HOME")) + "/.cache";
+	else
+		return "";
+	mkdir(dir.c_str(), 0755);
+	dir += "/ardulogic";
+	if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST)
+		return "";
+	return dir;
+}
+
+static void write_file(const std::string &file, const char *data, size_t len)
+{
+	FILE *f = fopen(file.c_str(), "w");
+	if (f == NULL || fwrite(data, 1, len, f) != len || fclose(f) != 0) {
+		fprintf(stderr, "Can't write firmware source file `%s': %s\n", file.c_str(), strerror(errno));
+		exit(1);
+	}
+}
+
+// Copy the image into the cache. The copy is written under a unique name
+// and renamed, so concurrent builds never see a partial image.
+static bool cache_file(const std::string &from, const std::string &to)
+{
+	std::string part = to + "." + std::to_string(getpid());
+	FILE *in = fopen(from.c_str(), "r");
+	FILE *out = in ? fopen(part.c_str(), "w") : NULL;
+	bool ok = out != NULL;
+
+	char buffer[4096];
+	size_t n;
+	while (ok && (n = fread(buffer, 1, sizeof(buffer), in)) > 0)
+		ok = fwrite(buffer, 1, n, out) == n;
+
+	if (in != NULL)
+		fclose(in);
+	if (out != NULL && fclose(out) != 0)
+		ok = false;
+	if (ok && rename(part.c_str(), to.c_str()) == 0)
+		return true;
+	remove(part.c_str());
+	return false;
+}
+
+// Build the firmware image (or take it from the cache) and program it,
+// unless the probe already sends the header of this configuration.
+static void build_and_program(const char *tts, const char *source, size_t source_len, bool check_probe)
+{
+	std::string toolchain = toolchain_id();
+	uint64_t hash = fnv1a(0xcbf29ce484222325ull, source, source_len);
+	hash = fnv1a(hash, toolchain.data(), toolchain.size());
+
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.hex", (unsigned long long)hash);
+	std::string cache = cache_dir();
+	std::string hex = cache.empty() ? "" : cache + "/" + name;
+
+	// unique build directory, so several instances can build at once
+	const char *tmp = getenv("TMPDIR");
+	std::string tmpdir = std::string(tmp && *tmp ? tmp : "/tmp") + "/ardulogic-XXXXXX";
+	if (mkdtemp(&tmpdir[0]) == NULL) {
+		fprintf(stderr, "Can't create build directory `%s': %s\n", tmpdir.c_str(), strerror(errno));
+		exit(1);
+	}
+	setenv("ARDULOGIC_BUILD", tmpdir.c_str(), 1);
+	write_file(tmpdir + "/firmware.c", source, source_len);
+
+	int rc = 0;
+	if (!hex.empty() && access(hex.c_str(), R_OK) == 0) {
+		printf("Using cached firmware image `%s'.\n", hex.c_str());
+	} else {
+		rc = system("set -x; avr-gcc " AVR_GCC_FLAGS " -o \"$ARDULOGIC_BUILD/firmware.elf\" \"$ARDULOGIC_BUILD/firmware.c\"");
+		rc = rc ?: system("set -x; avr-objcopy -j .text -j .data -O ihex \"$ARDULOGIC_BUILD/firmware.elf\" \"$ARDULOGIC_BUILD/firmware.hex\"");
+		if (rc == 0 && !hex.empty() && !cache_file(tmpdir + "/firmware.hex", hex))
+			hex.clear();
+		if (hex.empty())
+			hex = tmpdir + "/firmware.hex";
+	}
+
+	if (rc == 0 && check_probe && probe_matches(tts)) {
+		printf("The probe already runs the firmware for this configuration.\n");
+	} else if (rc == 0) {
+		setenv("ARDUINO_TTY", tts, 1);
+		setenv("ARDULOGIC_HEX", hex.c_str(), 1);
+		rc = system("set -x; avrdude -p m328p -b 115200 -c arduino -P \"$ARDUINO_TTY\" -v -U \"flash:w:$ARDULOGIC_HEX:i\"");
+	}
+
+	if (dont_cleanup_fwsrc == false) {
+		remove((tmpdir + "/firmware.c").c_str());
+		remove((tmpdir + "/firmware.elf").c_str());
+		remove((tmpdir + "/firmware.hex").c_str());
+		rmdir(tmpdir.c_str());
+	} else
+		printf("Firmware source kept in `%s'.\n", tmpdir.c_str());
+
+	if (rc) {
+		fprintf(stderr, "Error while compiling firmware or programming the arduino!\n");
+		exit(1);
+	}
+}
+
+void genfirmware(const char *tts, bool check_probe)
+{
+	int num_trigger = 0;
+	int num_bits = 0;
+
+	for (int i = 0; i < TOTAL_PIN_NUM; i++) {
+		if ((pins[i] & (PIN_TRIGGER_POSEDGE | PIN_TRIGGER_NEGEDGE)) != 0)
+			num_trigger++;
+		if ((pins[i] & PIN_CAPTURE) != 0)
+			num_bits++;
+	}
+
+	char *source = NULL;
+	size_t source_len = 0;
+	FILE *f = open_memstream(&source, &source_len);
 	if (!f) {
-		fprintf(stderr, "Can't create firmware source file `.ardulogic_tmp.firmware.c': %s\n", strerror(errno));
+		fprintf(stderr, "Can't create firmware source: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	if (universal_firmware) {
+		gen_universal(f);
+		fclose(f);
+		if (tts)
+			build_and_program(tts, source, source_len, check_probe);
+		free(source);
+		return;
+	}
+
+	if (num_trigger > 7) {
+		fprintf(stderr, "A maximum of 7 trigger pins is supported by the firmware generator.\n");
 		exit(1);
 	}
 
+	int mode = trigger_mode();
+	bool use_irq_trigger = mode != UMODE_POLL;
+
 	fprintf(f, "#include <stdint.h>\n");
 	fprintf(f, "#include <stdbool.h>\n");
 	fprintf(f, "#include <avr/io.h>\n");
+	fprintf(f, "#include <avr/pgmspace.h>\n");
 	fprintf(f, "#include <avr/sleep.h>\n");
 	fprintf(f, "#include <avr/interrupt.h>\n");
 	fprintf(f, "typedef uint%d_t smplword_t;\n", num_bits <= 8 ? 8 : 16);
 	fprintf(f, "volatile uint8_t error_code = 0;\n");
 
-	gen_pack(f);
+	gen_pack(f, num_bits);
 	gen_fifo(f, num_bits);
+	if (trigger_rle)
+		gen_rle(f, num_bits);
+	if (timestamps)
+		gen_timestamps(f, num_bits);
 	gen_serio(f);
 
 	if (trigger_freq > 0)
@@ -253,36 +1118,29 @@ void genfirmware(const char *tts)
 	else
 		gen_trigger(f);
 
-	char header[100 + TOTAL_PIN_NUM] = "..ARDULOGIC:";
-	int hp = strlen(header);
-	header[0] =  header[1] = 0;
-	for (int i = 0; i < TOTAL_PIN_NUM; i++)
-		header[hp++] = pins[i] + '0';
-	hp += sprintf(header + hp, ":%x:\r\n", trigger_freq);
+	char id[16];
+	sprintf(id, "%08x", config_hash());
+	gen_ident(f, id);
+	gen_link(f);
 
-	uint8_t pullupc = 0, pullupd = 0;
-	for (int i = 0; i < TOTAL_PIN_NUM; i++) {
-		if ((pins[i] & PIN_PULLUP) == 0)
-			continue;
-		if (PIN_A(0) <= i && i <= PIN_A(5))
-			pullupc |= 1 << (i-PIN_A(0));
-		if (PIN_D(2) <= i && i <= PIN_D(7))
-			pullupd |= 1 << (i-PIN_D(0));
-	}
+	char header[100 + TOTAL_PIN_NUM];
+	int hdrlen, hp = config_header(header, hdrlen);
 
-	fprintf(f, "int main() {\n");
-	fprintf(f, "	DDRB = 0x3f;\n");
-	fprintf(f, "	DDRC = 0;\n");
-	fprintf(f, "	DDRD = 0;\n");
-	fprintf(f, "	PORTB = 0;\n");
-	fprintf(f, "	PORTC = 0x%02x;\n", pullupc);
-	fprintf(f, "	PORTD = 0x%02x;\n", pullupd);
-	fprintf(f, "	serio_setup();\n");
-	for (int i = 0; i < 8; i++)
-		fprintf(f, "	fifo_data[fifo_in++] = 0;\n");
+	// a capture, started by PROBE_START
+	fprintf(f, "static void capture() {\n");
 	for (int i = 0; i < hp; i++)
 		fprintf(f, "	fifo_data[fifo_in++] = 0x%02x;\n", header[i]);
-	fprintf(f, "	fifo_data[fifo_in] |= 0x80;\n");
+	fprintf(f, "	fifo_data[fifo_in] = 0x80;\n");
+	fprintf(f, "	fifo_bits = 7;\n");
+	fprintf(f, "	error_code = 0;\n");
+	if (trigger_rle) {
+		fprintf(f, "	rle_last = 0;\n");
+		fprintf(f, "	rle_count = 0;\n");
+	}
+	if (timestamps)
+		fprintf(f, "	ts_last = 0;\n");
+	if (trigger_freq == 0 && !use_irq_trigger)
+		fprintf(f, "	trigger_state = 0x80;\n");
 
 	if (trigger_freq > 0)
 	{
@@ -290,55 +1148,16 @@ void genfirmware(const char *tts)
 		uint16_t tcnt1 = 0, ocr1a = 0, ocr1b = 0, icr1 = 0;
 		uint8_t timsk1 = 0, tifr1 = 0;
 
-		int prescale = 1;
-		int prescale_bits = 1;
-		int cycles;
-
-		while (1)
-		{
-			cycles = round((16e6 / prescale) / trigger_freq);
-			if (cycles < 64000)
-				break;
-
-			switch (prescale)
-			{
-			case 1:
-				prescale = 8;
-				prescale_bits = 2;
-				break;
-			case 8:
-				prescale = 64;
-				prescale_bits = 3;
-				break;
-			case 64:
-				prescale = 256;
-				prescale_bits = 4;
-				break;
-			case 256:
-				prescale = 1024;
-				prescale_bits = 5;
-				break;
-			default:
-				assert(!"This should never happen");
-				exit(1);
-			}
-		}
-
-		printf("Configure trigger for %.2f kHz (prescale=%d, cycles=%d).\n",
-				16e6 / (prescale * cycles), prescale, cycles);
-
-		// CTC mode: set CTC1/WGM12 in tccr1b
-		tccr1b |= 0x08;
-
-		// configure prescaler and cycles
-		tccr1b |= prescale_bits;
-		ocr1a = cycles;
+		timer_config(tccr1b, ocr1a);
 
 		// enable ionterrupt (timer 1 comp A)
 		timsk1 |= 0x02;
 
+		// clear a compare match left from the last capture
+		tifr1 |= 0x02;
+
 		fprintf(f, "	fifo_push_en = true;\n");
-		fprintf(f, "	fifo_push(pack(PINC, PIND));\n");
+		fprintf(f, "	%s(pack(PINC, PIND));\n", trigger_rle ? "rle_push" : "fifo_push");
 		fprintf(f, "	PORTB |= 0x10;\n");
 
 		fprintf(f, "	TCCR1A = 0x%02x;\n", tccr1a);
@@ -362,51 +1181,23 @@ void genfirmware(const char *tts)
 		fprintf(f, "	}\n");
 
 		fprintf(f, "	PORTB &= ~0x10;\n");
+		if (trigger_rle) {
+			fprintf(f, "	TIMSK1 = 0;\n");
+			fprintf(f, "	rle_flush();\n");
+		}
 		fprintf(f, "	fifo_push_en = false;\n");
-
-		fprintf(f, "	// EICRA = 0;\n");
-		fprintf(f, "	// EIMSK = 0;\n");
-		fprintf(f, "	// cli();\n");
 	}
 	else if (use_irq_trigger)
 	{
-		uint8_t eicra = 0;
-		uint8_t eimsk = 0;
-
-		switch (pins[PIN_D(2)] & (PIN_TRIGGER_POSEDGE|PIN_TRIGGER_NEGEDGE))
-		{
-		case PIN_TRIGGER_POSEDGE|PIN_TRIGGER_NEGEDGE:
-			eicra |= 0x01;
-			eimsk |= 0x01;
-			break;
-		case PIN_TRIGGER_NEGEDGE:
-			eicra |= 0x02;
-			eimsk |= 0x01;
-			break;
-		case PIN_TRIGGER_POSEDGE:
-			eicra |= 0x03;
-			eimsk |= 0x01;
-			break;
-		}
-
-		switch (pins[PIN_D(3)] & (PIN_TRIGGER_POSEDGE|PIN_TRIGGER_NEGEDGE))
-		{
-		case PIN_TRIGGER_POSEDGE|PIN_TRIGGER_NEGEDGE:
-			eicra |= 0x04;
-			eimsk |= 0x02;
-			break;
-		case PIN_TRIGGER_NEGEDGE:
-			eicra |= 0x06;
-			eimsk |= 0x02;
-			break;
-		case PIN_TRIGGER_POSEDGE:
-			eicra |= 0x0c;
-			eimsk |= 0x02;
-			break;
-		}
+		uint8_t eicra, eimsk;
+		irq_config(eicra, eimsk);
 
 		fprintf(f, "	fifo_push_en = true;\n");
-		fprintf(f, "	fifo_push(pack(PINC, PIND));\n");
+		if (timestamps) {
+			gen_timer_start(f);
+			fprintf(f, "	ts_push(pack(PINC, PIND), TCNT1);\n");
+		} else
+			fprintf(f, "	fifo_push(pack(PINC, PIND));\n");
 		fprintf(f, "	fifo_push_en = false;\n");
 
 		fprintf(f, "	EICRA = 0x%02x;\n", eicra);
@@ -422,51 +1213,63 @@ void genfirmware(const char *tts)
 		fprintf(f, "		serio_send();\n");
 		fprintf(f, "	}\n");
 		fprintf(f, "	PORTB &= ~0x10;\n");
+		if (timestamps)
+			fprintf(f, "	TIMSK1 = 0;\n");
 		fprintf(f, "	fifo_push_en = false;\n");
-
-		fprintf(f, "	// EICRA = 0;\n");
-		fprintf(f, "	// EIMSK = 0;\n");
-		fprintf(f, "	// cli();\n");
 	}
 	else
 	{
 		fprintf(f, "	fifo_push_en = true;\n");
+		if (timestamps) {
+			gen_timer_start(f);
+			fprintf(f, "	sei();\n");
+		}
 		fprintf(f, "	PORTB |= 0x10;\n");
 		fprintf(f, "	while ((UCSR0A & _BV(RXC0)) == 0) {\n");
 		fprintf(f, "		serio_send();\n");
 		fprintf(f, "		check_trigger();\n");
 		fprintf(f, "	}\n");
 		fprintf(f, "	PORTB &= ~0x10;\n");
+		if (timestamps)
+			fprintf(f, "	TIMSK1 = 0;\n");
 		fprintf(f, "	fifo_push_en = false;\n");
 	}
 
+	fprintf(f, "	cli();\n");
 	fprintf(f, "	fifo_close();\n");
 	fprintf(f, "	while (fifo_in != fifo_out)\n");
 	fprintf(f, "		serio_send();\n");
 	fprintf(f, "	fifo_data[fifo_in++] = 0;\n");
 	fprintf(f, "	fifo_data[fifo_in++] = 1;\n");
 	fprintf(f, "	fifo_data[fifo_in++] = error_code;\n");
-	fprintf(f, "	while (1)\n");
+	fprintf(f, "	while (fifo_in != fifo_out)\n");
 	fprintf(f, "		serio_send();\n");
+	fprintf(f, "	// drop the stop request\n");
+	fprintf(f, "	while ((UCSR0A & _BV(RXC0)) != 0)\n");
+	fprintf(f, "		(void)UDR0;\n");
+	fprintf(f, "}\n");
+
+	fprintf(f, "int main() {\n");
+	fprintf(f, "	DDRB = 0x3f;\n");
+	fprintf(f, "	DDRC = 0;\n");
+	fprintf(f, "	DDRD = 0;\n");
+	fprintf(f, "	PORTB = 0;\n");
+	fprintf(f, "	PORTC = 0x%02x;\n", pinc_mask(PIN_PULLUP));
+	fprintf(f, "	PORTD = 0x%02x;\n", pind_mask(PIN_PULLUP));
+	fprintf(f, "	serio_setup();\n");
+	fprintf(f, "	send_ident();\n");
+	fprintf(f, "	while (1) {\n");
+	fprintf(f, "		serio_command('%c');\n", PROBE_START);
+	fprintf(f, "		capture();\n");
+	fprintf(f, "		link_speed(%d);\n", LINK_UBRR(LINK_SAFE_BAUD));
+	fprintf(f, "	}\n");
 	fprintf(f, "	return 0;\n");
 	fprintf(f, "}\n");
 
 	fclose(f);
 
-	if (tts) {
-		setenv("ARDUINO_TTY", tts, 1);
-		int rc = system("set -x; avr-gcc -Wall -std=gnu99 -O3 -o .ardulogic_tmp.firmware.elf -mmcu=atmega328p -DF_CPU=16000000L .ardulogic_tmp.firmware.c");
-		rc = rc ?: system("set -x; avr-objcopy -j .text -j .data -O ihex .ardulogic_tmp.firmware.elf .ardulogic_tmp.firmware.hex");
-		rc = rc ?: system("set -x; avrdude -p m328p -b 115200 -c arduino -P \"$ARDUINO_TTY\" -v -U \"flash:w:.ardulogic_tmp.firmware.hex\"");
-		if (dont_cleanup_fwsrc == false) {
-			remove(".ardulogic_tmp.firmware.c");
-			remove(".ardulogic_tmp.firmware.elf");
-			remove(".ardulogic_tmp.firmware.hex");
-		}
-		if (rc) {
-			fprintf(stderr, "Error while compiling firmware or programming the arduino!\n");
-			exit(1);
-		}
-	}
+	if (tts)
+		build_and_program(tts, source, source_len, check_probe);
+	free(source);
 }
 
@@ -34,10 +34,35 @@ extern int yylex(void);
 extern int yyget_lineno(void);
 
 void check_decode(int v) {
-	if (decode != 0 && decode != v) {
+	if (decode != 0 && decode != v && (decode < DECODE_SPI || v < DECODE_SPI)) {
 		fprintf(stderr, "Config error in line %d: Conflicting decode and/or trigger statements\n", yyget_lineno());
 		exit(1);
 	}
+	if (v >= DECODE_SPI && num_decoders == MAX_DECODERS) {
+		fprintf(stderr, "Config error in line %d: More than %d decode statements\n", yyget_lineno(), MAX_DECODERS);
+		exit(1);
+	}
+}
+
+// the statement for decoder number num_decoders is complete
+void add_decoder(int v) {
+	if (decode == 0)
+		decode = v;
+	decoder_type[num_decoders++] = v;
+}
+
+// the record statement with the window sizes as given (negative: ms)
+static int record_pre_cfg, record_post_cfg;
+
+struct record_match *add_match(int type) {
+	if (num_matches == MAX_MATCHES) {
+		fprintf(stderr, "Config error in line %d: More than %d match statements\n", yyget_lineno(), MAX_MATCHES);
+		exit(1);
+	}
+	struct record_match *m = &matches[num_matches++];
+	memset(m, 0, sizeof(*m));
+	m->type = type;
+	return m;
 }
 
 void yyerror (char const *s) {
@@ -54,14 +79,17 @@ void yyerror (char const *s) {
 
 %token <num> TOK_PIN
 %token <num> TOK_FREQ
+%token <num> TOK_NUM
+%token <num> TOK_MSEC
 %token <str> TOK_STRING
 
 %token TOK_TRIGGER TOK_POSEDGE TOK_NEGEDGE
 %token TOK_DECODE TOK_SPI TOK_I2C TOK_JTAG
-%token TOK_CAPTURE TOK_PULLUP TOK_LABEL TOK_EOL
+%token TOK_CAPTURE TOK_PULLUP TOK_LABEL TOK_LINK TOK_EOL
 %token TOK_MSB TOK_LSB
+%token TOK_RECORD TOK_REARM TOK_MATCH TOK_DATA TOK_RLE TOK_TIMESTAMP
 
-%type <num> edge neg msb_notlsb
+%type <num> edge neg msb_notlsb spi_bits record_len rearm rle
 
 %%
 
@@ -71,7 +99,8 @@ config:
 	config stmt TOK_EOL;
 
 stmt:
-	stmt_trigger | stmt_capture | stmt_pullup | stmt_decode | stmt_label;
+	stmt_trigger | stmt_capture | stmt_pullup | stmt_decode | stmt_label |
+	stmt_record | stmt_match | stmt_timestamp | stmt_link;
 
 stmt_trigger:
 	TOK_TRIGGER edge TOK_PIN {
@@ -79,12 +108,36 @@ stmt_trigger:
 		pins[$3] |= $2;
 		decode = DECODE_TRIGGER;
 	} |
-	TOK_TRIGGER TOK_FREQ {
+	TOK_TRIGGER TOK_FREQ rle {
 		check_decode(0);
 		trigger_freq = $2;
+		trigger_rle = $3;
 		decode = DECODE_FREQ;
 	};
 
+rle:
+	/* empty */ {
+		$$ = 0;
+	} |
+	TOK_RLE {
+		$$ = 1;
+	};
+
+stmt_timestamp:
+	TOK_TIMESTAMP {
+		timestamps = true;
+	};
+
+stmt_link:
+	TOK_LINK TOK_NUM {
+		if ($2 < LINK_SAFE_BAUD || $2 > LINK_MAX_BAUD) {
+			fprintf(stderr, "Config error in line %d: Link speed must be between %d and %d baud\n",
+					yyget_lineno(), LINK_SAFE_BAUD, LINK_MAX_BAUD);
+			exit(1);
+		}
+		link_baud = $2;
+	};
+
 stmt_capture:
 	TOK_CAPTURE capture_list;
 
@@ -108,36 +161,48 @@ pullup_list:
 	};
 
 stmt_decode:
-	TOK_DECODE TOK_SPI edge msb_notlsb TOK_PIN neg TOK_PIN TOK_PIN TOK_PIN {
-		check_decode(0);
-		decode_config[CFG_SPI_MSB]   = $4;
-		decode_config[CFG_SPI_CSNEG] = $6;
-		decode_config[CFG_SPI_CS]    = $7;
-		pins[$5] |= $3; // SCK
-		pins[$7] |= PIN_CAPTURE | PIN_TRIGGER_POSEDGE | PIN_TRIGGER_NEGEDGE; // CS
-		pins[$8] |= PIN_CAPTURE; // MOSI
-		pins[$9] |= PIN_CAPTURE; // MISO
-		pin_names[$5] = "SCK";
-		pin_names[$7] = "CS";
-		pin_names[$8] = "MOSI";
-		pin_names[$9] = "MISO";
-		decode = DECODE_SPI;
+	TOK_DECODE TOK_SPI edge msb_notlsb spi_bits TOK_PIN neg TOK_PIN TOK_PIN TOK_PIN spi_cs_list {
+		check_decode(DECODE_SPI);
+		int *cfg = decode_config[num_decoders];
+		cfg[CFG_SPI_MSB]   = $4;
+		cfg[CFG_SPI_CSNEG] = $7;
+		cfg[CFG_SPI_CS]    = $8;
+		cfg[CFG_SPI_BITS]  = $5;
+		cfg[CFG_SPI_CSMASK] |= 1 << $8;
+		cfg[CFG_SPI_CSNEGMASK] |= $7 << $8;
+		cfg[CFG_SPI_SCK] = $6 + 1;
+		cfg[CFG_SPI_SCKEDGE] = $3;
+		cfg[CFG_SPI_DATAMASK] = (1 << $9) | (1 << $10);
+		cfg[CFG_SPI_MOSI] = $9 + 1;
+		cfg[CFG_SPI_MISO] = $10 + 1;
+		pins[$6] |= $3; // SCK
+		pins[$8] |= PIN_CAPTURE | PIN_TRIGGER_POSEDGE | PIN_TRIGGER_NEGEDGE; // CS
+		pins[$9] |= PIN_CAPTURE; // MOSI
+		pins[$10] |= PIN_CAPTURE; // MISO
+		pin_names[$6] = "SCK";
+		pin_names[$8] = "CS";
+		pin_names[$9] = "MOSI";
+		pin_names[$10] = "MISO";
+		add_decoder(DECODE_SPI);
 	} |
-	TOK_DECODE TOK_I2C TOK_PIN TOK_PIN {
-		check_decode(0);
-		decode_config[CFG_I2C_SCL] = $3;
-		decode_config[CFG_I2C_SDA] = $4;
+	TOK_DECODE TOK_I2C TOK_PIN TOK_PIN i2c_filter {
+		check_decode(DECODE_I2C);
+		int *cfg = decode_config[num_decoders];
+		cfg[CFG_I2C_SCL] = $3;
+		cfg[CFG_I2C_SDA] = $4;
 		pins[$3] |= PIN_CAPTURE | PIN_TRIGGER_POSEDGE | PIN_TRIGGER_NEGEDGE; // SCL
 		pins[$4] |= PIN_CAPTURE | PIN_TRIGGER_POSEDGE | PIN_TRIGGER_NEGEDGE; // SDA
 		pin_names[$3] = "SCL";
 		pin_names[$4] = "SDA";
-		decode = DECODE_I2C;
+		add_decoder(DECODE_I2C);
 	} |
 	TOK_DECODE TOK_JTAG TOK_PIN TOK_PIN TOK_PIN TOK_PIN {
-		check_decode(0);
-		decode_config[CFG_JTAG_TMS] = $4;
-		decode_config[CFG_JTAG_TDI] = $5;
-		decode_config[CFG_JTAG_TDO] = $6;
+		check_decode(DECODE_JTAG);
+		int *cfg = decode_config[num_decoders];
+		cfg[CFG_JTAG_TMS] = $4;
+		cfg[CFG_JTAG_TDI] = $5;
+		cfg[CFG_JTAG_TDO] = $6;
+		cfg[CFG_JTAG_TCK] = $3 + 1;
 		pins[$3] |= PIN_TRIGGER_POSEDGE; // TCK
 		pins[$4] |= PIN_CAPTURE; // TMS
 		pins[$5] |= PIN_CAPTURE; // TDI
@@ -146,7 +211,43 @@ stmt_decode:
 		pin_names[$4] = "TMS";
 		pin_names[$5] = "TDI";
 		pin_names[$6] = "TDO";
-		decode = DECODE_JTAG;
+		add_decoder(DECODE_JTAG);
+	};
+
+spi_bits:
+	/* empty */ {
+		$$ = 8;
+	} |
+	TOK_NUM {
+		if ($1 != 8 && $1 != 16 && $1 != 32) {
+			fprintf(stderr, "Config error in line %d: Unsupported SPI word width %d\n", yyget_lineno(), $1);
+			exit(1);
+		}
+		$$ = $1;
+	};
+
+spi_cs_list:
+	/* empty */ |
+	spi_cs_list neg TOK_PIN {
+		static const char *names[] = { "CS1", "CS2", "CS3", "CS4", "CS5", "CS6", "CS7", "CS8" };
+		check_decode(DECODE_SPI);
+		int *cfg = decode_config[num_decoders];
+		int n = __builtin_popcount(cfg[CFG_SPI_CSMASK] & ~(1 << $3));
+		cfg[CFG_SPI_CSMASK] |= 1 << $3;
+		cfg[CFG_SPI_CSNEGMASK] |= $2 << $3;
+		pins[$3] |= PIN_CAPTURE | PIN_TRIGGER_POSEDGE | PIN_TRIGGER_NEGEDGE; // additional CS
+		pin_names[$3] = names[n < 8 ? n : 7];
+	};
+
+i2c_filter:
+	/* empty */ |
+	i2c_filter TOK_NUM {
+		if ($2 < 0 || $2 > 127) {
+			fprintf(stderr, "Config error in line %d: Invalid I2C address %d\n", yyget_lineno(), $2);
+			exit(1);
+		}
+		check_decode(DECODE_I2C);
+		decode_config[num_decoders][CFG_I2C_FILTER + $2 / 32] |= 1u << ($2 % 32);
 	};
 
 stmt_label:
@@ -154,6 +255,64 @@ stmt_label:
 		pin_names[$2] = $3;
 	};
 
+stmt_record:
+	TOK_RECORD record_len record_len rearm {
+		record = true;
+		record_pre_cfg = $2;
+		record_post_cfg = $3;
+		record_rearm = $4;
+	};
+
+record_len:
+	TOK_NUM {
+		$$ = $1;
+	} |
+	TOK_MSEC {
+		$$ = -$1;
+	};
+
+rearm:
+	/* empty */ {
+		$$ = 0;
+	} |
+	TOK_REARM {
+		$$ = 1;
+	};
+
+stmt_match:
+	TOK_MATCH match_pins |
+	TOK_MATCH { add_match(MATCH_EDGES); } match_edges |
+	TOK_MATCH TOK_DATA TOK_NUM {
+		add_match(MATCH_DATA)->data = (unsigned)$3;
+	};
+
+match_pins:
+	match_pins neg TOK_PIN {
+		struct record_match *m = &matches[num_matches-1];
+		m->mask |= 1 << $3;
+		m->value |= !$2 << $3;
+	} |
+	neg TOK_PIN {
+		struct record_match *m = add_match(MATCH_PINS);
+		m->mask = 1 << $2;
+		m->value = !$1 << $2;
+	};
+
+match_edges:
+	match_edges match_edge |
+	match_edge;
+
+match_edge:
+	edge TOK_PIN {
+		struct record_match *m = &matches[num_matches-1];
+		if (m->num_edges == MAX_MATCH_EDGES) {
+			fprintf(stderr, "Config error in line %d: More than %d edges in match statement\n", yyget_lineno(), MAX_MATCH_EDGES);
+			exit(1);
+		}
+		m->edge_pin[m->num_edges] = $2;
+		m->edge_dir[m->num_edges++] = $1;
+	};
+
 edge:
 	TOK_POSEDGE {
 		$$ = PIN_TRIGGER_POSEDGE;
@@ -185,8 +344,17 @@ extern FILE *yyin;
 void config(const char *file)
 {
 	decode = 0;
+	num_decoders = 0;
+	memset(decoder_type, 0, sizeof(decoder_type));
 	memset(decode_config, 0, sizeof(decode_config));
 	memset(pins, 0, sizeof(pins));
+	trigger_rle = false;
+	timestamps = false;
+	link_baud = LINK_MAX_BAUD;
+	record = false;
+	record_rearm = false;
+	record_pre_cfg = record_post_cfg = 0;
+	num_matches = 0;
 
 	yyin = fopen(file, "r");
 	if (yyin == NULL) {
@@ -197,6 +365,71 @@ void config(const char *file)
 	yyparse();
 	fclose(yyin);
 
+	// When several decoders share the probe the samples are triggered by
+	// all their clocks, so each decoder needs its own clock to find its
+	// edges. The clocks are captured and trigger on both edges in this case.
+	// Captured pins not used by a decoder are SPI data pins.
+	int decoder_pins = 0, capture_mask = 0;
+	for (int k = 0; k < num_decoders; k++) {
+		int *cfg = decode_config[k];
+		if (decoder_type[k] == DECODE_SPI) {
+			if (num_decoders > 1)
+				pins[cfg[CFG_SPI_SCK]-1] |= PIN_CAPTURE | PIN_TRIGGER_POSEDGE | PIN_TRIGGER_NEGEDGE;
+			decoder_pins |= cfg[CFG_SPI_CSMASK] | cfg[CFG_SPI_DATAMASK] | 1 << (cfg[CFG_SPI_SCK]-1);
+		}
+		if (decoder_type[k] == DECODE_I2C)
+			decoder_pins |= 1 << cfg[CFG_I2C_SCL] | 1 << cfg[CFG_I2C_SDA];
+		if (decoder_type[k] == DECODE_JTAG) {
+			if (num_decoders > 1)
+				pins[cfg[CFG_JTAG_TCK]-1] |= PIN_CAPTURE | PIN_TRIGGER_POSEDGE | PIN_TRIGGER_NEGEDGE;
+			decoder_pins |= 1 << (cfg[CFG_JTAG_TCK]-1) | 1 << cfg[CFG_JTAG_TMS] |
+					1 << cfg[CFG_JTAG_TDI] | 1 << cfg[CFG_JTAG_TDO];
+		}
+	}
+	for (int i = 0; i < TOTAL_PIN_NUM; i++)
+		if ((pins[i] & PIN_CAPTURE) != 0)
+			capture_mask |= 1 << i;
+	for (int k = 0; k < num_decoders; k++)
+		if (decoder_type[k] == DECODE_SPI)
+			decode_config[k][CFG_SPI_DATAMASK] |= capture_mask & ~decoder_pins;
+
+	if (timestamps && trigger_freq > 0) {
+		fprintf(stderr, "Config error: Timestamps can't be used with a free running trigger\n");
+		exit(1);
+	}
+
+	// The windows in ms are converted to samples, which only works with a
+	// free running trigger. Match statements need the pins to be captured
+	// and a decoder for data matches.
+	if ((record_pre_cfg < 0 || record_post_cfg < 0) && decode != DECODE_FREQ) {
+		fprintf(stderr, "Config error: Record windows in ms need a free running trigger\n");
+		exit(1);
+	}
+	record_pre = record_pre_cfg < 0 ? uint64_t(-record_pre_cfg) * trigger_freq / 1000 : record_pre_cfg;
+	record_post = record_post_cfg < 0 ? uint64_t(-record_post_cfg) * trigger_freq / 1000 : record_post_cfg;
+	if (record && record_pre + record_post == 0) {
+		fprintf(stderr, "Config error: Empty record window\n");
+		exit(1);
+	}
+	if (num_matches > 0 && !record) {
+		fprintf(stderr, "Config error: Match statements without record statement\n");
+		exit(1);
+	}
+	for (int k = 0; k < num_matches; k++) {
+		struct record_match *m = &matches[k];
+		int mask = m->mask;
+		for (int i = 0; i < m->num_edges; i++)
+			mask |= 1 << m->edge_pin[i];
+		if ((mask & ~capture_mask) != 0) {
+			fprintf(stderr, "Config error: Match statement %d uses pins that are not captured\n", k+1);
+			exit(1);
+		}
+		if (m->type == MATCH_DATA && num_decoders == 0) {
+			fprintf(stderr, "Config error: Data match statement without decode statement\n");
+			exit(1);
+		}
+	}
+
 	printf("Capture configuration:");
 	for (int i = 0; i < TOTAL_PIN_NUM; i++) {
 		if (pins[i] == 0)
@@ -208,12 +441,22 @@ void config(const char *file)
 			printf("p");
 		if ((pins[i] & PIN_TRIGGER_NEGEDGE) != 0)
 			printf("n");
+		if ((pins[i] & PIN_PULLUP) != 0)
+			printf("u");
 	}
 	printf("\n");
 
 	printf("Decode configuration: %d", decode);
-	for (int i = 0; i < CFG_WORDS; i++)
-		printf(" %d", decode_config[i]);
+	for (int k = 0; k < num_decoders; k++) {
+		printf(" [%d:", decoder_type[k]);
+		for (int i = 0; i < CFG_WORDS; i++)
+			printf(" %d", decode_config[k][i]);
+		printf("]");
+	}
 	printf("\n");
+
+	if (record)
+		printf("Record configuration: %zd samples before and %zd samples after the trigger%s, %d match statements\n",
+				record_pre, record_post, record_rearm ? " (rearm)" : "", num_matches);
 }
 
@@ -23,11 +23,138 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-void writerawfile(const char *file)
+// Binary RAW files start with this header, followed by the NUL terminated
+// pin names and padding up to hdr_size. The samples are stored in host byte
+// order starting at hdr_size, so they can be used directly from a mapping.
+// With RAWBIN_TIMES the time of each sample in ns follows as 64 bit words,
+// starting at the next 8 byte boundary after the samples.
+
+#define RAWBIN_MAGIC	"ArduLogic RAW\n\032"
+#define RAWBIN_VERSION	3
+#define RAWBIN_ALIGN	64
+
+#define RAWBIN_TIMES	1
+
+struct rawbin_header {
+	char magic[16];
+	uint16_t version;
+	uint16_t byte_order;
+	uint32_t hdr_size;
+	uint64_t num_samples;
+	int32_t decode;
+	int32_t trigger_freq;
+	int32_t pins[TOTAL_PIN_NUM];
+	int32_t cfg_words;
+	int32_t num_decoders;
+	int32_t decoder_type[MAX_DECODERS];
+	int32_t decode_config[MAX_DECODERS][CFG_WORDS];
+	uint32_t flags;
+};
+
+// In version 1 files (one decoder) the config words directly follow cfg_words.
+// Version 2 files have no flags.
+
+// The offset of the pin names. Version 1 and 2 files were written with the
+// header struct of their time, so the names follow its padding to 8 bytes.
+// Version 3 files have them directly after the flags.
+static size_t rawbin_fixed_size(int version, int cfg_words)
+{
+	if (version == 1)
+		return (offsetof(struct rawbin_header, num_decoders) + cfg_words * sizeof(int32_t) + 7) & ~size_t(7);
+	size_t size = offsetof(struct rawbin_header, decode_config) + MAX_DECODERS * cfg_words * sizeof(int32_t);
+	if (version == 2)
+		return (size + 7) & ~size_t(7);
+	return size + sizeof(uint32_t);
+}
+
+static size_t rawbin_times_offset(size_t hdr_size, size_t num_samples)
+{
+	return (hdr_size + num_samples * sizeof(uint16_t) + 7) & ~size_t(7);
+}
+
+static void write_or_die(FILE *f, const char *file, const void *p, size_t n)
+{
+	if (fwrite(p, 1, n, f) != n) {
+		fprintf(stderr, "Error writing RAW file `%s': %s\n", file, strerror(errno));
+		exit(1);
+	}
+}
+
+static void writerawfile_bin(FILE *f, const char *file)
 {
+	struct rawbin_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, RAWBIN_MAGIC, sizeof(hdr.magic));
+	hdr.version = RAWBIN_VERSION;
+	hdr.byte_order = 0x0102;
+	hdr.num_samples = samples.size();
+	hdr.decode = decode;
+	hdr.trigger_freq = trigger_freq;
+	for (int i = 0; i < TOTAL_PIN_NUM; i++)
+		hdr.pins[i] = pins[i];
+	hdr.cfg_words = CFG_WORDS;
+	hdr.num_decoders = num_decoders;
+	for (int k = 0; k < num_decoders; k++) {
+		hdr.decoder_type[k] = decoder_type[k];
+		for (int i = 0; i < CFG_WORDS; i++)
+			hdr.decode_config[k][i] = decode_config[k][i];
+	}
+	hdr.flags = samples.timed ? RAWBIN_TIMES : 0;
+
+	std::vector<char> names;
+	for (int i = 0; i < TOTAL_PIN_NUM; i++)
+		names.insert(names.end(), pin_names[i], pin_names[i] + strlen(pin_names[i]) + 1);
+	size_t fixed_size = rawbin_fixed_size(RAWBIN_VERSION, CFG_WORDS);
+	hdr.hdr_size = fixed_size + names.size();
+	hdr.hdr_size = (hdr.hdr_size + RAWBIN_ALIGN - 1) & ~(RAWBIN_ALIGN - 1);
+	names.resize(hdr.hdr_size - fixed_size);
+
+	write_or_die(f, file, &hdr, fixed_size);
+	write_or_die(f, file, names.data(), names.size());
+
+	uint16_t buffer[4096];
+	for (size_t i = 0; i < samples.size(); i += 4096) {
+		size_t n = samples.size() - i < 4096 ? samples.size() - i : 4096;
+		for (size_t j = 0; j < n; j++)
+			buffer[j] = samples[i+j];
+		write_or_die(f, file, buffer, n * sizeof(uint16_t));
+	}
+
+	if (samples.timed) {
+		uint64_t times[4096];
+		size_t pad = rawbin_times_offset(hdr.hdr_size, samples.size()) - hdr.hdr_size - samples.size() * sizeof(uint16_t);
+		memset(times, 0, pad);
+		write_or_die(f, file, times, pad);
+		for (size_t i = 0; i < samples.size(); i += 4096) {
+			size_t n = samples.size() - i < 4096 ? samples.size() - i : 4096;
+			for (size_t j = 0; j < n; j++)
+				times[j] = samples.time(i+j);
+			write_or_die(f, file, times, n * sizeof(uint64_t));
+		}
+	}
+}
+
+// the binary RAW file the samples are mapped from (st_ino 0 if none)
+static struct stat mapped_file;
+
+void writerawfile(const char *file, bool binary)
+{
+	// truncating the mapped input would pull the samples away under us
+	struct stat st;
+	if (mapped_file.st_ino != 0 && stat(file, &st) == 0 &&
+			st.st_dev == mapped_file.st_dev && st.st_ino == mapped_file.st_ino) {
+		fprintf(stderr, "Can't write RAW file `%s': it is the binary RAW input file.\n", file);
+		exit(1);
+	}
+
 	FILE *f = fopen(file, "w");
 
 	if (f == NULL) {
@@ -35,16 +162,113 @@ void writerawfile(const char *file)
 		exit(1);
 	}
 
-	printf("Writing RAW output file `%s'.\n", file);
+	printf("Writing %s RAW output file `%s'.\n", binary ? "binary" : "text", file);
 
-	for (size_t i = 0; i < samples.size(); i++) {
-		fprintf(f, "%04x\n", samples[i]);
+	if (binary) {
+		writerawfile_bin(f, file);
+	} else {
+		for (size_t i = 0; i < samples.size(); i++) {
+			if (samples.timed)
+				fprintf(f, "%04x %llu\n", samples[i], (unsigned long long)samples.time(i));
+			else
+				fprintf(f, "%04x\n", samples[i]);
+		}
 	}
 
+	if (fclose(f) != 0) {
+		fprintf(stderr, "Error writing RAW file `%s': %s\n", file, strerror(errno));
+		exit(1);
+	}
+}
+
+bool is_binary_rawfile(const char *file)
+{
+	char magic[16];
+	FILE *f = fopen(file, "r");
+	if (f == NULL)
+		return false;
+	bool ret = fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+			memcmp(magic, RAWBIN_MAGIC, sizeof(magic)) == 0;
 	fclose(f);
+	return ret;
 }
 
-void readrawfile(const char *file)
+// Map the binary RAW file and use its sample data in place. The
+// configuration stored in the header is only used when no config file
+// has been loaded (load_config is set).
+static void readrawfile_bin(int fd, const char *file, size_t file_size, bool load_config)
+{
+	void *base = file_size > 0 ? mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	if (base == MAP_FAILED) {
+		fprintf(stderr, "Can't map RAW file `%s': %s\n", file, strerror(errno));
+		exit(1);
+	}
+
+	// files written with fewer decode config words are fine, the missing
+	// words are zero
+	const struct rawbin_header *hdr = (const struct rawbin_header*)base;
+	size_t cfg_offset = offsetof(struct rawbin_header, num_decoders);
+	size_t fixed_size = cfg_offset;
+	uint32_t flags = 0;
+	if (file_size >= fixed_size && hdr->cfg_words >= 0 && hdr->cfg_words <= CFG_WORDS) {
+		if (hdr->version != 1)
+			cfg_offset = offsetof(struct rawbin_header, decode_config);
+		fixed_size = rawbin_fixed_size(hdr->version, hdr->cfg_words);
+		if (hdr->version >= 3 && file_size >= fixed_size)
+			flags = *(const uint32_t*)((const char*)base + fixed_size - sizeof(uint32_t));
+	}
+	// the decoder types index the decoder tables
+	bool bad_decoders = file_size < fixed_size || hdr->decode < DECODE_NONE || hdr->decode > DECODE_JTAG;
+	if (!bad_decoders && hdr->version != 1 && file_size >= offsetof(struct rawbin_header, decode_config) &&
+			hdr->num_decoders >= 0 && hdr->num_decoders <= MAX_DECODERS)
+		for (int k = 0; k < hdr->num_decoders; k++)
+			if (hdr->decoder_type[k] < DECODE_SPI || hdr->decoder_type[k] > DECODE_JTAG)
+				bad_decoders = true;
+	if (file_size < fixed_size || hdr->version < 1 || hdr->version > RAWBIN_VERSION || hdr->byte_order != 0x0102 ||
+			hdr->cfg_words < 0 || hdr->cfg_words > CFG_WORDS ||
+			(hdr->version != 1 && (hdr->num_decoders < 0 || hdr->num_decoders > MAX_DECODERS)) || bad_decoders ||
+			hdr->hdr_size < fixed_size || hdr->hdr_size > file_size ||
+			(file_size - hdr->hdr_size) / sizeof(uint16_t) < hdr->num_samples ||
+			((flags & RAWBIN_TIMES) != 0 && (file_size - rawbin_times_offset(hdr->hdr_size, hdr->num_samples)) / sizeof(uint64_t) < hdr->num_samples)) {
+		fprintf(stderr, "Unsupported, truncated or corrupt binary RAW file `%s'.\n", file);
+		exit(1);
+	}
+
+	if (load_config) {
+		decode = hdr->decode;
+		trigger_freq = hdr->trigger_freq;
+		for (int i = 0; i < TOTAL_PIN_NUM; i++)
+			pins[i] = hdr->pins[i];
+		const int32_t *cfg = (const int32_t*)((const char*)base + cfg_offset);
+		num_decoders = hdr->version == 1 ? decode >= DECODE_SPI : hdr->num_decoders;
+		for (int k = 0; k < num_decoders; k++) {
+			decoder_type[k] = hdr->version == 1 ? decode : hdr->decoder_type[k];
+			for (int i = 0; i < CFG_WORDS; i++)
+				decode_config[k][i] = i < hdr->cfg_words ? cfg[k * hdr->cfg_words + i] : 0;
+		}
+
+		const char *p = (const char*)base + fixed_size;
+		const char *end = (const char*)base + hdr->hdr_size;
+		for (int i = 0; i < TOTAL_PIN_NUM; i++) {
+			size_t len = strnlen(p, end - p);
+			if (len == size_t(end - p)) {
+				fprintf(stderr, "Corrupt pin names in binary RAW file `%s'.\n", file);
+				exit(1);
+			}
+			pin_names[i] = p;
+			p += len + 1;
+		}
+
+		printf("Using configuration from RAW file: decode=%d decoders=%d trigger_freq=%d.\n", decode, num_decoders, trigger_freq);
+	}
+
+	const uint64_t *times = NULL;
+	if ((flags & RAWBIN_TIMES) != 0)
+		times = (const uint64_t*)((const char*)base + rawbin_times_offset(hdr->hdr_size, hdr->num_samples));
+	samples.map((const uint16_t*)((const char*)base + hdr->hdr_size), hdr->num_samples, times);
+}
+
+void readrawfile(const char *file, bool load_config)
 {
 	FILE *f = fopen(file, "r");
 
@@ -53,11 +277,48 @@ void readrawfile(const char *file)
 		exit(1);
 	}
 
+	struct stat st;
+	if (fstat(fileno(f), &st) < 0) {
+		fprintf(stderr, "Can't stat RAW file `%s': %s\n", file, strerror(errno));
+		exit(1);
+	}
+
+	if (is_binary_rawfile(file)) {
+		printf("Reading binary RAW file `%s'.\n", file);
+		readrawfile_bin(fileno(f), file, st.st_size, load_config);
+		mapped_file = st;
+		fclose(f);
+		return;
+	}
+
+	if (load_config) {
+		fprintf(stderr, "Text RAW file `%s' needs a config file.\n", file);
+		exit(1);
+	}
+
 	printf("Reading RAW file `%s'.\n", file);
 
-	unsigned int sample;
-	while (fscanf(f, "%04x\n", &sample) == 1)
-		samples.push_back(sample);
+	// one sample (hex) per line, optionally followed by its time in ns
+	char line[256];
+	bool timed = false;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		char *p = line, *end;
+		unsigned long sample = strtoul(p, &end, 16);
+		if (end == p)
+			continue;
+		p = end;
+		unsigned long long time = strtoull(p, &end, 10);
+		if (samples.size() == 0)
+			timed = end != p;
+		else if (timed && end == p) {
+			fprintf(stderr, "Missing sample time in RAW file `%s'.\n", file);
+			exit(1);
+		}
+		if (timed)
+			samples.push_back(sample, time);
+		else
+			samples.push_back(sample);
+	}
 
 	fclose(f);
 }
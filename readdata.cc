@@ -32,12 +32,18 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include <atomic>
 
 static int fd;
 static struct termios tcattr_old;
 static const char *tts_name;
 
-static void sigint_hdl(int dummy)
+static void sigint_hdl(int)
 {
 	char ch = 0;
 	if (write(fd, &ch, 1) != 1) {
@@ -47,27 +53,120 @@ static void sigint_hdl(int dummy)
 	}
 }
 
-static void sigalrm_hdl(int dummy)
+static void no_response()
 {
 	printf("\n");
 	printf("-- no response from device --\n");
 	printf("\n");
 	printf("This could have multiple reasons:\n");
 	printf("\n");
-	printf("1. There is no ArduLogic firmware on the device yet.\n");
+	printf("1. There is no ArduLogic firmware (or the firmware of an older\n");
+	printf("ArduLogic version) on the device yet.\n");
 	printf("Solution: Re-run with the `-p' command line option set.\n");
 	printf("\n");
 	printf("2. The Arduino is connected to a different serial device.\n");
 	printf("Solution: Pass the correct serial device name using the `-t'\n");
 	printf("command line option.\n");
 	printf("\n");
-	printf("3. Automatic reset via USB is disabled on your Arduino.\n");
+	printf("3. The firmware on the device hangs.\n");
 	printf("solution: Push the reset button on the Arduino now.\n");
 	printf("\n");
 }
 
-static uint8_t serbuffer[1024];
-static int serbuffer_idx, serbuffer_len;
+// A dedicated reader thread drains the tts into a large single-producer
+// single-consumer ring buffer, so the kernel tty buffer does not overflow
+// while the main thread is busy unpacking or printing.
+
+#define RING_SIZE (16 << 20)
+
+static uint8_t *ring;
+static std::atomic<size_t> ring_head, ring_tail;
+static std::atomic<bool> reader_done, reader_stop;
+static size_t ring_highwater, ring_stalls;
+static int reader_errno;
+static pthread_t reader_tid;
+static bool reader_running;
+
+static void *reader_main(void *)
+{
+	while (!reader_stop)
+	{
+		size_t head = ring_head.load(std::memory_order_relaxed);
+		size_t tail = ring_tail.load(std::memory_order_acquire);
+		size_t used = head - tail;
+
+		if (used > ring_highwater)
+			ring_highwater = used;
+
+		if (used == RING_SIZE) {
+			ring_stalls++;
+			usleep(100);
+			continue;
+		}
+
+		struct pollfd pfd = { fd, POLLIN, 0 };
+		int rc = poll(&pfd, 1, 100);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc == 0)
+			continue;
+
+		// read up to the end of the ring memory or the consumer position
+		size_t len = RING_SIZE - used;
+		if (len > RING_SIZE - head % RING_SIZE)
+			len = RING_SIZE - head % RING_SIZE;
+		rc = rc < 0 ? rc : read(fd, ring + head % RING_SIZE, len);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0) {
+			reader_errno = rc < 0 ? errno : 0;
+			break;
+		}
+
+		ring_head.store(head + rc, std::memory_order_release);
+	}
+
+	reader_done = true;
+	return NULL;
+}
+
+static void reader_start(bool realtime)
+{
+	if (ring == NULL)
+		ring = (uint8_t*)malloc(RING_SIZE);
+
+	ring_head = ring_tail = 0;
+	ring_highwater = ring_stalls = 0;
+	reader_done = reader_stop = false;
+
+	if (pthread_create(&reader_tid, NULL, &reader_main, NULL) != 0) {
+		fprintf(stderr, "Failed to create serial reader thread.\n");
+		exit(1);
+	}
+	reader_running = true;
+
+	if (realtime) {
+		if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+			fprintf(stderr, "WARNING: mlockall() failed: %s\n", strerror(errno));
+		struct sched_param sp;
+		sp.sched_priority = sched_get_priority_max(SCHED_FIFO);
+		int rc = pthread_setschedparam(reader_tid, SCHED_FIFO, &sp);
+		if (rc != 0)
+			fprintf(stderr, "WARNING: Can't set real-time priority for serial reader: %s\n", strerror(rc));
+	}
+}
+
+static void reader_finish()
+{
+	if (!reader_running)
+		return;
+	reader_stop = true;
+	pthread_join(reader_tid, NULL);
+	reader_running = false;
+}
+
+static uint8_t *serbuffer;
+static size_t serbuffer_idx, serbuffer_len;
 static bool serbuffer_end_of_block;
 
 static int serialreadbyte()
@@ -77,18 +176,47 @@ static int serialreadbyte()
 		return serbuffer[serbuffer_idx++];
 	}
 
-	int rc = read(fd, serbuffer, 1024);
-	if (rc > 0) {
-		serbuffer_idx = 0;
-		serbuffer_len = rc;
-		return serialreadbyte();
+	// release the consumed block and take whatever arrived in the meantime
+	size_t tail = ring_tail.load(std::memory_order_relaxed) + serbuffer_len;
+	ring_tail.store(tail, std::memory_order_release);
+	serbuffer_idx = serbuffer_len = 0;
+
+	while (1) {
+		bool done = reader_done;
+		size_t head = ring_head.load(std::memory_order_acquire);
+		if (head != tail) {
+			serbuffer = ring + tail % RING_SIZE;
+			serbuffer_len = head - tail;
+			if (serbuffer_len > RING_SIZE - tail % RING_SIZE)
+				serbuffer_len = RING_SIZE - tail % RING_SIZE;
+			return serialreadbyte();
+		}
+		if (done)
+			break;
+		usleep(1000);
 	}
 
-	if (rc == 0)
+	if (reader_errno == 0)
 		return -1;
+	errno = reader_errno;
 	return -2;
 }
 
+// wait up to timeout_ms for the next byte, returns false on timeout or
+// when the reader has stopped
+static bool serialwait(int timeout_ms)
+{
+	for (int ms = 0; true; ms++) {
+		bool done = reader_done;
+		size_t tail = ring_tail.load(std::memory_order_relaxed) + serbuffer_len;
+		if (serbuffer_idx < serbuffer_len || ring_head.load(std::memory_order_acquire) != tail)
+			return true;
+		if (done || ms >= timeout_ms)
+			return false;
+		usleep(1000);
+	}
+}
+
 static unsigned char serialread()
 {
 	int ch = serialreadbyte();
@@ -116,99 +244,412 @@ static unsigned char serialread()
 	exit(1);
 }
 
-static size_t get_numbits(std::vector<uint8_t> &data)
+static struct unpacker unpack;
+static std::vector<uint16_t> unpack_buf;
+static std::vector<uint64_t> unpack_times;
+static size_t payload_bytes;
+
+// make room for n samples (and their times)
+static void unpack_prepare(size_t n)
+{
+	unpack_buf.resize(n);
+	if (timestamps) {
+		unpack_times.resize(n);
+		unpack.tout = unpack_times.data();
+	}
+}
+
+static void unpack_store(size_t n)
 {
-	return (data.size()-1) * 7 - (data.back() & ~0x80);
+	if (timestamps)
+		samples.append(unpack_buf.data(), unpack_times.data(), n);
+	else
+		samples.append(unpack_buf.data(), n);
+}
+
+static void unpack_block(const std::vector<uint8_t> &block)
+{
+	unpack_prepare(unpack_maxwords(&unpack, block.size()));
+	size_t n = unpack_data(&unpack, block.data(), block.size(), unpack_buf.data());
+	if (verbose)
+		for (size_t i = 0; i < n; i++)
+			printf("Decode: sample=0x%04x\n", unpack_buf[i]);
+	unpack_store(n);
+}
+
+static void unpack_close()
+{
+	unpack_prepare(unpack_maxwords(&unpack, 0));
+	int n = unpack_finish(&unpack, unpack_buf.data());
+	if (n < 0) {
+		fprintf(stderr, "Data encoding error on tts `%s' (missing trailer).\n", tts_name);
+		exit(1);
+	}
+	if (unpack.carry_len != 0) {
+		fprintf(stderr, "Data encoding boundary error on tts `%s' (extra_bits=%d, chunk_bits=%d).\n",
+				tts_name, unpack.carry_len, unpack.num_bits);
+		exit(1);
+	}
+	unpack_store(n);
+}
+
+static void setup_tts()
+{
+	tcgetattr(fd, &tcattr_old);
+	// keep DTR when the tts is closed, so opening it again doesn't reset
+	// the Arduino and the firmware answers the query right away
+	tcattr_old.c_cflag &= ~HUPCL;
+	struct termios tcattr = tcattr_old;
+	tcattr.c_iflag = IGNBRK | IGNPAR;
+	tcattr.c_oflag = 0;
+	tcattr.c_cflag = CS8 | CREAD | CLOCAL;
+	tcattr.c_lflag = 0;
+	cfsetspeed(&tcattr, B115200);
+	tcsetattr(fd, TCSAFLUSH, &tcattr);
 }
 
-static bool get_bit(std::vector<uint8_t> &data, size_t num)
+// The rates for the link statement, from the fastest to LINK_SAFE_BAUD. The
+// AVR runs at exactly 2000000/n baud, these are the standard tts rates among
+// them (and the usual 115200 baud, 2% off).
+static const struct {
+	int baud;
+	speed_t speed;
+} link_rates[] = {
+	{ 2000000, B2000000 },
+	{ 1000000, B1000000 },
+	{ 500000, B500000 },
+	{ LINK_SAFE_BAUD, B115200 }
+};
+
+static void set_speed(speed_t speed)
 {
-	size_t byte_num = num / 7;
-	size_t bit_num = num % 7;
-	return (data[byte_num] & (1 << bit_num)) != 0;
+	struct termios tcattr;
+	tcgetattr(fd, &tcattr);
+	cfsetspeed(&tcattr, speed);
+	tcsetattr(fd, TCSADRAIN, &tcattr);
 }
 
-static size_t get_numwords(std::vector<uint8_t> &data, size_t bits)
+static void serialwrite(const uint8_t *data, int len)
 {
-	size_t total_bits = get_numbits(data);
-	if (total_bits % bits != 0) {
-		fprintf(stderr, "Data encoding boundary error on tts `%s' (total_bits=%zd, chunk_bits=%zd).\n",
-				tts_name, total_bits, bits);
+	if (write(fd, data, len) != len) {
+		fprintf(stderr, "I/O Error on tts `%s': %s\n", tts_name, strerror(errno));
+		tcsetattr(fd, TCSAFLUSH, &tcattr_old);
 		exit(1);
 	}
-	return total_bits / bits;
 }
 
-static uint16_t get_word(std::vector<uint8_t> &data, size_t num, size_t bits)
+// Send PROBE_QUERY and wait up to timeout_ms for the answer (see ardulogic.h).
+// Returns the protocol version and the id of the firmware, 0 when the
+// firmware sends the header of a capture instead (an ArduLogic version
+// without the query), -1 on timeout and -2 when the tts is closed.
+static int query_probe(char *id, int timeout_ms)
 {
-	uint16_t value = 0;
-	for (size_t i = 0; i < bits; i++)
-		value |= get_bit(data, num*bits + i) ? 1 << i : 0;
-	return value;
+	static const char prefix[] = "\0\0ARDULOGIC";
+	int prefix_len = sizeof(prefix) - 1;
+
+	uint8_t query = PROBE_QUERY;
+	serialwrite(&query, 1);
+
+	struct timeval tv_start, tv;
+	gettimeofday(&tv_start, NULL);
+
+	int idx = 0;
+	char line[32];
+	size_t len = 0;
+	while (1) {
+		gettimeofday(&tv, NULL);
+		int ms = timeout_ms - (tv.tv_sec - tv_start.tv_sec) * 1000 - (tv.tv_usec - tv_start.tv_usec) / 1000;
+		if (!serialwait(ms > 0 ? ms : 0))
+			return reader_done ? -2 : -1;
+		unsigned char ch = serialread();
+
+		if (idx < prefix_len) {
+			if (prefix[idx] == ch)
+				idx++;
+			else
+				idx = ch != 0 ? 0 : idx == 2 ? 2 : 1;
+			continue;
+		}
+		if (len == 0 && ch == ':')
+			return 0;
+		if (len == 0 && ch != '?') {
+			idx = 0;
+			continue;
+		}
+
+		line[len++] = ch;
+		if (ch != '\n' && len < sizeof(line)-1)
+			continue;
+		line[len] = 0;
+
+		unsigned int version;
+		if (sscanf(line, "?%x:%15[^:]:", &version, id) == 2 && version > 0)
+			return version;
+		idx = len = 0;
+	}
 }
 
-void readdata(const char *tts, bool autoprog)
+#define PROBE_NONE		0
+#define PROBE_MISMATCH		1
+#define PROBE_MATCH		2	// the firmware for this configuration
+#define PROBE_UNIVERSAL		3	// the universal firmware
+
+// Query the probe until it answers. The query is repeated, as the probe
+// might still be in the bootloader or send the end of a capture. A capture
+// header can also be the end of a capture that was started just before, so
+// the firmware is only taken as an older version when there is no answer
+// for a second. Gives up after timeout_ms or never for timeout_ms < 0 (with
+// a hint after 3 seconds).
+static int handshake(int timeout_ms)
 {
+	char id[16];
+	int header_seen = -1;
+	for (int waited = 0; timeout_ms < 0 || waited < timeout_ms; waited += 250)
+	{
+		if (timeout_ms < 0 && waited == 3000)
+			no_response();
+
+		int version = query_probe(id, 250);
+		if (version == -2)
+			break;
+		if (version == 0 && header_seen < 0)
+			header_seen = waited;
+		if (version <= 0) {
+			if (header_seen >= 0 && waited - header_seen >= 1000)
+				return PROBE_MISMATCH;
+			continue;
+		}
+		if (version != PROTOCOL_VERSION)
+			return PROBE_MISMATCH;
+
+		unsigned int universal_version;
+		if (sscanf(id, "U%x", &universal_version) == 1)
+			return universal_version == UNIVERSAL_VERSION ? PROBE_UNIVERSAL : PROBE_MISMATCH;
+		return strtoul(id, NULL, 16) == config_hash() ? PROBE_MATCH : PROBE_MISMATCH;
+	}
+	return PROBE_NONE;
+}
+
+// drop everything received so far
+static void serialflush()
+{
+	tcflush(fd, TCIFLUSH);
+	while (serialwait(0))
+		serialreadbyte();
+}
+
+// wait up to timeout_ms for the byte ch, skipping the answers to earlier
+// queries (they don't contain it)
+static bool serialexpect(uint8_t ch, int timeout_ms)
+{
+	struct timeval tv_start, tv;
+	gettimeofday(&tv_start, NULL);
+	while (1) {
+		gettimeofday(&tv, NULL);
+		int ms = timeout_ms - (tv.tv_sec - tv_start.tv_sec) * 1000 - (tv.tv_usec - tv_start.tv_usec) / 1000;
+		if (!serialwait(ms > 0 ? ms : 0))
+			return false;
+		if (serialread() == ch)
+			return true;
+	}
+}
+
+// Switch the link to baud and check it with the test burst (see ardulogic.h).
+// Returns the number of wrong or missing bytes of the burst, or -1 when the
+// firmware doesn't acknowledge LINK_BAUD or LINK_KEEP.
+static int link_test(int baud, speed_t speed)
+{
+	uint8_t cmd[3] = { LINK_BAUD, uint8_t(LINK_UBRR(baud)), uint8_t(~LINK_UBRR(baud)) };
+	serialwrite(cmd, 3);
+	if (!serialexpect(LINK_BAUD, LINK_TIMEOUT_MS))
+		return -1;
+
+	// the firmware switches LINK_SWITCH_US after the answer (see ardulogic.h)
+	usleep(LINK_SWITCH_US);
+	set_speed(speed);
+	serialflush();
+	cmd[0] = LINK_TEST;
+	serialwrite(cmd, 1);
+
+	int errors = 0;
+	for (int i = 0; i < LINK_TEST_BYTES; i++) {
+		if (!serialwait(LINK_TIMEOUT_MS))
+			return errors + LINK_TEST_BYTES - i;
+		if (serialread() != LINK_TEST_BYTE(i))
+			errors++;
+	}
+	if (errors > 0)
+		return errors;
+
+	cmd[0] = LINK_KEEP;
+	serialwrite(cmd, 1);
+	return serialexpect(LINK_KEEP, LINK_TIMEOUT_MS) ? 0 : -1;
+}
+
+// Try the rates up to link_baud, from the fastest one. The capture stream
+// has no error correction, so a rate is only used when the whole test burst
+// is received correctly. Otherwise LINK_ABORT sends the firmware back to the
+// safe rate (or its timeout, when LINK_ABORT is lost) and the next slower
+// rate is tried.
+static void negotiate_link()
+{
+	for (auto &rate : link_rates)
+	{
+		if (rate.baud > link_baud)
+			continue;
+		if (rate.baud == LINK_SAFE_BAUD)
+			break;
+
+		int errors = link_test(rate.baud, rate.speed);
+		if (errors == 0) {
+			printf("Serial link at %d baud.\n", rate.baud);
+			return;
+		}
+		if (errors < 0)
+			printf("Serial link: no acknowledge at %d baud, trying a slower rate.\n", rate.baud);
+		else
+			printf("Serial link at %d baud failed (%d of %d test bytes wrong), trying a slower rate.\n",
+					rate.baud, errors, LINK_TEST_BYTES);
+
+		uint8_t abort = LINK_ABORT;
+		serialwrite(&abort, 1);
+		tcdrain(fd);
+		set_speed(B115200);
+		usleep(LINK_TIMEOUT_MS * 1000 + LINK_SWITCH_US);
+		serialflush();
+		if (handshake(3000) == PROBE_NONE) {
+			fprintf(stderr, "No response from the probe after the link test on tts `%s'.\n", tts_name);
+			tcsetattr(fd, TCSAFLUSH, &tcattr_old);
+			exit(1);
+		}
+	}
+	printf("Serial link at %d baud.\n", LINK_SAFE_BAUD);
+}
+
+// Check if the probe already runs the firmware for this configuration (or
+// the universal firmware with -u).
+bool probe_matches(const char *tts)
+{
+	tts_name = tts;
+	fd = open(tts, O_RDWR);
+	if (fd < 0)
+		return false;
+	setup_tts();
+	reader_start(false);
+
+	int probe = handshake(3000);
+
+	reader_finish();
+	tcsetattr(fd, TCSAFLUSH, &tcattr_old);
+	close(fd);
+	return probe == (universal_firmware ? PROBE_UNIVERSAL : PROBE_MATCH);
+}
+
+// the configuration frame for the universal firmware, the probe sends
+// the header back and starts the capture
+static void send_config(const char *header, int hp)
+{
+	uint8_t frame[UNIVERSAL_FRAME_MAX + 3];
+	int n = universal_frame(frame, header, hp);
+	serialwrite(frame, n);
+	printf("Sent configuration to the universal firmware.\n");
+}
+
+// close the tts and program the probe, the caller connects again
+static void firmware_mismatch(const char *tts, bool autoprog)
+{
+	if (!autoprog) {
+		fprintf(stderr, "Firmware doesn't match configuration. Re-run with -p.\n");
+		exit(1);
+	}
+	reader_finish();
+	tcsetattr(fd, TCSAFLUSH, &tcattr_old);
+	close(fd);
+	fprintf(stderr, "Firmware doesn't match configuration. Reprogramming probe.\n");
+	genfirmware(tts, false);
+}
+
+void readdata(const char *tts, bool autoprog, bool realtime)
+{
+	payload_bytes = 0;
+
+	uint16_t capture_mask = 0;
+	for (int i = 0; i < TOTAL_PIN_NUM; i++)
+		if ((pins[i] & PIN_CAPTURE) != 0)
+			capture_mask |= 1 << i;
+	if (trigger_rle)
+		unpack_init_rle(&unpack, capture_mask);
+	else if (timestamps)
+		unpack_init_ts(&unpack, capture_mask);
+	else
+		unpack_init(&unpack, capture_mask);
+
+	tts_name = tts;
+	char header[100 + TOTAL_PIN_NUM];
+	int hdrlen, hp = config_header(header, hdrlen);
+
+	bool stop_sent = false;
+	if (record)
+		recorder_init();
+
+	// Opening the tts resets the Arduino unless DTR is kept from an earlier
+	// connection (see setup_tts), so the handshake might see the ident the
+	// firmware sends after the reset before the answer to the query. Both
+	// have the same format, so either one completes the handshake and the
+	// other one is skipped by the link negotiation or the header search.
+reconnect:
+	printf("Connecting to Arduino on `%s'..\n", tts);
 	serbuffer_idx = 0;
 	serbuffer_len = 0;
 	serbuffer_end_of_block = false;
 
-	printf("Connecting to Arduino on `%s'..\n", tts);
-	tts_name = tts;
-
 	fd = open(tts, O_RDWR);
 	if (fd < 0) {
 		fprintf(stderr, "Failed to open tts device `%s': %s\n", tts, strerror(errno));
 		exit(1);
 	}
 
-	tcgetattr(fd, &tcattr_old);
-	struct termios tcattr = tcattr_old;
-	tcattr.c_iflag = IGNBRK | IGNPAR;
-	tcattr.c_oflag = 0;
-	tcattr.c_cflag = CS8 | CREAD | CLOCAL;
-	tcattr.c_lflag = 0;
-	cfsetspeed(&tcattr, B2000000);
-	tcsetattr(fd, TCSAFLUSH, &tcattr);
-
-	char header[100 + TOTAL_PIN_NUM] = "..ARDULOGIC:";
-	int hp = strlen(header), hdrlen = hp;
-	header[0] = header[1] = 0;
-	for (int i = 0; i < TOTAL_PIN_NUM; i++)
-		header[hp++] = pins[i] + '0';
-	hp += sprintf(header + hp, ":%x:\r\n", trigger_freq);
+	setup_tts();
+	reader_start(realtime);
 
 restart_com:
-	sighandler_t old_hdl = signal(SIGALRM, &sigalrm_hdl);
-	alarm(3);
+	// a probe that was reset talks at the safe rate again
+	set_speed(B115200);
+	int probe = handshake(-1);
+	if (probe == PROBE_NONE) {
+		fprintf(stderr, "I/O Error on tts `%s': %s\n", tts_name, reader_errno ? strerror(reader_errno) : "EOF");
+		tcsetattr(fd, TCSAFLUSH, &tcattr_old);
+		exit(1);
+	}
+	if (probe == PROBE_MISMATCH) {
+		firmware_mismatch(tts, autoprog);
+		autoprog = false;
+		goto reconnect;
+	}
+	negotiate_link();
+	if (probe == PROBE_UNIVERSAL) {
+		send_config(header, hp);
+	} else {
+		uint8_t start = PROBE_START;
+		serialwrite(&start, 1);
+	}
 
 	int idx = 0;
 	while (idx != hp) {
 		unsigned char ch = serialread();
 		if (header[idx] != ch) {
 			if (idx >= hdrlen && ch != 0) {
-				if (autoprog) {
-					alarm(0);
-					signal(SIGALRM, old_hdl);
-					close(fd);
-					fprintf(stderr, "Firmware doesn't match configuration. Reprogramming probe.\n");
-					genfirmware(tts);
-					readdata(tts, false);
-					return;
-				}
-				fprintf(stderr, "Firmware doesn't match configuration. Re-run with -p.\n");
-				exit(1);
+				firmware_mismatch(tts, autoprog);
+				autoprog = false;
+				goto reconnect;
 			}
 			idx = header[0] == ch ? 1 : 0;
 		} else
 			idx++;
 	}
 
-	alarm(0);
-	signal(SIGALRM, old_hdl);
-
 	printf("Recording. Press Ctrl-C to stop.\n");
-	old_hdl = signal(SIGINT, &sigint_hdl);
+	sighandler_t old_hdl = signal(SIGINT, &sigint_hdl);
 
 	struct timeval tv_start, tv_stop;
 	gettimeofday(&tv_start, NULL);
@@ -216,14 +657,17 @@ restart_com:
 	uint8_t error_code;
 	int disp_count = 0;
 	int disp_mode = 0;
-	std::vector<uint8_t> data;
+	std::vector<uint8_t> block;
 	while (1)
 	{
 		unsigned char ch = serialread();
 		if (ch == 0) {
+			unpack_block(block);
+			block.clear();
 			ch = serialread();
 			if (ch == 0) {
 				printf("\nGot restart token start again.\n");
+				unpack_reset(&unpack);
 				goto restart_com;
 			}
 			if (ch == 1) {
@@ -238,14 +682,26 @@ restart_com:
 			tcsetattr(fd, TCSAFLUSH, &tcattr_old);
 			exit(1);
 		}
-		data.push_back(ch);
-		if (!verbose && serbuffer_end_of_block) {
+		block.push_back(ch);
+		payload_bytes++;
+		if (!serbuffer_end_of_block)
+			continue;
+		unpack_block(block);
+		block.clear();
+		if (vcd_live)
+			writevcd_update();
+		// the flight recorder stops the capture when its window is complete
+		if (record && recorder_update() && !stop_sent) {
+			sigint_hdl(0);
+			stop_sent = true;
+		}
+		if (!verbose) {
 			putchar(disp_mode[".,*#="]);
 			if (++disp_count >= 64) {
-				if (data.size() > 1e6)
-					printf(" %.2f MB   \r", data.size() / double(1024*1024));
+				if (payload_bytes > 1e6)
+					printf(" %.2f MB   \r", payload_bytes / double(1024*1024));
 				else
-					printf(" %.2f kB\r", data.size() / double(1024));
+					printf(" %.2f kB\r", payload_bytes / double(1024));
 				disp_mode = (disp_mode + 1) % 5;
 				disp_count = 0;
 			}
@@ -256,39 +712,28 @@ restart_com:
 	gettimeofday(&tv_stop, NULL);
 	double tv_diff = (tv_stop.tv_sec - tv_start.tv_sec) + 1e-6*(tv_stop.tv_usec - tv_start.tv_usec);
 
-	printf("\nRecording finished. Got %d bytes tts payload in %.2f seconds.\n", (int)data.size(), tv_diff);
+	printf("\nRecording finished. Got %zd bytes tts payload in %.2f seconds.\n", payload_bytes, tv_diff);
 	signal(SIGINT, old_hdl);
 
+	reader_finish();
 	tcsetattr(fd, TCSAFLUSH, &tcattr_old);
 	close(fd);
 
+	printf("Serial ring buffer high-water mark: %.2f kB of %d kB (%zd stalls).\n",
+			ring_highwater / 1024.0, RING_SIZE >> 10, ring_stalls);
+
 	if (error_code) {
 		fprintf(stderr, "Probe reported error 0x%02x.\n", error_code);
 		exit(1);
 	}
 
-	int num_bits = 0;
-	int bit2pin[16] = { /* zeros */ };
-	for (int i = 0; i < TOTAL_PIN_NUM; i++) {
-		if ((pins[i] & PIN_CAPTURE) == 0)
-			continue;
-		bit2pin[num_bits++] = i;
-	}
-
-	int num_words = get_numwords(data, num_bits);
-	for (int i = 0; i < num_words; i++) {
-		uint16_t word = get_word(data, i, num_bits);
-		uint16_t sample = 0;
-		for (int j = 0; j < num_bits; j++) {
-			if ((word & (1 << j)) == 0)
-				continue;
-			sample |= 1 << bit2pin[j];
-		}
-		if (verbose)
-			printf("Decode: word=0x%04x -> sample=0x%04x\n", word, sample);
-		samples.push_back(sample);
-	}
+	unpack_close();
 
 	printf("Decoded %d samples from captured data. Avg. sampling rate: %.2f kS/s.\n", (int)samples.size(), 1e-3 * samples.size() / tv_diff);
+	printf("Sample memory usage: %.2f kB (%.2f bytes/sample).\n", samples.memory_usage() / 1024.0,
+			samples.memory_usage() / double(samples.size() ? samples.size() : 1));
+
+	if (record)
+		recorder_finish();
 }
 
@@ -0,0 +1,259 @@
+/*
+ *  ArduLogic - Low Speed Logic Analyzer using the Arduino Hardware
+ *
+ *  Copyright (C) 2011  Clifford Wolf <clifford@clifford.at>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+
+#include "ardulogic.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+// The flight recorder checks the match statements on the samples as they
+// arrive and only keeps the samples that might end up in the window. When
+// the window after a match is complete the capture is stopped, or with
+// rearm the window is written to numbered output files and the recorder
+// waits for the next match after the window.
+
+struct recorder_state {
+	size_t checked, decoded;
+	uint16_t last;
+	bool matched[MAX_MATCHES];
+	int edge_pos[MAX_MATCHES];
+	std::vector<size_t> hits;
+
+	bool triggered, complete;
+	size_t trigger, armed_from;
+	int windows;
+
+	bool decoding;
+	struct decoder_set ds;
+	struct decode_batch batch;
+};
+
+static struct recorder_state rec;
+
+// pin patterns match when entering the pattern, edge sequences when the
+// last edge is found
+static bool match_sample(struct record_match *m, int k, uint16_t prev, uint16_t value, bool first)
+{
+	if (m->type == MATCH_PINS) {
+		bool matched = (value & m->mask) == m->value;
+		bool hit = matched && !rec.matched[k];
+		rec.matched[k] = matched;
+		return hit;
+	}
+
+	if (m->type != MATCH_EDGES || first)
+		return false;
+
+	uint16_t rise = ~prev & value, fall = prev & ~value;
+	int &pos = rec.edge_pos[k];
+
+	// other edges on the pins of the sequence start it over
+	for (int retry = 0; retry < 2; retry++) {
+		while (pos < m->num_edges) {
+			uint16_t &edges = m->edge_dir[pos] == PIN_TRIGGER_POSEDGE ? rise : fall;
+			if ((edges & (1 << m->edge_pin[pos])) == 0)
+				break;
+			edges &= ~(1 << m->edge_pin[pos]);
+			pos++;
+		}
+		if (pos == m->num_edges) {
+			pos = 0;
+			return true;
+		}
+		uint16_t others = 0;
+		for (int i = 0; i < m->num_edges; i++)
+			others |= 1 << m->edge_pin[i];
+		if (((rise | fall) & others) == 0)
+			break;
+		rise &= others, fall &= others;
+		pos = 0;
+	}
+	return false;
+}
+
+static uint64_t event_value(const struct decode_batch &batch, const struct decode_event &ev)
+{
+	if (ev.width == 0)
+		return ev.value;
+	uint64_t value = 0;
+	for (int i = ev.width > 64 ? ev.width - 64 : 0; i < ev.width; i++)
+		value = 2*value + (batch.bits[ev.value + i] == '1');
+	return value;
+}
+
+static void check_samples(size_t end)
+{
+	for (sample_cursor cursor(samples, rec.checked); cursor.valid() && cursor.idx < end; cursor.next_run()) {
+		bool first = cursor.idx == 0;
+		if (!first && cursor.value == rec.last)
+			continue;
+		for (int k = 0; k < num_matches; k++)
+			if (match_sample(&matches[k], k, rec.last, cursor.value, first))
+				rec.hits.push_back(cursor.idx);
+		rec.last = cursor.value;
+	}
+	rec.checked = end;
+
+	if (!rec.decoding || end <= 1)
+		return;
+
+	decoders_decode(&rec.ds, rec.decoded > 1 ? rec.decoded : 1, end, rec.batch);
+	rec.decoded = end;
+	for (size_t i = 0; i < rec.batch.events.size(); i++) {
+		const struct decode_event &ev = rec.batch.events[i];
+		if (ev.kind != EV_DATA)
+			continue;
+		for (int k = 0; k < num_matches; k++)
+			if (matches[k].type == MATCH_DATA && event_value(rec.batch, ev) == matches[k].data)
+				rec.hits.push_back(ev.idx);
+	}
+	rec.batch = decode_batch();
+}
+
+// copy the samples begin..end-1 to a new store
+static void cut_window(struct sample_store &out, size_t begin, size_t end)
+{
+	out.clear();
+	for (sample_cursor cursor(samples, begin); cursor.valid() && cursor.idx < end; cursor.next_run())
+		for (size_t i = cursor.idx; i < cursor.run_end && i < end; i++) {
+			if (samples.timed)
+				out.push_back(cursor.value, samples.time(i));
+			else
+				out.push_back(cursor.value);
+		}
+}
+
+static size_t window_begin()
+{
+	return rec.trigger > record_pre ? rec.trigger - record_pre : 0;
+}
+
+static void write_window()
+{
+	struct sample_store window;
+	cut_window(window, window_begin(), rec.trigger + record_post);
+
+	printf("Writing window %d (trigger at sample %zd of %zd).\n", ++rec.windows,
+			rec.trigger - window_begin(), window.size());
+	samples.swap(window);
+	writeoutputs(rec.windows);
+	samples.swap(window);
+}
+
+void recorder_init()
+{
+	rec.checked = rec.decoded = 0;
+	rec.last = 0;
+	memset(rec.matched, 0, sizeof(rec.matched));
+	memset(rec.edge_pos, 0, sizeof(rec.edge_pos));
+	rec.hits.clear();
+	rec.triggered = rec.complete = false;
+	rec.trigger = rec.armed_from = 0;
+	rec.windows = 0;
+
+	rec.decoding = false;
+	for (int k = 0; k < num_matches; k++)
+		if (matches[k].type == MATCH_DATA)
+			rec.decoding = true;
+	if (rec.decoding) {
+		decoders_init(&rec.ds, rec.batch);
+		rec.batch = decode_batch();
+	}
+}
+
+// Check the new samples, returns true when the capture can be stopped.
+bool recorder_update()
+{
+	if (rec.complete)
+		return true;
+
+	rec.hits.clear();
+	check_samples(samples.size());
+	std::sort(rec.hits.begin(), rec.hits.end());
+
+	for (size_t k = 0; true; ) {
+		if (!rec.triggered) {
+			while (k < rec.hits.size() && rec.hits[k] < rec.armed_from)
+				k++;
+			if (k == rec.hits.size())
+				break;
+			rec.triggered = true;
+			rec.trigger = rec.hits[k++];
+		}
+		if (samples.size() < rec.trigger + record_post)
+			break;
+		if (!record_rearm) {
+			rec.complete = true;
+			return true;
+		}
+		write_window();
+		rec.triggered = false;
+		rec.armed_from = rec.trigger + record_post;
+	}
+
+	// Keep record_pre samples before the trigger (or the samples checked so
+	// far). Blocks are only dropped when there are more than a window
+	// of them, so the store holds at most about two windows.
+	size_t keep = rec.triggered ? rec.trigger : rec.checked;
+	size_t first = samples.first_block * SAMPLE_BLOCK;
+	if (keep > first + 2*record_pre + record_post + SAMPLE_BLOCK)
+		samples.drop(keep - record_pre - 1);
+	return false;
+}
+
+// Reduce the samples to the window of the last match, or to the last
+// record_pre samples when nothing matched. With rearm the complete windows
+// have been written already, an incomplete one at the end is dropped.
+void recorder_finish()
+{
+	recorder_update();
+	if (rec.decoding)
+		decoders_done(&rec.ds);
+
+	size_t begin, end = samples.size();
+	if (rec.windows > 0) {
+		if (rec.triggered)
+			printf("Dropping the incomplete window after the trigger at sample %zd.\n", rec.trigger);
+		begin = end;
+	} else if (rec.triggered) {
+		begin = window_begin();
+		if (end > rec.trigger + record_post)
+			end = rec.trigger + record_post;
+		printf("Keeping %zd samples around the trigger at sample %zd.\n", end - begin, rec.trigger);
+	} else {
+		begin = end > record_pre ? end - record_pre : 0;
+		printf("No trigger, keeping the last %zd samples.\n", end - begin);
+	}
+
+	struct sample_store window;
+	cut_window(window, begin, end);
+	samples.swap(window);
+}
+
+// the number of windows written with rearm
+int recorder_windows()
+{
+	return rec.windows;
+}
@@ -0,0 +1,238 @@
+/*
+ *  ArduLogic - Low Speed Logic Analyzer using the Arduino Hardware
+ *
+ *  Copyright (C) 2011  Clifford Wolf <clifford@clifford.at>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "ardulogic.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+// A record is the varint (7 bits per byte, LSB first) of
+// (repetitions-1) << 16 | (value ^ previous value). The previous value
+// is zero at the start of each block, so each block can be decoded on
+// its own. Blocks never share a run.
+
+static inline uint64_t read_varint(const uint8_t *p, size_t &pos)
+{
+	uint64_t v = 0;
+	for (int shift = 0;; shift += 7) {
+		uint8_t ch = p[pos++];
+		v |= uint64_t(ch & 0x7f) << shift;
+		if ((ch & 0x80) == 0)
+			return v;
+	}
+}
+
+// Decoded blocks for random access using operator[]. Each thread has its
+// own cache, so concurrent readers don't get in each others way.
+static thread_local struct {
+	const sample_store *store[2];
+	size_t block[2], count[2];
+	uint16_t data[2][SAMPLE_BLOCK];
+	int next;
+} cache;
+
+sample_store::sample_store()
+{
+	mapped = NULL;
+	clear();
+}
+
+void sample_store::clear()
+{
+	packed.clear();
+	block_offset.clear();
+	count = 0;
+	last_value = 0;
+	run_value = 0;
+	run_len = 0;
+	first_block = 0;
+	timed = false;
+	times.clear();
+	mapped = NULL;
+	mapped_times = NULL;
+	mapped_size = 0;
+	forget();
+}
+
+// drop the cached blocks of this store
+void sample_store::forget() const
+{
+	for (int k = 0; k < 2; k++)
+		if (cache.store[k] == this)
+			cache.store[k] = NULL;
+}
+
+// Discard the blocks before the one holding sample n (the flight recorder
+// only keeps a window of the capture). The sample indices don't change.
+void sample_store::drop(size_t n)
+{
+	if (mapped || n / SAMPLE_BLOCK <= first_block)
+		return;
+
+	size_t blocks = n / SAMPLE_BLOCK - first_block;
+	if (blocks >= block_offset.size())
+		blocks = block_offset.size() - 1;
+	size_t bytes = block_offset[blocks];
+
+	packed.erase(packed.begin(), packed.begin() + bytes);
+	block_offset.erase(block_offset.begin(), block_offset.begin() + blocks);
+	for (size_t i = 0; i < block_offset.size(); i++)
+		block_offset[i] -= bytes;
+	if (timed)
+		times.erase(times.begin(), times.begin() + blocks * SAMPLE_BLOCK);
+	first_block += blocks;
+	forget();
+}
+
+void sample_store::swap(struct sample_store &other)
+{
+	std::swap(*this, other);
+	forget();
+	other.forget();
+}
+
+void sample_store::flush_run()
+{
+	if (run_len == 0)
+		return;
+	uint64_t v = (uint64_t(run_len - 1) << 16) | (run_value ^ last_value);
+	while (v >= 0x80) {
+		packed.push_back(v | 0x80);
+		v >>= 7;
+	}
+	packed.push_back(v);
+	last_value = run_value;
+	run_len = 0;
+}
+
+void sample_store::decode_block(size_t block, uint16_t *out) const
+{
+	block -= first_block;
+	size_t pos = block_offset[block];
+	size_t end = block+1 < block_offset.size() ? block_offset[block+1] : packed.size();
+	uint16_t value = 0;
+
+	while (pos < end) {
+		uint64_t v = read_varint(packed.data(), pos);
+		value ^= v & 0xffff;
+		for (size_t n = (v >> 16) + 1; n > 0; n--)
+			*(out++) = value;
+	}
+
+	if (block+1 == block_offset.size())
+		for (size_t n = run_len; n > 0; n--)
+			*(out++) = run_value;
+}
+
+uint16_t sample_store::lookup(size_t i) const
+{
+	size_t block = i / SAMPLE_BLOCK;
+	if (block < first_block)
+		return 0;
+
+	// the last block may have grown since it was decoded
+	for (int k = 0; k < 2; k++)
+		if (cache.store[k] == this && cache.block[k] == block && i < cache.count[k])
+			return cache.data[k][i % SAMPLE_BLOCK];
+
+	int k = cache.next;
+	cache.next = !cache.next;
+	decode_block(block, cache.data[k]);
+	cache.store[k] = this;
+	cache.block[k] = block;
+	cache.count[k] = count;
+	return cache.data[k][i % SAMPLE_BLOCK];
+}
+
+sample_cursor::sample_cursor(const struct sample_store &s, size_t i) : store(&s)
+{
+	seek(i);
+}
+
+void sample_cursor::seek(size_t i)
+{
+	pending = false;
+	value = 0;
+
+	if (i >= store->size()) {
+		idx = run_start = run_end = i;
+		return;
+	}
+
+	if (store->mapped) {
+		idx = i;
+		load();
+		return;
+	}
+
+	idx = i - i % SAMPLE_BLOCK;
+	while (load() && run_end <= i)
+		idx = run_end;
+	idx = i;
+}
+
+// load the run starting at idx
+bool sample_cursor::load()
+{
+	if (idx >= store->size()) {
+		run_start = run_end = idx;
+		return false;
+	}
+
+	if (store->mapped) {
+		value = store->mapped[idx];
+		run_start = idx;
+		run_end = idx + 1;
+		return true;
+	}
+
+	// the pending run might have been written to the block in the meantime
+	if (pending) {
+		seek(idx);
+		return true;
+	}
+
+	size_t block = idx / SAMPLE_BLOCK - store->first_block;
+	uint16_t prev = value;
+	if (idx % SAMPLE_BLOCK == 0) {
+		pos = store->block_offset[block];
+		prev = 0;
+	}
+
+	size_t end = block+1 < store->block_offset.size() ? store->block_offset[block+1] : store->packed.size();
+	run_start = idx;
+
+	if (pos < end) {
+		uint64_t v = read_varint(store->packed.data(), pos);
+		value = prev ^ (v & 0xffff);
+		run_end = idx + (v >> 16) + 1;
+	} else {
+		value = store->run_value;
+		run_end = store->count;
+		pending = true;
+	}
+
+	return true;
+}
+
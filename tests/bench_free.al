@@ -0,0 +1,3 @@
+# configuration for the free running captures of gendata
+capture A0 A1 A2 A3 A4 A5 D2 D3 D4 D5 D6 D7
+trigger 100kHz
@@ -0,0 +1,2 @@
+# configuration for the i2c captures of gendata
+decode i2c D2 D3
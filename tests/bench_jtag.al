@@ -0,0 +1,2 @@
+# configuration for the jtag captures of gendata
+decode jtag D2 D3 D4 D5
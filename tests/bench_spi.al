@@ -0,0 +1,2 @@
+# configuration for the spi captures of gendata
+decode spi posedge msb D2 !D3 D4 D5
@@ -0,0 +1,314 @@
+/*
+ *  Copyright (C) 2011  Clifford Wolf <clifford@clifford.at>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+// Microbenchmark for the serial payload unpacker: compares the old
+// bit-at-a-time get_word() decoder with the unpack_*() kernels and checks
+// that both produce the same samples for all word widths. The run-length
+// and timestamp kernels are checked against encoders of their own.
+//
+// Usage: ./bench_unpack [payload_megabytes]
+
+#include "../ardulogic.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + 1e-6 * tv.tv_usec;
+}
+
+// this is the decoder from readdata.cc before the unpack kernels
+static bool get_bit(std::vector<uint8_t> &data, size_t num)
+{
+	size_t byte_num = num / 7;
+	size_t bit_num = num % 7;
+	return (data[byte_num] & (1 << bit_num)) != 0;
+}
+
+static uint16_t get_word(std::vector<uint8_t> &data, size_t num, size_t bits)
+{
+	uint16_t value = 0;
+	for (size_t i = 0; i < bits; i++)
+		value |= get_bit(data, num*bits + i) ? 1 << i : 0;
+	return value;
+}
+
+static void old_unpack(std::vector<uint8_t> &data, uint16_t capture_mask, std::vector<uint16_t> &out)
+{
+	int num_bits = 0;
+	int bit2pin[16] = { /* zeros */ };
+	for (int i = 0; i < TOTAL_PIN_NUM; i++) {
+		if ((capture_mask & (1 << i)) == 0)
+			continue;
+		bit2pin[num_bits++] = i;
+	}
+
+	size_t num_words = ((data.size()-1) * 7 - (data.back() & ~0x80)) / num_bits;
+	for (size_t i = 0; i < num_words; i++) {
+		uint16_t word = get_word(data, i, num_bits);
+		uint16_t sample = 0;
+		for (int j = 0; j < num_bits; j++) {
+			if ((word & (1 << j)) == 0)
+				continue;
+			sample |= 1 << bit2pin[j];
+		}
+		out.push_back(sample);
+	}
+}
+
+// the encoder as implemented by fifo_push() and fifo_close() in the firmware
+static void encode(int num_bits, size_t num_words, std::vector<uint8_t> &data)
+{
+	uint8_t cur = 0x80;
+	int fifo_bits = 7;
+	for (size_t i = 0; i < num_words; i++) {
+		uint16_t w = random() & ((1 << num_bits) - 1);
+		for (int bits = num_bits; bits > 0; ) {
+			int bc = bits > fifo_bits ? fifo_bits : bits;
+			cur |= (w << (7-fifo_bits)) & 0x7f;
+			fifo_bits -= bc;
+			if (fifo_bits == 0) {
+				data.push_back(cur);
+				cur = 0x80, fifo_bits = 7;
+			}
+			w = w >> bc;
+			bits -= bc;
+		}
+	}
+	data.push_back(cur);
+	data.push_back(0x80 | fifo_bits);
+}
+
+// the run-length encoding as implemented by rle_push() in the firmware
+static void encode_rle(int num_bits, const std::vector<uint16_t> &words, std::vector<uint8_t> &data)
+{
+	uint8_t cur = 0x80;
+	int fifo_bits = 7;
+	uint16_t last = 0;
+	int count = 0;
+
+	for (size_t i = 0; i <= words.size(); i++) {
+		uint32_t rec[2];
+		int rec_bits[2], n = 0;
+		if (i < words.size() && words[i] == last && ++count < 128)
+			continue;
+		if (count > 0) {
+			rec[n] = ((count-1) << 1) | 1, rec_bits[n++] = 8;
+			count = 0;
+		}
+		if (i < words.size() && words[i] != last) {
+			rec[n] = words[i] << 1, rec_bits[n++] = num_bits + 1;
+			last = words[i];
+		}
+		for (int k = 0; k < n; k++)
+			for (int bits = rec_bits[k]; bits > 0; ) {
+				int bc = bits > fifo_bits ? fifo_bits : bits;
+				cur |= (rec[k] << (7-fifo_bits)) & 0x7f;
+				fifo_bits -= bc;
+				if (fifo_bits == 0) {
+					data.push_back(cur);
+					cur = 0x80, fifo_bits = 7;
+				}
+				rec[k] = rec[k] >> bc;
+				bits -= bc;
+			}
+	}
+	data.push_back(cur);
+	data.push_back(0x80 | fifo_bits);
+}
+
+static void push_bits(std::vector<uint8_t> &data, uint8_t &cur, int &fifo_bits, uint32_t w, int bits)
+{
+	while (bits > 0) {
+		int bc = bits > fifo_bits ? fifo_bits : bits;
+		cur |= (w << (7-fifo_bits)) & 0x7f;
+		fifo_bits -= bc;
+		if (fifo_bits == 0) {
+			data.push_back(cur);
+			cur = 0x80, fifo_bits = 7;
+		}
+		w = w >> bc;
+		bits -= bc;
+	}
+}
+
+// the timestamp records as implemented by ts_push() and the Timer1
+// overflow ISR in the firmware (times in timer ticks)
+static void encode_ts(int num_bits, const std::vector<uint16_t> &words, const std::vector<uint64_t> &ticks, std::vector<uint8_t> &data)
+{
+	uint8_t cur = 0x80;
+	int fifo_bits = 7;
+	uint64_t overflows = 0;
+	uint16_t last = 0;
+
+	for (size_t i = 0; i < words.size(); i++) {
+		for (; overflows < ticks[i] >> 16; overflows++)
+			push_bits(data, cur, fifo_bits, 1, 1);
+		uint16_t delta = uint16_t(ticks[i]) - last;
+		last = ticks[i];
+		push_bits(data, cur, fifo_bits, words[i] << 1, num_bits + 1);
+		if (delta < 128)
+			push_bits(data, cur, fifo_bits, delta << 1, 8);
+		else {
+			push_bits(data, cur, fifo_bits, 1, 1);
+			push_bits(data, cur, fifo_bits, delta, 16);
+		}
+	}
+	data.push_back(cur);
+	data.push_back(0x80 | fifo_bits);
+}
+
+int main(int argc, char **argv)
+{
+	size_t payload_size = (argc > 1 ? atoi(argv[1]) : 16) << 20;
+	static struct unpacker u;
+	bool ok = true;
+
+	printf("bits    old MB/s    new MB/s   speedup\n");
+	for (int num_bits = 1; num_bits <= TOTAL_PIN_NUM; num_bits++)
+	{
+		// spread the captured pins over the word to exercise the remapping
+		uint16_t capture_mask = 0;
+		for (int i = 0, k = 0; k < num_bits; i = (i + 5) % TOTAL_PIN_NUM)
+			if ((capture_mask & (1 << i)) == 0)
+				capture_mask |= 1 << i, k++;
+
+		std::vector<uint8_t> data;
+		encode(num_bits, payload_size * 7 / num_bits, data);
+
+		std::vector<uint16_t> old_samples, new_samples;
+		old_samples.reserve(payload_size * 7 / num_bits + 1);
+
+		double t0 = now();
+		old_unpack(data, capture_mask, old_samples);
+		double t1 = now();
+
+		// feed the data in blocks like readdata() does
+		unpack_init(&u, capture_mask);
+		new_samples.resize(unpack_maxwords(&u, data.size()));
+		size_t n = 0;
+		for (size_t i = 0; i < data.size(); i += 1024) {
+			size_t len = data.size() - i < 1024 ? data.size() - i : 1024;
+			n += unpack_data(&u, &data[i], len, &new_samples[n]);
+		}
+		int rc = unpack_finish(&u, &new_samples[n]);
+		double t2 = now();
+
+		if (rc < 0 || u.carry_len != 0)
+			ok = false;
+		new_samples.resize(n + (rc > 0 ? rc : 0));
+		if (new_samples != old_samples) {
+			printf("%4d  MISMATCH (%zd vs %zd samples)\n", num_bits, new_samples.size(), old_samples.size());
+			ok = false;
+			continue;
+		}
+
+		double mb = data.size() / double(1 << 20);
+		printf("%4d  %10.1f  %10.1f  %8.1fx\n", num_bits, mb / (t1-t0), mb / (t2-t1), (t1-t0) / (t2-t1));
+	}
+
+	printf("\nbits  rle MB/s   samples/byte\n");
+	for (int num_bits = 1; num_bits <= TOTAL_PIN_NUM; num_bits++)
+	{
+		uint16_t capture_mask = (1 << num_bits) - 1;
+
+		// bursts of changes with idle periods in between
+		std::vector<uint16_t> words, samples;
+		while (words.size() < payload_size) {
+			int run = random() % 4 == 0 ? random() % 1000 : 1;
+			words.insert(words.end(), run, random() & capture_mask);
+		}
+
+		std::vector<uint8_t> data;
+		encode_rle(num_bits, words, data);
+
+		double t0 = now();
+		unpack_init_rle(&u, capture_mask);
+		samples.resize(unpack_maxwords(&u, data.size()));
+		size_t n = 0;
+		for (size_t i = 0; i < data.size(); i += 1024) {
+			size_t len = data.size() - i < 1024 ? data.size() - i : 1024;
+			n += unpack_data(&u, &data[i], len, &samples[n]);
+		}
+		int rc = unpack_finish(&u, &samples[n]);
+		double t1 = now();
+
+		samples.resize(n + (rc > 0 ? rc : 0));
+		if (rc < 0 || u.carry_len != 0 || samples != words) {
+			printf("%4d  MISMATCH (%zd vs %zd samples)\n", num_bits, samples.size(), words.size());
+			ok = false;
+			continue;
+		}
+
+		double mb = data.size() / double(1 << 20);
+		printf("%4d  %10.1f  %13.1f\n", num_bits, mb / (t1-t0), words.size() / double(data.size()));
+	}
+
+	printf("\nbits   ts MB/s   samples/byte\n");
+	for (int num_bits = 1; num_bits <= TOTAL_PIN_NUM; num_bits++)
+	{
+		uint16_t capture_mask = (1 << num_bits) - 1;
+
+		// mostly short intervals, some longer than a timer overflow
+		std::vector<uint16_t> words, samples;
+		std::vector<uint64_t> ticks, times, expected;
+		uint64_t t = 0;
+		while (words.size() < payload_size / 4) {
+			t += random() % 8 == 0 ? random() % 200000 : random() % 128;
+			words.push_back(random() & capture_mask);
+			ticks.push_back(t);
+			expected.push_back(t * 125 / 2);
+		}
+
+		std::vector<uint8_t> data;
+		encode_ts(num_bits, words, ticks, data);
+
+		double t0 = now();
+		unpack_init_ts(&u, capture_mask);
+		samples.resize(unpack_maxwords(&u, data.size()));
+		times.resize(samples.size());
+		u.tout = times.data();
+		size_t n = 0;
+		for (size_t i = 0; i < data.size(); i += 1024) {
+			size_t len = data.size() - i < 1024 ? data.size() - i : 1024;
+			n += unpack_data(&u, &data[i], len, &samples[n]);
+		}
+		int rc = unpack_finish(&u, &samples[n]);
+		double t1 = now();
+
+		samples.resize(n + (rc > 0 ? rc : 0));
+		times.resize(samples.size());
+		if (rc < 0 || u.carry_len != 0 || samples != words || times != expected) {
+			printf("%4d  MISMATCH (%zd vs %zd samples)\n", num_bits, samples.size(), words.size());
+			ok = false;
+			continue;
+		}
+
+		double mb = data.size() / double(1 << 20);
+		printf("%4d  %10.1f  %13.1f\n", num_bits, mb / (t1-t0), words.size() / double(data.size()));
+	}
+
+	return ok ? 0 : 1;
+}
+
@@ -0,0 +1,3 @@
+# configuration for the emucheck target (see emuprobe.cc)
+capture A0 A1 A2 D5
+trigger 100kHz
@@ -0,0 +1,750 @@
+/*
+ *  Copyright (C) 2011  Clifford Wolf <clifford@clifford.at>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+// Probe emulator on a pseudo terminal: speaks the protocol of the firmware
+// generated by genfirmware.cc (answers to queries, header, 7 bit payload
+// bytes with the 0x80 flag, trailer byte, the 0x00 0x01 <error> end marker
+// and restarts), so the host side can be tested and benchmarked without an
+// Arduino:
+//
+//	$ ./emuprobe -p A0:c,A1:c,A2:c -f 100000 -r 100000 -o sent.raw /tmp/probe &
+//	$ ../ardulogic -t /tmp/probe -R got.raw emu.al
+//	$ cmp sent.raw got.raw
+//
+// The pin configuration is given as printed by ardulogic in the "Capture
+// configuration" line (c = capture, p/n = trigger on posedge/negedge,
+// u = pullup). Samples are random or read from a text RAW file (-i) and
+// are sent at the given rate (-r, default as fast as the host reads them).
+// With a rate the probe FIFO of 256 bytes is emulated: when the host or the
+// baud rate (-B) can't keep up, error 0x01 is reported like the firmware
+// does. The capture ends when the host sends the stop request or after -n
+// samples. Like the firmware, the emulator then waits for the next query,
+// also when the host closes and opens the link again.
+//
+// With -u the universal firmware is emulated: the pins and the mode are
+// taken from the configuration frame sent by the host instead of -p/-m.
+//
+// The pty has no baud rate, so the negotiation of the link speed always
+// succeeds. With -L the test burst is corrupted for rates above the given
+// one, like on a bad cable, so the host falls back to a slower rate. With
+// -A the LINK_KEEP acknowledge is lost above the given rate.
+//
+// With -o the samples are written in the text RAW format ardulogic writes
+// with -R. Samples in the last two payload bytes before a restart (-S) are
+// lost on the host, so don't compare the files in this case.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include <string>
+#include <vector>
+
+#define TOTAL_PIN_NUM 12
+#define FIFO_SIZE 256
+#define TS_TICKS_PER_SEC 16000000
+
+// the handshake and the configuration frame of the universal firmware
+// (see ardulogic.h)
+#define PROTOCOL_VERSION	3
+#define PROBE_QUERY		'?'
+#define PROBE_START		'S'
+#define LINK_BAUD		'B'
+#define LINK_TEST		'T'
+#define LINK_KEEP		'K'
+#define LINK_ABORT		'A'
+#define LINK_TEST_BYTES		256
+#define LINK_RATE(ubrr)		(2000000.0 / ((ubrr) + 1))
+#define LINK_TEST_BYTE(i)	((uint8_t)((i) * 0x9d + 0x35))
+#define UNIVERSAL_VERSION	1
+#define UNIVERSAL_FRAME_MAX	96
+#define UCFG_FLAGS	1
+#define UCFG_CAPC	2
+#define UCFG_CAPD	3
+#define UCFG_PULLUPC	4
+#define UCFG_PULLUPD	5
+#define UCFG_POSC	6
+#define UCFG_NEGC	7
+#define UCFG_POSD	8
+#define UCFG_NEGD	9
+#define UCFG_SIZE	15
+
+static const char *pin_names[TOTAL_PIN_NUM] = {
+	"A0", "A1", "A2", "A3", "A4", "A5",
+	"D2", "D3", "D4", "D5", "D6", "D7"
+};
+
+static int pins[TOTAL_PIN_NUM];
+static int num_bits;
+static int capture_pin[TOTAL_PIN_NUM];
+static long trigger_freq;
+static bool mode_rle, mode_ts;
+static double rate, baud, link_max, keep_max;
+static long long max_samples = -1;
+static long change_every = 1;
+static long long restart_at = -1, corrupt_at = -1;
+static int final_error;
+static bool keep_running, universal;
+static std::string config_header;
+static const char *input_file, *output_file;
+
+static std::vector<uint16_t> input_samples;
+static std::vector<uint64_t> input_times;
+
+static int master_fd;
+
+// encoder state, as in the firmware
+static std::vector<uint8_t> outbox;
+static size_t outbox_pos;
+static uint8_t cur_byte;
+static int free_bits;
+static uint16_t rle_last;
+static int rle_count;
+static uint64_t ts_ticks, ts_overflows;
+static uint16_t ts_last;
+static int error_code;
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + 1e-6 * tv.tv_usec;
+}
+
+static void usage()
+{
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Usage: emuprobe -p <pins> [options] [<link>]\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "    -p <pins>   pin configuration, e.g. A0:c,A1:c,D2:p\n");
+	fprintf(stderr, "    -f <freq>   free running trigger frequency in Hz (header only)\n");
+	fprintf(stderr, "    -m rle|ts   run-length encoding or timestamps\n");
+	fprintf(stderr, "    -r <rate>   samples per second (default: as fast as possible)\n");
+	fprintf(stderr, "    -B <baud>   limit the link to the given baud rate\n");
+	fprintf(stderr, "    -L <baud>   fail the link test above the given baud rate\n");
+	fprintf(stderr, "    -A <baud>   lose the link test acknowledge above the given baud rate\n");
+	fprintf(stderr, "    -n <num>    stop after this number of samples\n");
+	fprintf(stderr, "    -c <num>    random samples change every <num> samples on average\n");
+	fprintf(stderr, "    -i <file>   send the samples from a text RAW file (repeated)\n");
+	fprintf(stderr, "    -o <file>   write the samples sent to a text RAW file\n");
+	fprintf(stderr, "    -E <code>   report this error code at the end of the capture\n");
+	fprintf(stderr, "    -S <num>    restart (reset the probe) after <num> samples\n");
+	fprintf(stderr, "    -C <num>    send a corrupt payload byte after <num> samples\n");
+	fprintf(stderr, "    -k          wait for the next capture after a capture\n");
+	fprintf(stderr, "    -u          emulate the universal firmware (no -p/-f/-m needed)\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "The <link> is created as symlink to the pty slave device.\n");
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+static void setup_pins()
+{
+	num_bits = 0;
+	for (int i = 0; i < TOTAL_PIN_NUM; i++)
+		if ((pins[i] & 0x01) != 0)
+			capture_pin[num_bits++] = i;
+}
+
+static void parse_pins(const char *spec)
+{
+	char *buf = strdup(spec);
+	for (char *tok = strtok(buf, ", "); tok != NULL; tok = strtok(NULL, ", ")) {
+		char *flags = strchr(tok, ':');
+		if (flags != NULL)
+			*(flags++) = 0;
+		int i = 0;
+		while (i < TOTAL_PIN_NUM && strcmp(tok, pin_names[i]))
+			i++;
+		if (i == TOTAL_PIN_NUM) {
+			fprintf(stderr, "Unknown pin `%s'.\n", tok);
+			exit(1);
+		}
+		for (; flags != NULL && *flags; flags++)
+			switch (*flags) {
+			case 'c': pins[i] |= 0x01; break;
+			case 'p': pins[i] |= 0x02; break;
+			case 'n': pins[i] |= 0x04; break;
+			case 'u': pins[i] |= 0x08; break;
+			default:
+				fprintf(stderr, "Unknown pin flag `%c'.\n", *flags);
+				exit(1);
+			}
+	}
+	free(buf);
+
+	setup_pins();
+	if (num_bits == 0) {
+		fprintf(stderr, "No pins configured for capturing.\n");
+		exit(1);
+	}
+}
+
+static void read_input()
+{
+	FILE *f = fopen(input_file, "r");
+	if (f == NULL) {
+		fprintf(stderr, "Can't open RAW file `%s' for reading: %s\n", input_file, strerror(errno));
+		exit(1);
+	}
+	char line[256];
+	while (fgets(line, sizeof(line), f) != NULL) {
+		char *p = line, *end;
+		unsigned long sample = strtoul(p, &end, 16);
+		if (end == p)
+			continue;
+		p = end;
+		unsigned long long time = strtoull(p, &end, 10);
+		input_samples.push_back(sample);
+		if (end != p)
+			input_times.push_back(time);
+	}
+	fclose(f);
+
+	if (input_samples.size() == 0) {
+		fprintf(stderr, "No samples in RAW file `%s'.\n", input_file);
+		exit(1);
+	}
+	if (mode_ts && input_times.size() != input_samples.size()) {
+		fprintf(stderr, "Timestamps need a time for each sample in RAW file `%s'.\n", input_file);
+		exit(1);
+	}
+}
+
+static void push_byte(uint8_t ch)
+{
+	outbox.push_back(ch);
+}
+
+static void push_bits(uint32_t w, int bits)
+{
+	while (bits > 0) {
+		int bc = bits > free_bits ? free_bits : bits;
+		cur_byte |= (w << (7-free_bits)) & 0x7f;
+		free_bits -= bc;
+		if (free_bits == 0) {
+			push_byte(cur_byte);
+			cur_byte = 0x80, free_bits = 7;
+		}
+		w = w >> bc;
+		bits -= bc;
+	}
+}
+
+static void rle_flush()
+{
+	if (rle_count == 0)
+		return;
+	push_bits(((rle_count-1) << 1) | 1, 8);
+	rle_count = 0;
+}
+
+static void push_sample(uint16_t w, uint64_t ticks)
+{
+	if (mode_rle) {
+		if (w == rle_last) {
+			if (++rle_count == 128)
+				rle_flush();
+			return;
+		}
+		rle_flush();
+		push_bits(w << 1, num_bits + 1);
+		rle_last = w;
+		return;
+	}
+
+	if (mode_ts) {
+		for (; ts_overflows < ticks >> 16; ts_overflows++)
+			push_bits(1, 1);
+		uint16_t delta = uint16_t(ticks) - ts_last;
+		ts_last = ticks;
+		push_bits(w << 1, num_bits + 1);
+		if (delta < 128)
+			push_bits(delta << 1, 8);
+		else {
+			push_bits(1, 1);
+			push_bits(delta, 16);
+		}
+		return;
+	}
+
+	push_bits(w, num_bits);
+}
+
+static int make_header(char *buffer)
+{
+	int len = sprintf(buffer, "ARDULOGIC:");
+	for (int i = 0; i < TOTAL_PIN_NUM; i++)
+		buffer[len++] = pins[i] + '0';
+	len += sprintf(buffer + len, ":%lx:%s%s\r\n", trigger_freq, mode_rle ? "rle:" : "", mode_ts ? "ts:" : "");
+	return len;
+}
+
+// the answer to a query, with the hash of the configuration part of the
+// header (folded 64 bit FNV-1a) or the version of the universal firmware
+static void push_ident()
+{
+	char id[16];
+	if (universal) {
+		sprintf(id, "U%x", UNIVERSAL_VERSION);
+	} else {
+		char buffer[100];
+		int len = make_header(buffer);
+		uint64_t hash = 0xcbf29ce484222325ull;
+		for (int i = 10; i < len; i++) {
+			hash ^= (uint8_t)buffer[i];
+			hash *= 0x100000001b3ull;
+		}
+		sprintf(id, "%08x", uint32_t(hash ^ (hash >> 32)));
+	}
+
+	char ident[64];
+	int len = sprintf(ident, "ARDULOGIC?%x:%s:\r\n", PROTOCOL_VERSION, id);
+	for (int i = 0; i < 10; i++)
+		push_byte(0);
+	for (int i = 0; i < len; i++)
+		push_byte(ident[i]);
+}
+
+static void push_header()
+{
+	push_byte(0);
+	push_byte(0);
+	char buffer[100];
+	int len = make_header(buffer);
+	// the universal firmware sends back the header from the host
+	if (universal)
+		len = config_header.copy(buffer, sizeof(buffer), 2);
+	for (int i = 0; i < len; i++)
+		push_byte(buffer[i]);
+
+	cur_byte = 0x80;
+	free_bits = 7;
+	rle_last = 0;
+	rle_count = 0;
+	ts_overflows = ts_ticks >> 16;
+	ts_last = ts_ticks;
+}
+
+static void push_trailer()
+{
+	rle_flush();
+	push_byte(cur_byte);
+	push_byte(0x80 | free_bits);
+	push_byte(0);
+	push_byte(1);
+	push_byte(error_code);
+}
+
+// Send the outbox as far as the host and the baud rate allow. Returns
+// false when the host has closed the pty.
+static bool send_outbox(double &link_budget)
+{
+	while (outbox_pos < outbox.size()) {
+		size_t len = outbox.size() - outbox_pos;
+		if (baud > 0) {
+			if (link_budget < 1)
+				break;
+			if (len > link_budget)
+				len = link_budget;
+		}
+		ssize_t rc = write(master_fd, outbox.data() + outbox_pos, len);
+		if (rc < 0 && errno == EAGAIN)
+			break;
+		if (rc < 0)
+			return false;
+		outbox_pos += rc;
+		link_budget -= rc;
+	}
+	// the link can't save up time while there is nothing to send
+	if (outbox_pos == outbox.size()) {
+		outbox.clear();
+		outbox_pos = 0;
+		link_budget = 0;
+	}
+	return true;
+}
+
+// wait until the slave side is opened by the host
+static bool wait_host()
+{
+	while (1) {
+		struct pollfd pfd = { master_fd, POLLIN, 0 };
+		if (poll(&pfd, 1, 10) < 0)
+			return false;
+		if ((pfd.revents & POLLHUP) == 0)
+			break;
+		usleep(10000);
+	}
+	// the bootloader delay after the reset when the host opens the tty
+	usleep(200000);
+	return true;
+}
+
+static bool host_gone()
+{
+	struct pollfd pfd = { master_fd, POLLIN, 0 };
+	return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLHUP) != 0;
+}
+
+// The link speed negotiation, returns false for bytes that are not part of
+// it. A LINK_TEST or LINK_KEEP that doesn't come is a timeout in the
+// firmware, so an unexpected byte ends the negotiation. LINK_ABORT only
+// does that.
+static int link_state;
+static uint8_t link_ubrr;
+
+static bool link_command(uint8_t ch)
+{
+	switch (link_state)
+	{
+	case 0:
+		if (ch != LINK_BAUD)
+			return false;
+		link_state = 1;
+		return true;
+	case 1:
+		link_ubrr = ch;
+		link_state = 2;
+		return true;
+	case 2:
+		link_state = 0;
+		if (uint8_t(~ch) == link_ubrr) {
+			push_byte(LINK_BAUD);
+			link_state = 3;
+		}
+		return true;
+	case 3:
+		link_state = 0;
+		if (ch != LINK_TEST)
+			return ch == LINK_ABORT;
+		for (int i = 0; i < LINK_TEST_BYTES; i++) {
+			bool corrupt = link_max > 0 && LINK_RATE(link_ubrr) > link_max && i % 16 == 15;
+			push_byte(LINK_TEST_BYTE(i) ^ (corrupt ? 0x10 : 0));
+		}
+		link_state = 4;
+		return true;
+	case 4:
+		link_state = 0;
+		if (ch != LINK_KEEP)
+			return ch == LINK_ABORT;
+		if (keep_max <= 0 || LINK_RATE(link_ubrr) <= keep_max)
+			push_byte(LINK_KEEP);
+		return true;
+	}
+	return false;
+}
+
+// Answer queries until the host starts the capture, with PROBE_START or
+// for the universal firmware with the configuration frame: 'C', the length,
+// the UCFG_* bytes and the header, and the sum. The host may close the link
+// and open it again in the meantime.
+static void wait_start()
+{
+	std::vector<uint8_t> frame;
+	while (1) {
+		double link_budget = 1e9;
+		if (host_gone() || !send_outbox(link_budget)) {
+			outbox.clear();
+			outbox_pos = 0;
+			frame.clear();
+			link_state = 0;
+			usleep(10000);
+			continue;
+		}
+
+		uint8_t buffer[64];
+		ssize_t rc = read(master_fd, buffer, sizeof(buffer));
+		for (ssize_t i = 0; i < rc; i++) {
+			if (frame.size() > 0)
+				frame.push_back(buffer[i]);
+			else if (link_command(buffer[i]))
+				continue;
+			else if (universal && buffer[i] == 'C')
+				frame.push_back(buffer[i]);
+			else if (buffer[i] == PROBE_QUERY)
+				push_ident();
+			else if (!universal && buffer[i] == PROBE_START)
+				return;
+		}
+
+		if (frame.size() >= 2 && (frame[1] < UCFG_SIZE || frame[1] > UNIVERSAL_FRAME_MAX))
+			frame.clear();
+		if (frame.size() >= 2 && frame.size() >= frame[1] + 3u) {
+			uint8_t sum = 0;
+			for (int i = 0; i < frame[1]; i++)
+				sum += frame[i+2];
+			if (sum == frame[frame[1]+2])
+				break;
+			fprintf(stderr, "emuprobe: bad configuration frame.\n");
+			frame.clear();
+		}
+		usleep(1000);
+	}
+
+	const uint8_t *cfg = frame.data() + 2;
+	for (int i = 0; i < TOTAL_PIN_NUM; i++) {
+		int bit = i < 6 ? i : i - 4;
+		uint8_t c = i < 6 ? 0 : 1;
+		pins[i] = 0;
+		if ((cfg[UCFG_CAPC + c] >> bit) & 1)
+			pins[i] |= 0x01;
+		if ((cfg[UCFG_PULLUPC + c] >> bit) & 1)
+			pins[i] |= 0x08;
+		if ((cfg[UCFG_POSC + 2*c] >> bit) & 1)
+			pins[i] |= 0x02;
+		if ((cfg[UCFG_NEGC + 2*c] >> bit) & 1)
+			pins[i] |= 0x04;
+	}
+	mode_rle = (cfg[UCFG_FLAGS] & 0x01) != 0;
+	mode_ts = (cfg[UCFG_FLAGS] & 0x02) != 0;
+	config_header.assign((const char*)cfg + UCFG_SIZE, frame[1] - UCFG_SIZE);
+	setup_pins();
+}
+
+// returns false when the host is gone before the end of the capture
+static bool run_capture(FILE *out)
+{
+
+	long long n = 0;
+	uint16_t value = 0;
+	double start = now(), last = start, link_budget = 0;
+	bool stopped = false;
+
+	error_code = 0;
+	ts_ticks = 0;
+	push_header();
+
+	while (!stopped)
+	{
+		// any byte from the host is the stop request
+		uint8_t buffer[64];
+		ssize_t rc = read(master_fd, buffer, sizeof(buffer));
+		if (rc > 0)
+			stopped = true;
+		else if (rc < 0 && errno != EAGAIN)
+			return false;
+
+		double t = now();
+		link_budget += (t - last) * baud / 10;
+		last = t;
+
+		long long target = rate > 0 ? (t - start) * rate : n + 4096;
+		if (rate <= 0 && outbox.size() - outbox_pos > 65536)
+			target = n;
+		while (!stopped && n < target) {
+			if (n == max_samples) {
+				stopped = true;
+				break;
+			}
+			if (n == restart_at) {
+				push_ident();
+				wait_start();
+				push_header();
+			}
+			if (n == corrupt_at)
+				push_byte(0x55);
+
+			uint64_t time;
+			if (input_samples.size() > 0) {
+				value = input_samples[n % input_samples.size()];
+				time = input_times.size() > 0 ? input_times[n % input_times.size()] : 0;
+				uint64_t period = input_times.size() > 0 ? input_times.back() + 1000 : 0;
+				time += period * (n / input_samples.size());
+				ts_ticks = time * 2 / 125;
+			} else {
+				if (change_every <= 1 || random() % change_every == 0)
+					value = random() & 0xfff;
+				ts_ticks += rate > 0 ? TS_TICKS_PER_SEC / rate : random() % 300 + 1;
+			}
+
+			uint16_t sample = 0, w = 0;
+			for (int j = 0; j < num_bits; j++)
+				if ((value & (1 << capture_pin[j])) != 0) {
+					w |= 1 << j;
+					sample |= 1 << capture_pin[j];
+				}
+			push_sample(w, ts_ticks);
+			n++;
+
+			if (out != NULL) {
+				if (mode_ts)
+					fprintf(out, "%04x %llu\n", sample, (unsigned long long)ts_ticks * 125 / 2);
+				else
+					fprintf(out, "%04x\n", sample);
+			}
+		}
+
+		if (!send_outbox(link_budget))
+			return false;
+
+		// the firmware waits for the serial port when its FIFO is full
+		if (rate > 0 && outbox.size() - outbox_pos >= FIFO_SIZE)
+			error_code |= 0x01;
+		if (!stopped)
+			usleep(rate > 0 || outbox.size() > 0 ? 1000 : 0);
+	}
+
+	if (final_error != 0)
+		error_code = final_error;
+	push_trailer();
+
+	while (outbox.size() > 0) {
+		double t = now();
+		link_budget += (t - last) * baud / 10;
+		last = t;
+		if (!send_outbox(link_budget) || host_gone())
+			break;
+		usleep(1000);
+	}
+
+	fprintf(stderr, "emuprobe: sent %lld samples in %.2f seconds%s.\n", n, now() - start,
+			error_code ? " (with error)" : "");
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "p:f:m:r:B:L:A:n:c:i:o:E:S:C:ku")) != -1)
+		switch (opt)
+		{
+		case 'p':
+			parse_pins(optarg);
+			break;
+		case 'f':
+			trigger_freq = atol(optarg);
+			break;
+		case 'm':
+			if (!strcmp(optarg, "rle"))
+				mode_rle = true;
+			else if (!strcmp(optarg, "ts"))
+				mode_ts = true;
+			else
+				usage();
+			break;
+		case 'r':
+			rate = atof(optarg);
+			break;
+		case 'B':
+			baud = atof(optarg);
+			break;
+		case 'L':
+			link_max = atof(optarg);
+			break;
+		case 'A':
+			keep_max = atof(optarg);
+			break;
+		case 'n':
+			max_samples = atoll(optarg);
+			break;
+		case 'c':
+			change_every = atol(optarg);
+			break;
+		case 'i':
+			input_file = optarg;
+			break;
+		case 'o':
+			output_file = optarg;
+			break;
+		case 'E':
+			final_error = strtol(optarg, NULL, 0);
+			break;
+		case 'S':
+			restart_at = atoll(optarg);
+			break;
+		case 'C':
+			corrupt_at = atoll(optarg);
+			break;
+		case 'k':
+			keep_running = true;
+			break;
+		case 'u':
+			universal = true;
+			break;
+		default:
+			usage();
+		}
+
+	if (optind + 1 < argc || (num_bits == 0 && !universal) || (mode_rle && trigger_freq == 0))
+		usage();
+	if (input_file != NULL)
+		read_input();
+
+	int slave_fd;
+	char slave_name[256];
+	if (openpty(&master_fd, &slave_fd, slave_name, NULL, NULL) < 0) {
+		fprintf(stderr, "Can't open pty: %s\n", strerror(errno));
+		return 1;
+	}
+	struct termios tcattr;
+	tcgetattr(slave_fd, &tcattr);
+	cfmakeraw(&tcattr);
+	tcsetattr(slave_fd, TCSANOW, &tcattr);
+	close(slave_fd);
+	fcntl(master_fd, F_SETFL, O_NONBLOCK);
+
+	if (optind < argc) {
+		unlink(argv[optind]);
+		if (symlink(slave_name, argv[optind]) < 0) {
+			fprintf(stderr, "Can't create link `%s': %s\n", argv[optind], strerror(errno));
+			return 1;
+		}
+	}
+	fprintf(stderr, "emuprobe: emulating probe on `%s'.\n", slave_name);
+
+	// the probe is reset when the host opens the tty for the first time,
+	// the bootloader drops what the host sent in the meantime
+	if (!wait_host())
+		return 1;
+	uint8_t buffer[64];
+	while (read(master_fd, buffer, sizeof(buffer)) > 0) { }
+	push_ident();
+
+	while (1) {
+		wait_start();
+		FILE *out = NULL;
+		if (output_file != NULL && (out = fopen(output_file, "w")) == NULL) {
+			fprintf(stderr, "Can't open RAW file `%s' for writing: %s\n", output_file, strerror(errno));
+			return 1;
+		}
+		bool done = run_capture(out);
+		if (out != NULL)
+			fclose(out);
+		if (!done)
+			continue;
+		if (!keep_running) {
+			while (!host_gone())
+				usleep(10000);
+			break;
+		}
+	}
+
+	if (optind < argc)
+		unlink(argv[optind]);
+	return 0;
+}
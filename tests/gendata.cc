@@ -0,0 +1,219 @@
+/*
+ *  Copyright (C) 2011  Clifford Wolf <clifford@clifford.at>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+// Synthetic captures in the text RAW format for benchmarks and tests. The
+// pins match the bench_<type>.al config files:
+//
+//	spi	decode spi posedge msb D2 !D3 D4 D5 (one sample per SCK edge)
+//	i2c	decode i2c D2 D3 (one sample per pin change), with repeated
+//		START and clock stretching by the slave
+//	jtag	decode jtag D2 D3 D4 D5 (one sample per TCK edge), IR and DR scans
+//	free	all pins with a free running trigger, bursts of changes
+//
+// Usage: ./gendata <type> <num_samples> [seed] > capture.raw
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define PIN_D2	6
+#define PIN_D3	7
+#define PIN_D4	8
+#define PIN_D5	9
+
+static long long num_samples, count;
+static char buffer[1 << 16];
+static size_t buffer_len;
+
+static void sample(uint16_t v)
+{
+	static const char hex[] = "0123456789abcdef";
+	if (buffer_len + 5 > sizeof(buffer)) {
+		fwrite(buffer, 1, buffer_len, stdout);
+		buffer_len = 0;
+	}
+	buffer[buffer_len++] = hex[(v >> 12) & 15];
+	buffer[buffer_len++] = hex[(v >> 8) & 15];
+	buffer[buffer_len++] = hex[(v >> 4) & 15];
+	buffer[buffer_len++] = hex[v & 15];
+	buffer[buffer_len++] = '\n';
+	count++;
+}
+
+static bool done()
+{
+	return count >= num_samples;
+}
+
+static void gen_spi()
+{
+	uint16_t idle = 1 << PIN_D3;
+	sample(idle);
+	while (!done()) {
+		sample(0);
+		for (int words = random() % 16 + 1; words > 0; words--) {
+			uint8_t mosi = random(), miso = random();
+			for (int k = 7; k >= 0; k--)
+				sample(((mosi >> k) & 1) << PIN_D4 | ((miso >> k) & 1) << PIN_D5);
+		}
+		sample(idle);
+	}
+}
+
+static int scl = 1, sda = 1;
+
+static void i2c_set(int new_scl, int new_sda)
+{
+	if (new_scl == scl && new_sda == sda)
+		return;
+	scl = new_scl, sda = new_sda;
+	sample(scl << PIN_D2 | sda << PIN_D3);
+}
+
+static void i2c_bit(int b)
+{
+	i2c_set(0, sda);
+	i2c_set(0, b);
+	i2c_set(1, b);
+}
+
+static void i2c_start()
+{
+	// a repeated START when the bus is not idle
+	if (!sda) {
+		i2c_set(0, sda);
+		i2c_set(0, 1);
+		i2c_set(1, 1);
+	}
+	i2c_set(1, 0);
+}
+
+static void i2c_stop()
+{
+	i2c_set(0, sda);
+	i2c_set(0, 0);
+	i2c_set(1, 0);
+	i2c_set(1, 1);
+}
+
+static void i2c_byte(uint8_t v, int ack, bool stretch)
+{
+	for (int k = 7; k >= 0; k--) {
+		// the slave holds SCL low while it prepares the next byte and
+		// sets up SDA before releasing it
+		if (stretch && k == 7) {
+			i2c_set(0, sda);
+			i2c_set(0, !((v >> k) & 1));
+		}
+		i2c_bit((v >> k) & 1);
+	}
+	i2c_bit(!ack);
+}
+
+static void gen_i2c()
+{
+	sample(scl << PIN_D2 | sda << PIN_D3);
+	while (!done()) {
+		uint8_t addr = 0x48 + random() % 8;
+		i2c_start();
+		i2c_byte(addr << 1, 1, false);
+		i2c_byte(random(), 1, false);
+		if (random() % 2) {
+			// register read: write the register address, repeated START
+			// and read with NACK on the last byte
+			i2c_start();
+			i2c_byte(addr << 1 | 1, 1, false);
+			for (int n = random() % 8 + 1; n > 0; n--)
+				i2c_byte(random(), n > 1, true);
+		} else {
+			for (int n = random() % 8; n > 0; n--)
+				i2c_byte(random(), 1, false);
+		}
+		i2c_stop();
+	}
+}
+
+static void jtag_clk(int tms, int tdi = 0, int tdo = 0)
+{
+	sample(tms << PIN_D3 | tdi << PIN_D4 | tdo << PIN_D5);
+}
+
+static void jtag_scan(bool ir, int len)
+{
+	jtag_clk(1);
+	if (ir)
+		jtag_clk(1);
+	jtag_clk(0);
+	jtag_clk(0);
+	for (int k = 0; k < len; k++)
+		jtag_clk(k == len-1, random() & 1, random() & 1);
+	jtag_clk(1);
+	jtag_clk(0);
+}
+
+static void gen_jtag()
+{
+	for (int k = 0; k < 5; k++)
+		jtag_clk(1);
+	jtag_clk(0);
+	while (!done()) {
+		jtag_scan(true, random() % 13 + 4);
+		jtag_scan(false, random() % 4 == 0 ? random() % 300 + 1 : 32);
+		for (int k = random() % 100; k > 0; k--)
+			jtag_clk(0);
+	}
+}
+
+static void gen_free()
+{
+	uint16_t v = 0;
+	while (!done()) {
+		v = random() & 0xfff;
+		for (int run = random() % 4 == 0 ? random() % 1000 : 1; run > 0 && !done(); run--)
+			sample(v);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 3 && argc != 4) {
+		fprintf(stderr, "Usage: %s {spi|i2c|jtag|free} <num_samples> [seed]\n", argv[0]);
+		return 1;
+	}
+
+	num_samples = atoll(argv[2]);
+	srandom(argc > 3 ? atoi(argv[3]) : 1);
+
+	if (!strcmp(argv[1], "spi"))
+		gen_spi();
+	else if (!strcmp(argv[1], "i2c"))
+		gen_i2c();
+	else if (!strcmp(argv[1], "jtag"))
+		gen_jtag();
+	else if (!strcmp(argv[1], "free"))
+		gen_free();
+	else {
+		fprintf(stderr, "Unknown capture type `%s'.\n", argv[1]);
+		return 1;
+	}
+
+	fwrite(buffer, 1, buffer_len, stdout);
+	return 0;
+}
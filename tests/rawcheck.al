@@ -0,0 +1,5 @@
+# configuration for the rawcheck target, the labels end up in the binary
+# RAW file header
+decode i2c D2 D3
+label D2 "SCL"
+label D3 "SDA"
@@ -0,0 +1,290 @@
+/*
+ *  ArduLogic - Low Speed Logic Analyzer using the Arduino Hardware
+ *
+ *  Copyright (C) 2011  Clifford Wolf <clifford@clifford.at>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "ardulogic.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
+
+// The probe sends the sample words LSB first, packed into the lower 7 bits
+// of each payload byte. The kernels collect the payload in a 64 bit shift
+// register and cut whole words from it. The word is then mapped to the pin
+// positions using pdep (the captured pins are always in ascending order)
+// or using a lookup table.
+
+template <int NB>
+static inline void unpack_emit(struct unpacker *u, uint64_t &carry, int &carry_len, uint16_t *&out)
+{
+	while (carry_len >= NB) {
+		uint16_t word = carry & ((1 << NB) - 1);
+#ifdef __BMI2__
+		*(out++) = _pdep_u32(word, u->capture_mask);
+#else
+		*(out++) = u->lut[word];
+#endif
+		carry >>= NB;
+		carry_len -= NB;
+	}
+}
+
+template <int NB>
+static size_t unpack_kernel(struct unpacker *u, const uint8_t *data, size_t len, uint16_t *out)
+{
+	uint64_t carry = u->carry;
+	int carry_len = u->carry_len;
+	uint16_t *p = out;
+	size_t i = 0;
+
+	unpack_emit<NB>(u, carry, carry_len, p);
+
+	for (; i+8 <= len; i += 8) {
+		uint64_t w = 0;
+		for (int k = 0; k < 8; k++)
+			w |= uint64_t(data[i+k]) << (8*k);
+#ifdef __BMI2__
+		w = _pext_u64(w, 0x7f7f7f7f7f7f7f7full);
+#else
+		w = ((w & 0x7f007f007f007f00ull) >> 1) | (w & 0x007f007f007f007full);
+		w = ((w & 0x3fff00003fff0000ull) >> 2) | (w & 0x00003fff00003fffull);
+		w = ((w & 0x0fffffff00000000ull) >> 4) | (w & 0x000000000fffffffull);
+#endif
+		// two halves of 28 bits so the register never overflows
+		carry |= (w & 0x0fffffff) << carry_len;
+		carry_len += 28;
+		unpack_emit<NB>(u, carry, carry_len, p);
+		carry |= (w >> 28) << carry_len;
+		carry_len += 28;
+		unpack_emit<NB>(u, carry, carry_len, p);
+	}
+
+	for (; i < len; i++) {
+		carry |= uint64_t(data[i] & 0x7f) << carry_len;
+		carry_len += 7;
+		unpack_emit<NB>(u, carry, carry_len, p);
+	}
+
+	u->carry = carry;
+	u->carry_len = carry_len;
+	return p - out;
+}
+
+// With run-length encoding (free running trigger with `rle') the stream
+// is a sequence of records, starting with a flag bit: 0 is followed by a
+// sample word, 1 by a 7 bit count c, repeating the last sample c+1 times.
+
+#define RLE_COUNT_BITS	7
+
+static size_t unpack_rle_kernel(struct unpacker *u, const uint8_t *data, size_t len, uint16_t *out)
+{
+	uint64_t carry = u->carry;
+	int carry_len = u->carry_len;
+	int nb = u->num_bits;
+	uint16_t *p = out;
+
+	for (size_t i = 0; true; i++) {
+		while (carry_len > 0) {
+			if ((carry & 1) == 0) {
+				if (carry_len < nb + 1)
+					break;
+				u->last = u->lut[(carry >> 1) & ((1 << nb) - 1)];
+				*(p++) = u->last;
+				carry >>= nb + 1;
+				carry_len -= nb + 1;
+			} else {
+				if (carry_len < RLE_COUNT_BITS + 1)
+					break;
+				for (int n = ((carry >> 1) & ((1 << RLE_COUNT_BITS) - 1)) + 1; n > 0; n--)
+					*(p++) = u->last;
+				carry >>= RLE_COUNT_BITS + 1;
+				carry_len -= RLE_COUNT_BITS + 1;
+			}
+		}
+		if (i >= len)
+			break;
+		carry |= uint64_t(data[i] & 0x7f) << carry_len;
+		carry_len += 7;
+	}
+
+	u->carry = carry;
+	u->carry_len = carry_len;
+	return p - out;
+}
+
+// With timestamps (edge triggers and the timestamp statement) a record is
+// a 1 bit for an overflow of Timer1, or a 0 bit followed by the sample word,
+// a 0 bit and a 7 bit or a 1 bit and a 16 bit number of timer ticks since
+// the last sample. Timer1 runs at 16 MHz, one tick is 62.5 ns. The time of
+// each sample in ns is written to u->tout. The time is not reset by
+// unpack_reset(), so it goes on when the probe restarts.
+
+#define TS_SHORT_BITS	7
+
+static size_t unpack_ts_kernel(struct unpacker *u, const uint8_t *data, size_t len, uint16_t *out)
+{
+	uint64_t carry = u->carry;
+	int carry_len = u->carry_len;
+	int nb = u->num_bits;
+	uint16_t *p = out;
+
+	for (size_t i = 0; true; i++) {
+		while (carry_len > 0) {
+			if ((carry & 1) != 0) {
+				u->ticks += 1 << 16;
+				carry >>= 1;
+				carry_len--;
+				continue;
+			}
+			if (carry_len < nb + 2)
+				break;
+			int delta_bits = (carry >> (nb + 1)) & 1 ? 16 : TS_SHORT_BITS;
+			int rec_len = nb + 2 + delta_bits;
+			if (carry_len < rec_len)
+				break;
+			u->tcnt += (carry >> (nb + 2)) & ((1 << delta_bits) - 1);
+			*(p++) = u->lut[(carry >> 1) & ((1 << nb) - 1)];
+			*(u->tout++) = (u->ticks + u->tcnt) * 125 / 2;
+			carry >>= rec_len;
+			carry_len -= rec_len;
+		}
+		if (i >= len)
+			break;
+		carry |= uint64_t(data[i] & 0x7f) << carry_len;
+		carry_len += 7;
+	}
+
+	u->carry = carry;
+	u->carry_len = carry_len;
+	return p - out;
+}
+
+static size_t (*const unpack_kernels[])(struct unpacker*, const uint8_t*, size_t, uint16_t*) = {
+	NULL,
+	&unpack_kernel<1>, &unpack_kernel<2>, &unpack_kernel<3>, &unpack_kernel<4>,
+	&unpack_kernel<5>, &unpack_kernel<6>, &unpack_kernel<7>, &unpack_kernel<8>,
+	&unpack_kernel<9>, &unpack_kernel<10>, &unpack_kernel<11>, &unpack_kernel<12>
+};
+
+void unpack_init(struct unpacker *u, uint16_t capture_mask)
+{
+	u->capture_mask = capture_mask;
+	u->num_bits = 0;
+	for (int i = 0; i < TOTAL_PIN_NUM; i++)
+		if ((capture_mask & (1 << i)) != 0)
+			u->num_bits++;
+
+	if (u->num_bits == 0) {
+		fprintf(stderr, "No pins configured for capturing.\n");
+		exit(1);
+	}
+
+	for (int word = 0; word < (1 << u->num_bits); word++) {
+		uint16_t sample = 0;
+		for (int i = 0, j = 0; i < TOTAL_PIN_NUM; i++) {
+			if ((capture_mask & (1 << i)) == 0)
+				continue;
+			if ((word & (1 << j++)) != 0)
+				sample |= 1 << i;
+		}
+		u->lut[word] = sample;
+	}
+
+	u->rle = false;
+	u->ticks = 0;
+	u->tcnt = 0;
+	u->tout = NULL;
+	u->kernel = unpack_kernels[u->num_bits];
+	unpack_reset(u);
+}
+
+void unpack_init_rle(struct unpacker *u, uint16_t capture_mask)
+{
+	unpack_init(u, capture_mask);
+	u->rle = true;
+	u->kernel = &unpack_rle_kernel;
+}
+
+void unpack_init_ts(struct unpacker *u, uint16_t capture_mask)
+{
+	unpack_init(u, capture_mask);
+	u->kernel = &unpack_ts_kernel;
+}
+
+void unpack_reset(struct unpacker *u)
+{
+	u->carry = 0;
+	u->carry_len = 0;
+	u->hold_len = 0;
+	u->last = 0;
+}
+
+size_t unpack_maxwords(struct unpacker *u, size_t len)
+{
+	size_t bits = (len + u->hold_len) * 7 + u->carry_len;
+	if (u->rle)
+		return (bits << RLE_COUNT_BITS) / (RLE_COUNT_BITS + 1) + 1;
+	return bits / u->num_bits + 1;
+}
+
+// The last two payload bytes of a stream are the (possibly partial) last
+// data byte and the trailer byte holding the number of unused bits in it.
+// So the most recent two bytes are held back until more data arrives.
+size_t unpack_data(struct unpacker *u, const uint8_t *data, size_t len, uint16_t *out)
+{
+	if (u->hold_len + len <= 2) {
+		for (size_t i = 0; i < len; i++)
+			u->hold[u->hold_len++] = data[i];
+		return 0;
+	}
+
+	size_t n = 0;
+	if (len >= 2) {
+		n += u->kernel(u, u->hold, u->hold_len, out);
+		n += u->kernel(u, data, len-2, out + n);
+		u->hold[0] = data[len-2];
+		u->hold[1] = data[len-1];
+	} else {
+		n += u->kernel(u, u->hold, 1, out);
+		u->hold[0] = u->hold[1];
+		u->hold[1] = data[0];
+	}
+	u->hold_len = 2;
+	return n;
+}
+
+int unpack_finish(struct unpacker *u, uint16_t *out)
+{
+	int unused_bits = u->hold[1] & ~0x80;
+	if (u->hold_len != 2 || unused_bits > 7)
+		return -1;
+
+	uint8_t last = u->hold[0] & ((1 << (7 - unused_bits)) - 1);
+	u->carry |= uint64_t(last) << u->carry_len;
+	u->carry_len += 7 - unused_bits;
+	u->hold_len = 0;
+
+	return u->kernel(u, NULL, 0, out);
+}
+
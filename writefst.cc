@@ -0,0 +1,545 @@
+/*
+ *  ArduLogic - Low Speed Logic Analyzer using the Arduino Hardware
+ *
+ *  Copyright (C) 2011  Clifford Wolf <clifford@clifford.at>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+
+#include "ardulogic.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <zlib.h>
+
+// Native FST output (the block based, compressed format of gtkwave). The
+// file holds the same signals and values as the VCD file. Each block of
+// FST_CHUNK samples is written as one value change section: the values at
+// the start of the section (frame), a zlib compressed list of changes for
+// each signal and the table of timestamps the changes refer to. The
+// geometry (signal widths) and the hierarchy follow the last section, the
+// header at the start of the file is written last.
+
+#define FST_CHUNK (1 << 16)
+
+#define FST_BL_HDR		0
+#define FST_BL_VCDATA		1
+#define FST_BL_GEOM		3
+#define FST_BL_HIER		4
+
+#define FST_ST_VCD_MODULE	0
+#define FST_ST_VCD_SCOPE	254
+#define FST_ST_VCD_UPSCOPE	255
+
+#define FST_VT_VCD_REG		5
+#define FST_VD_IMPLICIT		0
+
+#define FST_HDR_LENGTH		330
+#define FST_HDR_VERSION_SIZE	128
+#define FST_HDR_DATE_SIZE	119
+
+struct fst_context {
+	FILE *f;
+	const char *file;
+	struct decoder_set decoders;
+	int trigger_handle, first_signal_handle;
+	int pin_handle[TOTAL_PIN_NUM];
+	uint16_t capture_mask;
+
+	// per handle: width and position in the value strings
+	std::vector<uint32_t> width, pos;
+	std::string values, emitted, frame;
+	std::vector<int> dirty;
+	std::vector<bool> is_dirty;
+	std::vector<uint8_t> hier, tmp;
+	int num_scopes, num_sections;
+	uint64_t max_mem, now;
+
+	// the current section
+	std::vector<uint64_t> times;
+	std::vector<std::vector<uint8_t> > chains;
+	std::vector<uint32_t> last_change;
+};
+
+static void fst_varint(std::vector<uint8_t> &buf, uint64_t v)
+{
+	while (v >= 0x80) {
+		buf.push_back(v | 0x80);
+		v >>= 7;
+	}
+	buf.push_back(v);
+}
+
+static void fst_u64(std::vector<uint8_t> &buf, uint64_t v)
+{
+	for (int i = 56; i >= 0; i -= 8)
+		buf.push_back(v >> i);
+}
+
+static void fst_set_u64(std::vector<uint8_t> &buf, size_t pos, uint64_t v)
+{
+	for (int i = 0; i < 8; i++)
+		buf[pos + i] = v >> (56 - 8*i);
+}
+
+// zlib compressed data, or the data itself when that isn't smaller
+static void fst_compress(const uint8_t *data, size_t len, std::vector<uint8_t> &out, int level)
+{
+	uLongf clen = compressBound(len);
+	out.resize(clen);
+	if (compress2(out.data(), &clen, data, len, level) != Z_OK || clen >= len) {
+		out.assign(data, data + len);
+		return;
+	}
+	out.resize(clen);
+}
+
+static void fst_write(struct fst_context *ctx, const std::vector<uint8_t> &buf)
+{
+	if (fwrite(buf.data(), 1, buf.size(), ctx->f) != buf.size()) {
+		fprintf(stderr, "Error writing FST file `%s': %s\n", ctx->file, strerror(errno));
+		exit(1);
+	}
+}
+
+static void fst_scope(struct fst_context *ctx, const std::string &name)
+{
+	ctx->hier.push_back(FST_ST_VCD_SCOPE);
+	ctx->hier.push_back(FST_ST_VCD_MODULE);
+	ctx->hier.insert(ctx->hier.end(), name.begin(), name.end());
+	ctx->hier.push_back(0);
+	ctx->hier.push_back(0);
+	ctx->num_scopes++;
+}
+
+static void fst_upscope(struct fst_context *ctx)
+{
+	ctx->hier.push_back(FST_ST_VCD_UPSCOPE);
+}
+
+static int fst_var(struct fst_context *ctx, const std::string &name, int width, char init)
+{
+	std::string full_name = std::string(vcd_prefix) + name;
+	ctx->hier.push_back(FST_VT_VCD_REG);
+	ctx->hier.push_back(FST_VD_IMPLICIT);
+	ctx->hier.insert(ctx->hier.end(), full_name.begin(), full_name.end());
+	ctx->hier.push_back(0);
+	fst_varint(ctx->hier, width);
+	fst_varint(ctx->hier, 0);
+
+	ctx->width.push_back(width);
+	ctx->pos.push_back(ctx->values.size());
+	ctx->values.append(width, init);
+	ctx->is_dirty.push_back(false);
+	return ctx->width.size() - 1;
+}
+
+// Add the changed values to the change lists, the time is the last entry
+// of the time table. Single bit values are stored in the varint holding the
+// time table delta, other values follow it as packed bits (binary values)
+// or as one character per bit.
+static void fst_commit(struct fst_context *ctx)
+{
+	uint32_t ti = ctx->times.size() - 1;
+
+	for (size_t k = 0; k < ctx->dirty.size(); k++)
+	{
+		int h = ctx->dirty[k];
+		const char *value = &ctx->values[ctx->pos[h]];
+		uint32_t width = ctx->width[h];
+		ctx->is_dirty[h] = false;
+
+		if (memcmp(value, &ctx->emitted[ctx->pos[h]], width) == 0)
+			continue;
+		memcpy(&ctx->emitted[ctx->pos[h]], value, width);
+
+		std::vector<uint8_t> &chain = ctx->chains[h];
+		uint64_t delta = ti - ctx->last_change[h];
+		ctx->last_change[h] = ti;
+
+		if (width == 1) {
+			if (*value == '0' || *value == '1')
+				fst_varint(chain, delta << 2 | (*value - '0') << 1);
+			else
+				fst_varint(chain, delta << 4 | (*value == 'z') << 1 | 1);
+			continue;
+		}
+
+		bool binary = true;
+		for (uint32_t i = 0; i < width; i++)
+			if (value[i] != '0' && value[i] != '1')
+				binary = false;
+
+		if (!binary) {
+			fst_varint(chain, delta << 1 | 1);
+			chain.insert(chain.end(), value, value + width);
+			continue;
+		}
+
+		fst_varint(chain, delta << 1);
+		size_t n = chain.size();
+		chain.resize(n + (width + 7) / 8);
+		for (uint32_t i = 0; i < width; i++)
+			if (value[i] == '1')
+				chain[n + i/8] |= 0x80 >> (i % 8);
+	}
+
+	ctx->dirty.clear();
+}
+
+// add the current time to the time table
+static void fst_mark(struct fst_context *ctx)
+{
+	if (ctx->times.back() == ctx->now)
+		return;
+	fst_commit(ctx);
+	ctx->times.push_back(ctx->now);
+}
+
+static void fst_set(struct fst_context *ctx, int h, const char *value)
+{
+	fst_mark(ctx);
+	memcpy(&ctx->values[ctx->pos[h]], value, ctx->width[h]);
+	if (!ctx->is_dirty[h]) {
+		ctx->is_dirty[h] = true;
+		ctx->dirty.push_back(h);
+	}
+}
+
+// A section starts with the last timestamp of the previous section, so the
+// frame holds the values at the first timestamp of the section.
+static void fst_begin_section(struct fst_context *ctx)
+{
+	uint64_t t = ctx->times.empty() ? 0 : ctx->times.back();
+	ctx->times.clear();
+	ctx->times.push_back(t);
+	ctx->frame = ctx->emitted;
+	ctx->chains.assign(ctx->width.size(), std::vector<uint8_t>());
+	ctx->last_change.assign(ctx->width.size(), 0);
+}
+
+static void fst_write_section(struct fst_context *ctx)
+{
+	fst_commit(ctx);
+
+	std::vector<uint8_t> buf, packed;
+	size_t maxhandle = ctx->width.size();
+
+	buf.push_back(FST_BL_VCDATA);
+	fst_u64(buf, 0);
+	fst_u64(buf, ctx->times.front());
+	fst_u64(buf, ctx->times.back());
+	fst_u64(buf, 0);
+
+	fst_compress((const uint8_t*)ctx->frame.data(), ctx->frame.size(), packed, 4);
+	fst_varint(buf, ctx->frame.size());
+	fst_varint(buf, packed.size());
+	fst_varint(buf, maxhandle);
+	buf.insert(buf.end(), packed.begin(), packed.end());
+
+	// the change lists follow the pack type, the chain table holds their
+	// offsets from the pack type (odd entries) and runs of signals without
+	// changes (even entries)
+	fst_varint(buf, maxhandle);
+	size_t vc_start = buf.size();
+	buf.push_back('Z');
+
+	std::vector<uint8_t> table;
+	uint64_t mem = 0, prev_offset = 0, run = 0;
+	for (size_t h = 0; h < maxhandle; h++)
+	{
+		const std::vector<uint8_t> &chain = ctx->chains[h];
+		if (chain.empty()) {
+			run++;
+			continue;
+		}
+		if (run > 0)
+			fst_varint(table, run << 1);
+		run = 0;
+
+		uint64_t offset = buf.size() - vc_start;
+		fst_varint(table, (offset - prev_offset) << 1 | 1);
+		prev_offset = offset;
+
+		fst_compress(chain.data(), chain.size(), packed, 4);
+		fst_varint(buf, packed.size() < chain.size() ? chain.size() : 0);
+		buf.insert(buf.end(), packed.begin(), packed.end());
+		mem += chain.size();
+	}
+	if (run > 0)
+		fst_varint(table, run << 1);
+
+	buf.insert(buf.end(), table.begin(), table.end());
+	fst_u64(buf, table.size());
+
+	std::vector<uint8_t> times;
+	for (size_t i = 0; i < ctx->times.size(); i++)
+		fst_varint(times, ctx->times[i] - (i > 0 ? ctx->times[i-1] : 0));
+	fst_compress(times.data(), times.size(), packed, 9);
+	buf.insert(buf.end(), packed.begin(), packed.end());
+	fst_u64(buf, times.size());
+	fst_u64(buf, packed.size());
+	fst_u64(buf, ctx->times.size());
+
+	fst_set_u64(buf, 1, buf.size() - 1);
+	fst_set_u64(buf, 25, mem);
+	fst_write(ctx, buf);
+
+	if (mem > ctx->max_mem)
+		ctx->max_mem = mem;
+	ctx->num_sections++;
+	fst_begin_section(ctx);
+}
+
+static void fst_write_geometry(struct fst_context *ctx)
+{
+	std::vector<uint8_t> geom, packed, buf;
+	for (size_t h = 0; h < ctx->width.size(); h++)
+		fst_varint(geom, ctx->width[h]);
+	fst_compress(geom.data(), geom.size(), packed, 9);
+
+	buf.push_back(FST_BL_GEOM);
+	fst_u64(buf, packed.size() + 24);
+	fst_u64(buf, geom.size());
+	fst_u64(buf, ctx->width.size());
+	buf.insert(buf.end(), packed.begin(), packed.end());
+	fst_write(ctx, buf);
+}
+
+// the hierarchy is stored gzip compressed
+static void fst_write_hierarchy(struct fst_context *ctx)
+{
+	std::vector<uint8_t> buf;
+	buf.push_back(FST_BL_HIER);
+	fst_u64(buf, 0);
+	fst_u64(buf, ctx->hier.size());
+
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, 4, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		fprintf(stderr, "Can't initialize zlib for FST hierarchy.\n");
+		exit(1);
+	}
+	size_t n = buf.size();
+	buf.resize(n + deflateBound(&zs, ctx->hier.size()));
+	zs.next_in = ctx->hier.data();
+	zs.avail_in = ctx->hier.size();
+	zs.next_out = &buf[n];
+	zs.avail_out = buf.size() - n;
+	if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+		fprintf(stderr, "Can't compress FST hierarchy.\n");
+		exit(1);
+	}
+	buf.resize(n + zs.total_out);
+	deflateEnd(&zs);
+
+	fst_set_u64(buf, 1, buf.size() - 1);
+	fst_write(ctx, buf);
+}
+
+static void fst_write_header(struct fst_context *ctx, uint64_t end_time)
+{
+	std::vector<uint8_t> buf;
+	buf.push_back(FST_BL_HDR);
+	fst_u64(buf, FST_HDR_LENGTH - 1);
+	fst_u64(buf, 0);
+	fst_u64(buf, end_time);
+
+	// the reader detects the byte order of doubles using this value
+	double endian_test = 2.7182818284590452354;
+	uint8_t *p = (uint8_t*)&endian_test;
+	buf.insert(buf.end(), p, p + sizeof(endian_test));
+
+	fst_u64(buf, ctx->max_mem);
+	fst_u64(buf, ctx->num_scopes);
+	fst_u64(buf, ctx->width.size());
+	fst_u64(buf, ctx->width.size());
+	fst_u64(buf, ctx->num_sections);
+	buf.push_back(uint8_t(-9));
+
+	char version[FST_HDR_VERSION_SIZE] = "ArduLogic";
+	buf.insert(buf.end(), version, version + sizeof(version));
+
+	char date[FST_HDR_DATE_SIZE] = { /* zeros */ };
+	time_t now = time(NULL);
+	strftime(date, sizeof(date), "%a %b %d %H:%M:%S %Y", localtime(&now));
+	buf.insert(buf.end(), date, date + sizeof(date));
+
+	buf.push_back(0);
+	fst_u64(buf, 0);
+
+	if (fseek(ctx->f, 0, SEEK_SET) != 0) {
+		fprintf(stderr, "Can't seek in FST file `%s': %s\n", ctx->file, strerror(errno));
+		exit(1);
+	}
+	fst_write(ctx, buf);
+}
+
+static void fst_event(struct fst_context *ctx, const struct decode_batch &batch, const struct decode_event &ev)
+{
+	const struct decode_signal &sig = ctx->decoders.signals[ev.sig];
+	char *p = (char*)ctx->tmp.data();
+
+	if (ev.width > 0) {
+		// shorter values are zero extended, wider ones cut to the low bits
+		int width = ev.width < sig.width ? ev.width : sig.width;
+		memset(p, '0', sig.width - width);
+		memcpy(p + sig.width - width, &batch.bits[ev.value + ev.width - width], width);
+	} else if (ev.kind == EV_IDLE) {
+		memset(p, 'z', sig.width);
+	} else if (sig.names != NULL) {
+		const char *name = sig.names[ev.value];
+		for (int i = 0; i < sig.width / 8; i++) {
+			memcpy(p + 8*i, vcd_bits_table[uint8_t(*name)], 8);
+			if (*name)
+				name++;
+		}
+	} else {
+		for (int i = 0; i < sig.width; i++) {
+			int bit = sig.width - 1 - i;
+			p[i] = bit < 64 && ((ev.value >> bit) & 1) ? '1' : '0';
+		}
+	}
+
+	fst_set(ctx, ctx->first_signal_handle + ev.sig, p);
+}
+
+void writefst(const char *file)
+{
+	struct fst_context ctx;
+	ctx.file = file;
+	ctx.f = fopen(file, "w");
+
+	if (ctx.f == NULL) {
+		fprintf(stderr, "Can't open FST file `%s': %s\n", file, strerror(errno));
+		exit(1);
+	}
+
+	printf("Writing FST output file `%s'.\n", file);
+
+	// the bits table is set up by vcd_open()
+	struct vcd_writer w;
+	vcd_open(&w, NULL);
+
+	// placeholder for the header
+	std::vector<uint8_t> header(FST_HDR_LENGTH);
+	fst_write(&ctx, header);
+
+	struct decode_batch init_batch;
+	decoders_init(&ctx.decoders, init_batch);
+
+	ctx.num_scopes = 0;
+	ctx.num_sections = 0;
+	ctx.max_mem = 0;
+	ctx.trigger_handle = -1;
+	if (!vcd_no_trigger)
+		ctx.trigger_handle = fst_var(&ctx, "trigger", 1, samples.size() > 0 ? '0' : 'x');
+
+	uint16_t first = samples.size() > 0 ? samples[0] : 0;
+	ctx.capture_mask = 0;
+	for (int i = 0; i < TOTAL_PIN_NUM; i++)
+		if ((pins[i] & PIN_CAPTURE) != 0) {
+			char init = samples.size() > 0 ? '0' + ((first >> i) & 1) : 'x';
+			ctx.pin_handle[i] = fst_var(&ctx, pin_names[i], 1, init);
+			ctx.capture_mask |= 1 << i;
+		}
+
+	// with more than one decoder the signals of each decoder are in their
+	// own scope, like in the VCD file
+	int max_width = 1;
+	ctx.first_signal_handle = ctx.width.size();
+	for (size_t k = 0; k < ctx.decoders.decoders.size(); k++) {
+		const struct decoder_instance &d = ctx.decoders.decoders[k];
+		if (ctx.decoders.decoders.size() > 1)
+			fst_scope(&ctx, d.label);
+		for (size_t j = d.first_signal; j < d.first_signal + d.num_signals; j++) {
+			const struct decode_signal &sig = ctx.decoders.signals[j];
+			fst_var(&ctx, sig.name, sig.width, 'x');
+			if (sig.width > max_width)
+				max_width = sig.width;
+		}
+		if (ctx.decoders.decoders.size() > 1)
+			fst_upscope(&ctx);
+	}
+	ctx.tmp.resize(max_width);
+
+	ctx.times.assign(1, 0);
+	ctx.now = 0;
+	for (size_t k = 0; k < init_batch.events.size(); k++)
+		fst_event(&ctx, init_batch, init_batch.events[k]);
+	for (size_t k = 0; k < ctx.is_dirty.size(); k++)
+		ctx.is_dirty[k] = false;
+	ctx.dirty.clear();
+	ctx.emitted = ctx.values;
+	fst_begin_section(&ctx);
+
+	sample_cursor cursor(samples, 0);
+	uint16_t prev = cursor.value;
+	size_t begin = 1;
+
+	do {
+		size_t end = begin + FST_CHUNK < samples.size() ? begin + FST_CHUNK : samples.size();
+		struct decode_batch batch;
+		if (begin < end)
+			decoders_decode(&ctx.decoders, begin, end, batch);
+
+		const decode_event *ev = batch.events.data();
+		const decode_event *ev_end = ev + batch.events.size();
+
+		for (size_t i = begin; i < end && cursor.next(); i++) {
+			uint16_t sample = cursor.value;
+			ctx.now = vcd_time(i, 0);
+
+			for (uint16_t changed = (prev ^ sample) & ctx.capture_mask; changed != 0; changed &= changed - 1) {
+				int j = __builtin_ctz(changed);
+				fst_set(&ctx, ctx.pin_handle[j], ((sample >> j) & 1) ? "1" : "0");
+			}
+			for (; ev != ev_end && ev->idx == i; ev++)
+				fst_event(&ctx, batch, *ev);
+
+			if (!vcd_no_trigger) {
+				if (trigger_freq == 0)
+					ctx.now = vcd_time(i, 1);
+				fst_set(&ctx, ctx.trigger_handle, "1");
+				ctx.now = vcd_time(i, trigger_freq > 0 ? 1 : 2);
+				fst_set(&ctx, ctx.trigger_handle, "0");
+			}
+			prev = sample;
+		}
+
+		if (end >= samples.size()) {
+			ctx.now = vcd_time(samples.size(), 0);
+			fst_mark(&ctx);
+		}
+		fst_write_section(&ctx);
+		begin = end;
+	} while (begin < samples.size());
+
+	decoders_done(&ctx.decoders);
+
+	fst_write_geometry(&ctx);
+	fst_write_hierarchy(&ctx);
+	fst_write_header(&ctx, ctx.times.back());
+
+	if (fclose(ctx.f) != 0) {
+		fprintf(stderr, "Error writing FST file `%s': %s\n", file, strerror(errno));
+		exit(1);
+	}
+}
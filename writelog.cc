@@ -0,0 +1,168 @@
+/*
+ *  ArduLogic - Low Speed Logic Analyzer using the Arduino Hardware
+ *
+ *  Copyright (C) 2011  Clifford Wolf <clifford@clifford.at>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+
+#include "ardulogic.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define LOG_CHUNK (1 << 16)
+
+// The decoded transactions are streamed to the log file while the capture
+// is decoded, one line per transaction, as CSV (with a header line) or as
+// JSON Lines (empty fields are left out).
+
+static const char *const log_fields[] = {
+	"index", "time", "protocol", "addr", "tx", "rx", "ack", "state"
+};
+
+static void log_string(struct vcd_writer *w, const std::string &str, bool json)
+{
+	bool quote = json || str.find_first_of(",\"") != std::string::npos;
+	if (quote)
+		vcd_char(w, '"');
+	for (size_t i = 0; i < str.size(); i++) {
+		if (json && uint8_t(str[i]) < 0x20) {
+			vcd_printf(w, "\\u%04x", uint8_t(str[i]));
+			continue;
+		}
+		if (str[i] == '"')
+			vcd_char(w, json ? '\\' : '"');
+		else if (json && str[i] == '\\')
+			vcd_char(w, '\\');
+		vcd_char(w, str[i]);
+	}
+	if (quote)
+		vcd_char(w, '"');
+}
+
+static void log_line(struct vcd_writer *w, const std::string &protocol, const struct log_record &rec, bool json)
+{
+	const std::string *values[] = { &protocol, &rec.addr, &rec.tx, &rec.rx, &rec.ack, &rec.state };
+
+	if (json) {
+		vcd_printf(w, "{\"%s\":", log_fields[0]);
+		vcd_num(w, rec.idx);
+		vcd_printf(w, ",\"%s\":", log_fields[1]);
+		vcd_num(w, vcd_time(rec.idx, 0));
+		for (int k = 0; k < 6; k++) {
+			if (values[k]->empty())
+				continue;
+			vcd_printf(w, ",\"%s\":", log_fields[k+2]);
+			log_string(w, *values[k], true);
+		}
+		vcd_str(w, "}\n");
+		return;
+	}
+
+	vcd_num(w, rec.idx);
+	vcd_char(w, ',');
+	vcd_num(w, vcd_time(rec.idx, 0));
+	for (int k = 0; k < 6; k++) {
+		vcd_char(w, ',');
+		log_string(w, *values[k], false);
+	}
+	vcd_char(w, '\n');
+}
+
+static void log_batch(struct vcd_writer *w, struct decoder_set *ds, const std::vector<int> &sig_decoder,
+		std::vector<log_record> &recs, const struct decode_batch &batch, bool json, size_t &count)
+{
+	std::vector<log_record> done;
+
+	for (size_t i = 0; i < batch.events.size(); i++) {
+		struct decode_event ev = batch.events[i];
+		int k = sig_decoder[ev.sig];
+		struct decoder_instance &d = ds->decoders[k];
+		if (d.desc->log == NULL)
+			continue;
+		ev.sig -= d.first_signal;
+		d.desc->log(d.state.data(), batch, ev, recs[k], done);
+		for (size_t j = 0; j < done.size(); j++)
+			log_line(w, d.label, done[j], json);
+		count += done.size();
+		done.clear();
+	}
+}
+
+void writelog(const char *file, bool json)
+{
+	if (num_decoders == 0) {
+		fprintf(stderr, "Log output requires a `decode' configuration.\n");
+		exit(1);
+	}
+
+	FILE *f = fopen(file, "w");
+	if (f == NULL) {
+		fprintf(stderr, "Can't open log file `%s': %s\n", file, strerror(errno));
+		exit(1);
+	}
+
+	printf("Writing %s log file `%s'.\n", json ? "JSON" : "CSV", file);
+
+	struct vcd_writer w;
+	vcd_open(&w, f);
+	if (!json) {
+		for (int k = 0; k < 8; k++)
+			vcd_printf(&w, "%s%s", k ? "," : "", log_fields[k]);
+		vcd_char(&w, '\n');
+	}
+
+	struct decoder_set ds;
+	struct decode_batch batch;
+	decoders_init(&ds, batch);
+
+	std::vector<int> sig_decoder(ds.signals.size());
+	for (size_t k = 0; k < ds.decoders.size(); k++)
+		for (size_t i = 0; i < ds.decoders[k].num_signals; i++)
+			sig_decoder[ds.decoders[k].first_signal + i] = k;
+
+	std::vector<log_record> recs(ds.decoders.size());
+	size_t count = 0;
+	log_batch(&w, &ds, sig_decoder, recs, batch, json, count);
+
+	for (size_t begin = 1; begin < samples.size(); begin += LOG_CHUNK)
+	{
+		size_t end = begin + LOG_CHUNK < samples.size() ? begin + LOG_CHUNK : samples.size();
+		batch = decode_batch();
+		decoders_decode(&ds, begin, end, batch);
+		log_batch(&w, &ds, sig_decoder, recs, batch, json, count);
+	}
+
+	// transactions still running at the end of the capture
+	for (size_t k = 0; k < recs.size(); k++)
+		if (recs[k].open) {
+			log_line(&w, ds.decoders[k].label, recs[k], json);
+			count++;
+		}
+
+	decoders_done(&ds);
+	vcd_flush(&w);
+
+	if (fclose(f) != 0) {
+		fprintf(stderr, "Error writing log file `%s': %s\n", file, strerror(errno));
+		exit(1);
+	}
+	printf("Wrote %zd transactions.\n", count);
+}
@@ -23,77 +23,462 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/time.h>
 
-void writevcd(const char *file)
+#include <atomic>
+
+char vcd_bits_table[256][8];
+
+void vcd_open(struct vcd_writer *w, FILE *f)
 {
-	FILE *f = fopen(file, "w");
+	if (vcd_bits_table[0][0] == 0)
+		for (int i = 0; i < 256; i++)
+			for (int j = 0; j < 8; j++)
+				vcd_bits_table[i][j] = '0' + ((i >> (7-j)) & 1);
 
-	if (f == NULL) {
-		fprintf(stderr, "Can't open VCD file `%s': %s\n", file, strerror(errno));
+	w->f = f;
+	w->buf.resize(VCD_BUFSIZE);
+	w->len = 0;
+}
+
+void vcd_grow(struct vcd_writer *w, size_t n)
+{
+	if (w->f != NULL) {
+		vcd_flush(w);
+		if (n <= w->buf.size())
+			return;
+	}
+	w->buf.resize(w->buf.size() * 2 > w->len + n ? w->buf.size() * 2 : w->len + n);
+}
+
+void vcd_flush(struct vcd_writer *w)
+{
+	if (w->f == NULL || w->len == 0)
+		return;
+	if (fwrite(&w->buf[0], 1, w->len, w->f) != w->len) {
+		fprintf(stderr, "Error writing VCD file: %s\n", strerror(errno));
 		exit(1);
 	}
+	w->len = 0;
+}
 
-	printf("Writing VCD output file `%s'.\n", file);
+void vcd_printf(struct vcd_writer *w, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
 
-	struct decoder_desc *decoder = NULL;
-	if (decode == DECODE_SPI)
-		decoder = &decoder_spi;
-	if (decode == DECODE_I2C)
-		decoder = &decoder_i2c;
-	if (decode == DECODE_JTAG)
-		decoder = &decoder_jtag;
+	char *p = vcd_space(w, n+1);
+	va_start(ap, fmt);
+	vsnprintf(p, n+1, fmt, ap);
+	va_end(ap);
+	w->len += n;
+}
 
-	fprintf(f, "$comment Created by ArduLogic $end\n");
-	fprintf(f, "$var reg 1 %sc %strigger $end\n", vcd_prefix, vcd_prefix);
-	for (int i = 0; i < TOTAL_PIN_NUM; i++)
-		if ((pins[i] & PIN_CAPTURE) != 0)
-			fprintf(f, "$var reg 1 %sp%d %s%s $end\n", vcd_prefix, i, vcd_prefix, pin_names[i]);
-	if (decoder)
-		decoder->vcd_defs(f);
-	fprintf(f, "$enddefinitions\n");
-
-	if (samples.size() == 0) {
-		fprintf(f, "#0 $dumpall");
-		for (int i = 0; i < TOTAL_PIN_NUM; i++)
-			if ((pins[i] & PIN_CAPTURE) != 0)
-				fprintf(f, " xp%d", i);
-		if (decoder)
-			decoder->vcd_init(f);
-		fprintf(f, " $end\n");
-		fclose(f);
+// prefixed VCD identifier
+std::string vcd_ident(const char *fmt, ...)
+{
+	char buffer[64];
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(buffer, sizeof(buffer), fmt, ap);
+	va_end(ap);
+	return std::string(vcd_prefix) + buffer;
+}
+
+// timestamp in ns of the given third of the sample period, rounded. With
+// timestamps the time is relative to the first sample and goes on in
+// steps of 1us after the last sample.
+uint64_t vcd_time(size_t i, int third)
+{
+	if (samples.timed && samples.size() > 0) {
+		size_t last = samples.size() - 1;
+		uint64_t t = samples.time(i < last ? i : last) + (i < last ? 0 : 1000 * (i - last));
+		uint64_t next = i < last ? samples.time(i+1) : t + 1000;
+		return t - samples.time(0) + third * (next - t) / 3;
+	}
+
+	uint64_t num = trigger_freq > 0 ? 1000000000 : 1000;
+	uint64_t den = trigger_freq > 0 ? trigger_freq : 1;
+	return ((3*i + third) * num * 2 + 3*den) / (6*den);
+}
+
+static void vcd_timestamp(struct vcd_writer *w, uint64_t t)
+{
+	vcd_char(w, '#');
+	vcd_num(w, t);
+}
+
+// The samples are decoded and rendered in chunks of VCD_CHUNK samples by
+// vcd_threads worker threads. The decoder states at the start of each chunk
+// are taken from a sequential pre-pass that only skips over the samples
+// (decoders_skip()), the workers then decode their chunk from that snapshot
+// and render the events together with the pin changes. With a single
+// thread the decoders simply run over the chunks in order. The rendered
+// chunks are written to the file in order, VCD_BATCH chunks per thread at
+// a time.
+
+#define VCD_CHUNK (1 << 15)
+#define VCD_BATCH 2
+
+struct vcd_context {
+	FILE *f;
+	const char *file;
+	bool live, started;
+	size_t done;
+	struct timeval last_update;
+	struct vcd_writer w;
+	struct decoder_set decoders;
+	std::vector<std::string> signal_id;
+	std::string trigger_id;
+	std::string pin_id[TOTAL_PIN_NUM];
+	uint16_t capture_mask;
+};
+
+struct vcd_chunk {
+	size_t begin, end;
+	struct decoder_set ds;
+	struct decode_batch batch;
+	struct vcd_writer w;
+};
+
+static void vcd_event(struct vcd_writer *w, const struct vcd_context *ctx, const struct decode_batch &batch, const struct decode_event &ev)
+{
+	const struct decode_signal &sig = ctx->decoders.signals[ev.sig];
+
+	if (ev.width > 0) {
+		// only the low bits of values wider than the signal are shown
+		int width = ev.width < sig.width ? ev.width : sig.width;
+		char *p = vcd_space(w, width + 2);
+		p[0] = ' ', p[1] = 'b';
+		memcpy(p + 2, &batch.bits[ev.value + ev.width - width], width);
+		w->len += width + 2;
+	} else if (ev.kind == EV_IDLE) {
+		char *p = vcd_space(w, sig.width + 2);
+		p[0] = ' ', p[1] = 'b';
+		memset(p + 2, 'z', sig.width);
+		w->len += sig.width + 2;
+	} else if (sig.names != NULL) {
+		const char *name = sig.names[ev.value];
+		vcd_str(w, " b");
+		for (int i = 0; i < sig.width / 8; i++) {
+			memcpy(vcd_space(w, 8), vcd_bits_table[uint8_t(*name)], 8);
+			w->len += 8;
+			if (*name)
+				name++;
+		}
+	} else
+		vcd_bits(w, ev.value, sig.width);
+
+	vcd_char(w, ' ');
+	vcd_str(w, ctx->signal_id[ev.sig]);
+}
+
+static void vcd_render(const struct vcd_context *ctx, struct vcd_chunk *chunk)
+{
+	struct vcd_writer *w = &chunk->w;
+	const decode_event *ev = chunk->batch.events.data();
+	const decode_event *ev_end = ev + chunk->batch.events.size();
+
+	sample_cursor cursor(samples, chunk->begin - 1);
+	uint16_t prev = cursor.value;
+
+	for (size_t i = chunk->begin; i < chunk->end && cursor.next(); i++) {
+		uint16_t sample = cursor.value;
+
+		// reserve space so the timestamp can be taken back if nothing changed
+		size_t mark = vcd_space(w, 32) - &w->buf[0];
+		vcd_timestamp(w, vcd_time(i, 0));
+		size_t mark_changes = w->len;
+
+		for (uint16_t changed = (prev ^ sample) & ctx->capture_mask; changed != 0; changed &= changed - 1) {
+			int j = __builtin_ctz(changed);
+			vcd_char(w, ' ');
+			vcd_char(w, '0' + ((sample >> j) & 1));
+			vcd_str(w, ctx->pin_id[j]);
+		}
+		for (; ev != ev_end && ev->idx == i; ev++)
+			vcd_event(w, ctx, chunk->batch, *ev);
+
+		if (vcd_no_trigger) {
+			if (w->len == mark_changes)
+				w->len = mark;
+			else
+				vcd_char(w, '\n');
+		} else {
+			if (trigger_freq == 0) {
+				vcd_char(w, ' ');
+				vcd_timestamp(w, vcd_time(i, 1));
+			}
+			vcd_str(w, " 1");
+			vcd_str(w, ctx->trigger_id);
+			vcd_char(w, ' ');
+			vcd_timestamp(w, vcd_time(i, trigger_freq > 0 ? 1 : 2));
+			vcd_str(w, " 0");
+			vcd_str(w, ctx->trigger_id);
+			vcd_char(w, '\n');
+		}
+		prev = sample;
+	}
+}
+
+struct vcd_worker_args {
+	const struct vcd_context *ctx;
+	std::vector<vcd_chunk> *chunks;
+	size_t last;
+	std::atomic<size_t> *next;
+};
+
+static void *vcd_worker(void *p)
+{
+	struct vcd_worker_args *args = (struct vcd_worker_args*)p;
+	size_t k;
+	while ((k = args->next->fetch_add(1)) < args->last) {
+		struct vcd_chunk *chunk = &(*args->chunks)[k];
+		decoders_decode(&chunk->ds, chunk->begin, chunk->end, chunk->batch);
+		decoders_done(&chunk->ds);
+		vcd_render(args->ctx, chunk);
+	}
+	return NULL;
+}
+
+static void vcd_write_error(struct vcd_context *ctx)
+{
+	// in live mode the capture goes on when the viewer has gone away
+	if (ctx->live && errno == EPIPE) {
+		fprintf(stderr, "\nLive VCD reader closed `%s', continuing without live output.\n", ctx->file);
+		fclose(ctx->f);
+		ctx->f = NULL;
 		return;
 	}
+	fprintf(stderr, "Error writing VCD file `%s': %s\n", ctx->file, strerror(errno));
+	exit(1);
+}
+
+static void vcd_output(struct vcd_context *ctx, const char *data, size_t len)
+{
+	if (ctx->f != NULL && len > 0 && fwrite(data, 1, len, ctx->f) != len)
+		vcd_write_error(ctx);
+}
 
-	fprintf(f, "#0 $dumpall 0%sc", vcd_prefix);
+static void vcd_output_buffer(struct vcd_context *ctx, struct vcd_writer *w)
+{
+	vcd_output(ctx, &w->buf[0], w->len);
+	w->len = 0;
+}
+
+// Set up the decoders and write the header and the values of the first
+// sample (or `x' for all pins when there are no samples).
+static void vcd_header(struct vcd_context *ctx)
+{
+	// with more than one decoder the signals of each decoder are in their
+	// own scope and the identifiers are prefixed with the decoder label
+	struct decode_batch init_batch;
+	decoders_init(&ctx->decoders, init_batch, ctx->live);
+	for (size_t k = 0; k < ctx->decoders.decoders.size(); k++) {
+		const struct decoder_instance &d = ctx->decoders.decoders[k];
+		for (size_t j = d.first_signal; j < d.first_signal + d.num_signals; j++) {
+			const std::string &id = ctx->decoders.signals[j].id;
+			if (ctx->decoders.decoders.size() > 1)
+				ctx->signal_id.push_back(vcd_ident("%s_%s", d.label.c_str(), id.c_str()));
+			else
+				ctx->signal_id.push_back(vcd_ident("%s", id.c_str()));
+		}
+	}
+
+	struct vcd_writer *w = &ctx->w;
+	vcd_open(w, NULL);
+
+	ctx->trigger_id = vcd_ident("c");
+	ctx->capture_mask = 0;
+	for (int i = 0; i < TOTAL_PIN_NUM; i++)
+		if ((pins[i] & PIN_CAPTURE) != 0) {
+			ctx->pin_id[i] = vcd_ident("p%d", i);
+			ctx->capture_mask |= 1 << i;
+		}
+
+	vcd_printf(w, "$comment Created by ArduLogic $end\n");
+	vcd_printf(w, "$timescale 1ns $end\n");
+	if (!vcd_no_trigger)
+		vcd_printf(w, "$var reg 1 %s %strigger $end\n", ctx->trigger_id.c_str(), vcd_prefix);
 	for (int i = 0; i < TOTAL_PIN_NUM; i++)
 		if ((pins[i] & PIN_CAPTURE) != 0)
-			fprintf(f, " %d%sp%d", (samples[0] & (1 << i)) != 0, vcd_prefix, i);
-	if (decoder)
-		decoder->vcd_init(f);
-	fprintf(f, " $end\n");
-
-	double ns_step = trigger_freq > 0 ? 1e9 / double(trigger_freq) : 1000;
-	for (size_t i = 1; i < samples.size(); i++) {
-		double ns = i * ns_step;
-		fprintf(f, "#%.0f", ns);
-		for (int j = 0; j < TOTAL_PIN_NUM; j++) {
-			if ((pins[j] & PIN_CAPTURE) == 0)
-				continue;
-			if (((samples[i-1] ^ samples[i]) & (1 << j)) == 0)
-				continue;
-			fprintf(f, " %d%sp%d", (samples[i] & (1 << j)) != 0, vcd_prefix, j);
+			vcd_printf(w, "$var reg 1 %s %s%s $end\n", ctx->pin_id[i].c_str(), vcd_prefix, pin_names[i]);
+	for (size_t k = 0; k < ctx->decoders.decoders.size(); k++) {
+		const struct decoder_instance &d = ctx->decoders.decoders[k];
+		if (ctx->decoders.decoders.size() > 1)
+			vcd_printf(w, "$scope module %s $end\n", d.label.c_str());
+		for (size_t j = d.first_signal; j < d.first_signal + d.num_signals; j++)
+			vcd_printf(w, "$var reg %d %s %s%s $end\n", ctx->decoders.signals[j].width,
+					ctx->signal_id[j].c_str(), vcd_prefix, ctx->decoders.signals[j].name.c_str());
+		if (ctx->decoders.decoders.size() > 1)
+			vcd_printf(w, "$upscope $end\n");
+	}
+	vcd_printf(w, "$enddefinitions\n");
+
+	vcd_printf(w, "#0 $dumpall");
+	if (samples.size() > 0 && !vcd_no_trigger) {
+		vcd_str(w, " 0");
+		vcd_str(w, ctx->trigger_id);
+	}
+	uint16_t first = samples.size() > 0 ? samples[0] : 0;
+	for (int i = 0; i < TOTAL_PIN_NUM; i++)
+		if ((pins[i] & PIN_CAPTURE) != 0) {
+			vcd_char(w, ' ');
+			vcd_char(w, samples.size() > 0 ? '0' + ((first >> i) & 1) : 'x');
+			vcd_str(w, ctx->pin_id[i]);
 		}
-		if (decoder)
-			decoder->vcd_step(f, i);
-		if (trigger_freq > 0)
-			fprintf(f, " 1%sc #%.0f 0%sc\n", vcd_prefix, ns + ns_step/3, vcd_prefix);
-		else
-			fprintf(f, " #%.0f 1%sc #%.0f 0%sc\n", ns + ns_step/3, vcd_prefix, ns + 2*ns_step/3, vcd_prefix);
+	for (size_t k = 0; k < init_batch.events.size(); k++)
+		vcd_event(w, ctx, init_batch, init_batch.events[k]);
+	vcd_printf(w, " $end\n");
+	vcd_output_buffer(ctx, w);
+
+	ctx->started = true;
+	ctx->done = samples.size() > 0 ? 1 : 0;
+}
+
+// decode and write the samples up to end
+static void vcd_advance(struct vcd_context *ctx, size_t end)
+{
+	int num_threads = vcd_threads > 0 ? vcd_threads : sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_threads < 1)
+		num_threads = 1;
+
+	std::vector<vcd_chunk> chunks;
+	for (size_t i = ctx->done; i < end; i += VCD_CHUNK) {
+		chunks.push_back(vcd_chunk());
+		chunks.back().begin = i;
+		chunks.back().end = i + VCD_CHUNK < end ? i + VCD_CHUNK : end;
 	}
-	fprintf(f, "#%zd\n", samples.size());
+	ctx->done = end > ctx->done ? end : ctx->done;
+
+	std::vector<pthread_t> threads(num_threads);
+	std::vector<vcd_worker_args> args(num_threads);
+	std::atomic<size_t> next_chunk;
 
-	fclose(f);
+	for (size_t k = 0; k < chunks.size(); k += num_threads * VCD_BATCH)
+	{
+		size_t last = k + num_threads * VCD_BATCH < chunks.size() ? k + num_threads * VCD_BATCH : chunks.size();
+		next_chunk = k;
+
+		if (num_threads == 1) {
+			for (size_t j = k; j < last; j++) {
+				vcd_open(&chunks[j].w, NULL);
+				decoders_decode(&ctx->decoders, chunks[j].begin, chunks[j].end, chunks[j].batch);
+				vcd_render(ctx, &chunks[j]);
+			}
+		} else {
+			for (size_t j = k; j < last; j++) {
+				vcd_open(&chunks[j].w, NULL);
+				decoders_copy(&chunks[j].ds, &ctx->decoders);
+				decoders_skip(&ctx->decoders, chunks[j].begin, chunks[j].end);
+			}
+			for (int t = 0; t < num_threads; t++) {
+				args[t].ctx = ctx;
+				args[t].chunks = &chunks;
+				args[t].last = last;
+				args[t].next = &next_chunk;
+				if (t > 0 && pthread_create(&threads[t], NULL, &vcd_worker, &args[t]) != 0) {
+					fprintf(stderr, "Failed to create VCD worker thread.\n");
+					exit(1);
+				}
+			}
+			vcd_worker(&args[0]);
+			for (int t = 1; t < num_threads; t++)
+				pthread_join(threads[t], NULL);
+		}
+
+		for (size_t j = k; j < last; j++) {
+			vcd_output_buffer(ctx, &chunks[j].w);
+			chunks[j].w.buf = std::vector<char>();
+			chunks[j].batch = decode_batch();
+		}
+	}
 }
 
+// In live mode the VCD file (or pipe) is written while the capture is
+// running: readdata() calls writevcd_update() for each block of samples
+// and the new samples are written at most every VCD_LIVE_INTERVAL ms. The
+// reader must keep up with the serial link, so one update writes at most
+// VCD_LIVE_SAMPLES samples. Further behind it goes on with the next block.
+
+#define VCD_LIVE_INTERVAL 200
+#define VCD_LIVE_SAMPLES (4 * VCD_CHUNK)
+
+static struct vcd_context vcd_ctx;
+
+void writevcd_begin(const char *file, bool live)
+{
+	printf("Writing VCD output file `%s'.\n", file);
+
+	// a viewer reading from a pipe may go away during a live capture
+	if (live)
+		signal(SIGPIPE, SIG_IGN);
+
+	vcd_ctx.file = file;
+	vcd_ctx.live = live;
+	vcd_ctx.f = fopen(file, "w");
+	if (vcd_ctx.f == NULL) {
+		fprintf(stderr, "Can't open VCD file `%s': %s\n", file, strerror(errno));
+		exit(1);
+	}
+
+	vcd_ctx.started = false;
+	vcd_ctx.done = 0;
+	gettimeofday(&vcd_ctx.last_update, NULL);
+}
+
+void writevcd_update()
+{
+	if (vcd_ctx.f == NULL || samples.size() == 0)
+		return;
+
+	bool behind = samples.size() - vcd_ctx.done > VCD_LIVE_SAMPLES;
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	if (!behind && (now.tv_sec - vcd_ctx.last_update.tv_sec) * 1000 + (now.tv_usec - vcd_ctx.last_update.tv_usec) / 1000 < VCD_LIVE_INTERVAL)
+		return;
+	vcd_ctx.last_update = now;
+
+	if (!vcd_ctx.started)
+		vcd_header(&vcd_ctx);
+	vcd_advance(&vcd_ctx, behind ? vcd_ctx.done + VCD_LIVE_SAMPLES : samples.size());
+
+	if (vcd_ctx.f != NULL && fflush(vcd_ctx.f) != 0)
+		vcd_write_error(&vcd_ctx);
+}
+
+void writevcd_end()
+{
+	if (!vcd_ctx.started)
+		vcd_header(&vcd_ctx);
+
+	if (samples.size() > 0) {
+		vcd_advance(&vcd_ctx, samples.size());
+		vcd_timestamp(&vcd_ctx.w, vcd_time(samples.size(), 0));
+		vcd_char(&vcd_ctx.w, '\n');
+		vcd_output_buffer(&vcd_ctx, &vcd_ctx.w);
+	}
+
+	decoders_done(&vcd_ctx.decoders);
+
+	FILE *f = vcd_ctx.f;
+	vcd_ctx.f = NULL;
+	if (f != NULL && fclose(f) != 0 && !(vcd_ctx.live && errno == EPIPE)) {
+		fprintf(stderr, "Error writing VCD file `%s': %s\n", vcd_ctx.file, strerror(errno));
+		exit(1);
+	}
+}
+
+void writevcd(const char *file)
+{
+	writevcd_begin(file, false);
+	writevcd_end();
+}